@@ -0,0 +1,82 @@
+#ifndef FRONTIER_HPP
+#define FRONTIER_HPP
+
+#include <map>
+#include <vector>
+
+#include <nav_msgs/OccupancyGrid.h>
+
+#include "player_map/rosmap.hpp"
+
+namespace scarab {
+
+// Inclusive bounding box of the cells that differ between two grids.  Returns
+// false if their size, resolution or origin differ, in which case every cell
+// should be considered changed; an empty box has min > max.
+bool diffGrids(const nav_msgs::OccupancyGrid &a, const nav_msgs::OccupancyGrid &b,
+               int *min_i, int *min_j, int *max_i, int *max_j);
+
+// Frontiers between known free space and unknown space, for exploration.
+// Frontier cells are free cells next to unknown ones, grouped into 8 connected
+// clusters.  Each new grid is compared with the previous one, and only cells
+// and clusters near those that changed are updated.
+class FrontierTracker {
+public:
+  struct Frontier {
+    int size;                // number of cells
+    Eigen::Vector2f centroid;
+    Eigen::Vector2f target;  // cell of the frontier nearest to the centroid
+    double cost;             // cost of the path to target, set by rank()
+  };
+
+  // Thresholds are as in OccupancyMap::setThresholds(); clusters smaller than
+  // min_size cells are ignored
+  FrontierTracker(int free_threshold = 0, int occupied_threshold = 100,
+                  int min_size = 1);
+
+  void update(const nav_msgs::OccupancyGrid &grid);
+  // Frontiers of the last grid
+  std::vector<Frontier> frontiers() const;
+  // Frontiers whose targets can be reached from (x, y) on map, cheapest
+  // first; all are ranked with a single search
+  std::vector<Frontier> rank(OccupancyMap *map, double x, double y,
+                             double max_occ_dist, bool allow_unknown = false,
+                             OccupancyMap::SearchContext *context = NULL) const;
+  // As above, for frontiers from an earlier call to frontiers()
+  static std::vector<Frontier> rank(const std::vector<Frontier> &frontiers,
+                                    OccupancyMap *map, double x, double y,
+                                    double max_occ_dist,
+                                    bool allow_unknown = false,
+                                    OccupancyMap::SearchContext *context = NULL);
+  // Cluster of cell index of the last grid, or -1 if it isn't a frontier
+  // cell; the numbers themselves mean nothing
+  int cluster(int index) const { return label_[index]; }
+
+private:
+  struct Cluster {
+    std::vector<int> cells;
+  };
+
+  bool isFree(int index) const {
+    int value = grid_.data[index];
+    return 0 <= value && value <= free_threshold_;
+  }
+  bool isUnknown(int index) const {
+    int value = grid_.data[index];
+    return !isFree(index) && !(occupied_threshold_ <= value && value <= 100);
+  }
+  bool isFrontier(int i, int j) const;
+  // Recompute frontier cells in the given box, and the clusters near it
+  void updateRegion(int min_i, int min_j, int max_i, int max_j);
+  Frontier summarize(const Cluster &cluster) const;
+
+  int free_threshold_, occupied_threshold_, min_size_;
+  nav_msgs::OccupancyGrid grid_;
+  std::vector<uint8_t> frontier_; // nonzero for frontier cells
+  std::vector<int> label_;        // cluster of each frontier cell, -1 if none
+  std::map<int, Cluster> clusters_;
+  int next_label_;
+};
+
+} // end namespace scarab
+#endif
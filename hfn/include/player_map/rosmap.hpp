@@ -1,11 +1,19 @@
 #ifndef ROSMAP_HPP
 #define ROSMAP_HPP
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
 #include <vector>
 #include <set>
 
+#include <boost/noncopyable.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <Eigen/Core>
 #include <Eigen/Dense>
@@ -20,8 +28,15 @@ typedef std::vector<Eigen::Vector2f, Eigen::aligned_allocator<Eigen::Vector2f> >
 
 double pathLength(const scarab::Path &path);
 
+// The map and everything derived from it live in an immutable snapshot that
+// is replaced atomically (read-copy-update), so queries may run on any number
+// of threads while a new map is built.  Searches keep their scratch space in a
+// SearchContext; each thread searching concurrently needs its own, and methods
+// given no context share one that belongs to the map.
 class OccupancyMap {
 public:
+  class SearchContext;
+
   OccupancyMap();
   ~OccupancyMap();
 
@@ -30,36 +45,42 @@ public:
 
   void setMap(map_t *map);
   void setMap(const nav_msgs::OccupancyGrid &grid);
+  // Build the C-space of grid before replacing the current map, so that
+  // queries never see the new map without it
+  void setMap(const nav_msgs::OccupancyGrid &grid,
+              double max_occ_dist, double lethal_occ_dist,
+              double cost_occ_prob = 0.0, double cost_occ_dist = 0.0);
   void updateCSpace(double max_occ_dist, double lethal_occ_dist,
                     double cost_occ_prob = 0.0, double cost_occ_dist = 0.0);
 
-  nav_msgs::OccupancyGrid getCSpace();
-  nav_msgs::OccupancyGrid getCostMap();
-
-  double minX();
-  double minY();
-  double maxX();
-  double maxY();
-
-  double lethalOccDist() const { return lethal_occ_dist_; }
-  double maxOccDist() const { return max_occ_dist_; }
-
-  const map_cell_t* getCell(double x, double y) const;
-  int coordIndex(double x, double y) const {
-    int xi = MAP_GXWX(map_, x);
-    int yi = MAP_GYWY(map_, y);
-    if (!MAP_VALID(map_, xi, yi)) {
-      return -1;
-    } else {
-      return MAP_INDEX(map_, xi, yi);
-    }
-  }
+  // Live obstacle layer.  Laser returns (hits) seen from (x, y) are added to
+  // the C-space as obstacles; beams clear earlier returns they pass through,
+  // and returns more than window meters from (x, y) are forgotten, so the
+  // layer rolls along with the robot.  Beams that didn't return (misses) only
+  // clear.  Distances and costs are only recomputed near cells that changed,
+  // and cells are never more traversable than in the static map.  Requires
+  // the C-space; replacing the map clears the layer.
+  void updateObstacles(double x, double y, const Path &hits,
+                       const Path &misses, double window);
 
-  int numX() { return map_->size_x; }
-  int numY() { return map_->size_y; }
-  const map_cell_t* at(int xi, int yi) const {
-    return map_->cells + MAP_INDEX(map_, xi, yi);
-  }
+  nav_msgs::OccupancyGrid getCSpace() const;
+  nav_msgs::OccupancyGrid getCostMap() const;
+
+  double minX() const;
+  double minY() const;
+  double maxX() const;
+  double maxY() const;
+
+  double lethalOccDist() const;
+  double maxOccDist() const;
+
+  // Copy the cell containing (x, y); false if it's outside of the map
+  bool getCell(double x, double y, map_cell_t *cell) const;
+  int coordIndex(double x, double y) const;
+
+  int numX() const;
+  int numY() const;
+  map_cell_t at(int xi, int yi) const;
 
   // True if cell is free and far away from obstacles
   bool safePoint(double x, double y) const; // Use lethalOccDist()
@@ -68,7 +89,15 @@ public:
   bool lineOfSight(double x1, double y1, double x2, double y2,
                    double max_occ_dist = 0.0, bool allow_unknown = false) const;
   Path astar(double x1, double y1, double x2, double y2,
-             double max_occ_dist = 0.0, bool allow_unknown = false);
+             double max_occ_dist = 0.0, bool allow_unknown = false,
+             SearchContext *context = NULL);
+  // Same result as astar(), but searches from both ends at once; usually
+  // expands fewer nodes on long paths
+  Path bidirectionalAstar(double x1, double y1, double x2, double y2,
+                          double max_occ_dist = 0.0, bool allow_unknown = false,
+                          SearchContext *context = NULL);
+  // Number of nodes expanded by the last search
+  int expanded(const SearchContext *context = NULL) const;
   bool nearestPoint(double x, double y, double max_occ_dist,
                     double *out_x, double *out_y) const;
   // TODO: Unify these two APIs
@@ -76,55 +105,201 @@ public:
   // Get a list of endpoints
   const Path& prepareShortestPaths(double x, double y, double min_distance,
                                    double max_distance, double max_occ_dist,
-                                   bool allow_unknown = false);
+                                   bool allow_unknown = false,
+                                   SearchContext *context = NULL);
   // Get the path whose endpoint is ind from last call to prepareShortestPaths()
-  Path buildShortestPath(int ind);
+  Path buildShortestPath(int ind, const SearchContext *context = NULL) const;
 
   // Calculate single source shortest paths to all endpoints
   // Returns a vector, element at index i is true if path from dests[i] exists
   // Use buildShortestPath to construct path; index matches point in dests
   void prepareAllShortestPaths(double x, double y, double max_occ_dist,
-                               bool allow_unknown = false);
+                               bool allow_unknown = false,
+                               SearchContext *context = NULL);
   // Get shortest path
-  Path shortestPath(double x, double y);
+  Path shortestPath(double x, double y,
+                    const SearchContext *context = NULL) const;
+
+  // Cost of the cheapest path from (x, y) to each of targets, infinite for
+  // those that can't be reached, in the units of prepareShortestPaths()
+  // distances.  Stops searching once every target has been reached.
+  void pathCosts(double x, double y, const Path &targets, double max_occ_dist,
+                 bool allow_unknown, std::vector<double> *costs,
+                 SearchContext *context = NULL);
 
+  // Calculate the cost to (x, y) from everywhere, so that a robot can follow
+  // it from wherever it ends up without replanning.  Unlike the searches
+  // above, this is kept until the next call, and keeps referring to the map
+  // it was computed on.
+  void prepareNavigationFunction(double x, double y, double max_occ_dist,
+                                 bool allow_unknown = false,
+                                 SearchContext *context = NULL);
+  // Follow the navigation function distance meters downhill from (x, y), or
+  // until the goal is reached.  Returns false if (x, y) can't reach the goal.
+  bool descend(double x, double y, double distance,
+               double *out_x, double *out_y,
+               const SearchContext *context = NULL) const;
+  // Path from (x, y) to the goal of the navigation function, empty if none
+  Path navigationPath(double x, double y,
+                      const SearchContext *context = NULL) const;
+
+  // Settings below take effect the next time the map is replaced
   void setThresholds(int free, int occ);
   void setCostFactors(double occ_prob, double occ_dist);
+  // Use 4 or 8 connected neighborhoods when searching (default 8)
+  void setConnectivity(int connectivity);
+  // Number of landmarks whose distances guide astar(), 0 to use straight line
+  // distance only (default 8, at most kMaxLandmarks).  Distances from each
+  // landmark are computed whenever the C-space is updated.
+  void setLandmarks(int num_landmarks);
+  static const int kMaxLandmarks = 16;
 
 private:
+  // Map and search grid; never modified once published
+  struct Snapshot;
+
   struct Node {
     Node() {}
-    Node(const std::pair<int, int> &c, float d, float h) :
-      coord(c), true_cost(d), heuristic(h) { }
-    std::pair<int, int> coord;
-    float true_cost;
-    float heuristic;
+    Node(int ind, float d, float h) :
+      index(ind), true_cost(d), heuristic(h) { }
+    int index;        // index into the padded search grid
+    float true_cost;  // cost from start
+    float heuristic;  // true_cost + estimated cost to go
   };
 
   struct NodeCompare {
     bool operator()(const Node &lnode, const Node &rnode) {
-      return make_pair(lnode.heuristic, lnode.coord) <
-        make_pair(rnode.heuristic, rnode.coord);
+      return std::make_pair(lnode.heuristic, lnode.index) <
+        std::make_pair(rnode.heuristic, rnode.index);
+    }
+  };
+
+  // Estimates of the cost to go; (i, j) are grid coordinates
+  struct NoHeuristic {
+    float operator()(int i, int j) const { return 0.0; }
+  };
+
+  struct EuclideanHeuristic {
+    EuclideanHeuristic(int i, int j) : stopi(i), stopj(j) { }
+    float operator()(int i, int j) const { return hypotf(i - stopi, j - stopj); }
+    int stopi, stopj;
+  };
+
+  // Average of the distance to one end minus the distance to the other.  The
+  // forward and backward versions are negations of each other, so both
+  // searches of a bidirectional search see the same reduced edge costs
+  // (Ikeda et al.)
+  struct BalancedHeuristic {
+    BalancedHeuristic(int toi, int toj, int fromi, int fromj)
+      : to(toi, toj), from(fromi, fromj) { }
+    float operator()(int i, int j) const { return 0.5 * (to(i, j) - from(i, j)); }
+    EuclideanHeuristic to, from;
+  };
+
+  // Triangle inequality bound from distances to landmarks (ALT, Goldberg and
+  // Harrelson), never less than straight line distance.  Landmark distances
+  // are over every cell that is ever traversable and ignore cell costs, so
+  // they remain lower bounds whatever the search options.
+  struct LandmarkHeuristic {
+    LandmarkHeuristic(const Snapshot *map, int stopi, int stopj);
+    float operator()(int i, int j) const {
+      const uint16_t *d = dist + size_t((i + 1) + (j + 1) * pad_x) * n;
+      int diff = 0;
+      for (int k = 0; k < n; ++k) {
+        diff = std::max(diff, std::abs(int(goal[k]) - int(d[k])));
+      }
+      // Distances are rounded down, so the difference may be one too large
+      return std::max(euclidean(i, j), (diff - 1) * inv_scale);
     }
+    EuclideanHeuristic euclidean;
+    const uint16_t *dist;
+    int pad_x, n;
+    float inv_scale;
+    uint16_t goal[kMaxLandmarks];
   };
 
-  void initializeSearch(double startx, double starty);
-  bool nextNode(double max_occ_dist, Node *curr_node, bool allow_unknown);
-  void addNeighbors(const Node &node, double max_occ_dist, bool allow_unknown);
-  void buildPath(int i, int j, Path *path);
+  // Compile time description of a search; addNeighbors() is instantiated
+  // separately for each combination so its inner loop has no mode checks.
+  // Reverse searches run from the goal, so the cost of entering a cell is
+  // charged when leaving it.
+  template <class H, bool AllowUnknown, int Connectivity, bool Reverse = false>
+  struct SearchPolicy {
+    typedef H Heuristic;
+    static const bool allow_unknown = AllowUnknown;
+    static const int connectivity = Connectivity;
+    static const bool reverse = Reverse;
+  };
+
+  struct SearchState {
+    SearchState() : start(-1), expanded(0), size(0) { }
+    // Map that costs and prev refer to; NULL until the first search
+    boost::shared_ptr<const Snapshot> map;
+    int start;
+    int expanded;
+    int size; // length of costs and prev
+    boost::scoped_array<float> costs;
+    boost::scoped_array<int> prev;
+    // Priority queue mapping cost to index
+    std::set<Node, NodeCompare> Q;
+  };
+
+  // Cheapest path through a node reached by both searches of a
+  // bidirectional search
+  struct Meeting {
+    Meeting(const SearchState *o)
+      : other(o), cost(std::numeric_limits<float>::infinity()), index(-1) { }
+    const SearchState *other;
+    float cost;
+    int index;
+  };
+
+  // Visitors are called on each node as it is removed from the queue and
+  // return false to end the search
+  struct StopAtGoal;
+  struct StopAtTargets;
+  struct CollectEndpoints;
+  struct VisitAll;
+
+  boost::shared_ptr<const Snapshot> snapshot() const;
+  void publish(const boost::shared_ptr<const Snapshot> &snapshot);
+  SearchContext* context(SearchContext *context) const {
+    return context == NULL ? context_.get() : context;
+  }
+  const SearchContext* context(const SearchContext *context) const {
+    return context == NULL ? context_.get() : context;
+  }
+
+  void initializeSearch(const boost::shared_ptr<const Snapshot> &map,
+                        double startx, double starty, SearchContext *context);
+  void initializeSearch(const boost::shared_ptr<const Snapshot> &map,
+                        int start, SearchState *state);
 
-  map_t *map_;
-  int ncells_;
-  int starti_, startj_;
-  int stopi_, stopj_;
+  // Current map; readers take a reference with snapshot() and writers replace
+  // it with publish()
+  boost::shared_ptr<const Snapshot> snapshot_;
+  // Held by writers so that copy, update and publish are atomic
+  boost::mutex write_mutex_;
+  // Snapshot that was replaced by the last updateObstacles(); reused for the
+  // next update once no reader holds it, so the map isn't copied every scan
+  boost::shared_ptr<Snapshot> spare_;
   int max_free_threshold_, min_occupied_threshold_;
-  double max_occ_dist_, lethal_occ_dist_;
-  boost::scoped_array<float> costs_;
-  boost::scoped_array<int> prev_i_;
-  boost::scoped_array<int> prev_j_;
-  // Priority queue mapping cost to index
-  boost::scoped_ptr<std::set<Node, NodeCompare> > Q_;
-  Path endpoints_;
+  int connectivity_;
+  int num_landmarks_;
+
+  boost::scoped_ptr<SearchContext> context_;
+};
+
+class OccupancyMap::SearchContext : boost::noncopyable {
+public:
+  int expanded() const { return forward.expanded + backward.expanded; }
+
+private:
+  friend class OccupancyMap;
+  // Single source searches only use forward
+  SearchState forward, backward;
+  // Search rooted at the goal of prepareNavigationFunction()
+  SearchState navigation;
+  Path endpoints;
 };
 
 } // end namespace scarab
@@ -0,0 +1,154 @@
+// Time each version of convertCells() and computeCosts() on random cells, and
+// check that the vector versions give bit-identical results to the scalar
+// ones.  Grids include values outside of 0-100, thresholds outside of that
+// range, and margins where lethal_occ_dist >= max_occ_dist.  Mismatches are
+// reported, and make the exit status nonzero.
+//
+// usage: cell_bench [cells] [trials]
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "cell_kernels.hpp"
+
+using namespace std;
+using namespace scarab;
+
+typedef void (*ConvertFn)(const int8_t*, int, int, int, map_cell_t*);
+typedef void (*CostFn)(map_cell_t*, int, double, double, double, double);
+
+struct Version {
+  Version(const char *name, ConvertFn convert, CostFn cost)
+    : name(name), convert(convert), cost(cost), convert_time(0.0),
+      cost_time(0.0), mismatches(0) { }
+  const char *name;
+  ConvertFn convert;
+  CostFn cost;
+  double convert_time, cost_time;
+  int mismatches;
+};
+
+// Compare the fields that the kernels write, bit for bit
+bool sameCells(const vector<map_cell_t> &a, const vector<map_cell_t> &b) {
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].occ_state != b[i].occ_state || a[i].occ_prob != b[i].occ_prob ||
+        memcmp(&a[i].occ_dist, &b[i].occ_dist, sizeof(a[i].occ_dist)) ||
+        memcmp(&a[i].cost, &b[i].cost, sizeof(a[i].cost))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Mostly values from a map, with some outside of -1 to 100
+int8_t randomValue() {
+  double r = drand48();
+  if (r < 0.1) {
+    return -1;
+  } else if (r < 0.2) {
+    return int8_t(lrand48() % 256 - 128);
+  }
+  return int8_t(lrand48() % 101);
+}
+
+// Thresholds at and past the ends of the range, as well as within it
+int randomThreshold() {
+  static const int extremes[] = {-1000, -129, -128, -1, 0, 100, 101, 127, 128,
+                                 1000};
+  if (drand48() < 0.5) {
+    return extremes[lrand48() % (sizeof(extremes) / sizeof(extremes[0]))];
+  }
+  return lrand48() % 101;
+}
+
+int main(int argc, char **argv) {
+  int num_cells = argc > 1 ? atoi(argv[1]) : 100003;
+  int trials = argc > 2 ? atoi(argv[2]) : 50;
+
+  vector<Version> versions;
+  versions.push_back(Version("scalar", convertCellsScalar, computeCostsScalar));
+#ifdef CELL_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1")) {
+    versions.push_back(Version("sse4.1", convertCellsSSE4, computeCostsSSE4));
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    versions.push_back(Version("avx2", convertCellsAVX2, computeCostsAVX2));
+  }
+#endif
+
+  vector<int8_t> data(num_cells);
+  vector<int> probs(num_cells);
+  vector<double> dists(num_cells);
+  // Results of the scalar versions, then of the one being checked
+  vector<map_cell_t> converted(num_cells), costed(num_cells), cells(num_cells);
+  srand48(1);
+  for (int trial = 0; trial < trials; ++trial) {
+    for (int i = 0; i < num_cells; ++i) {
+      data[i] = randomValue();
+    }
+    int free_threshold = randomThreshold();
+    int occupied_threshold = randomThreshold();
+    double max_occ_dist = 0.1 + drand48();
+    double lethal_occ_dist = max_occ_dist * drand48();
+    if (trial % 10 == 0) {
+      lethal_occ_dist = max_occ_dist;
+    } else if (trial % 5 == 0) {
+      lethal_occ_dist += max_occ_dist;
+    }
+    double cost_occ_prob = trial % 7 == 0 ? 0.0 : 10.0 * drand48();
+    double cost_occ_dist = trial % 11 == 0 ? 0.0 : 10.0 * drand48();
+    // Distances on both sides of and at both margins, and some out of range
+    // probabilities, as the distance transform and map might leave them
+    for (int i = 0; i < num_cells; ++i) {
+      double r = drand48();
+      dists[i] = r < 0.05 ? lethal_occ_dist :
+        (r < 0.1 ? max_occ_dist : 2.0 * max_occ_dist * drand48());
+      probs[i] = drand48() < 0.05 ? lrand48() % 1000 - 500 : data[i];
+    }
+
+    for (size_t v = 0; v < versions.size(); ++v) {
+      Version &version = versions[v];
+      memset(&cells[0], 0, num_cells * sizeof(map_cell_t));
+      ros::WallTime start = ros::WallTime::now();
+      version.convert(&data[0], num_cells, free_threshold, occupied_threshold,
+                      &cells[0]);
+      ros::WallTime middle = ros::WallTime::now();
+      version.convert_time += (middle - start).toSec();
+      if (v == 0) {
+        converted = cells;
+      } else if (!sameCells(cells, converted)) {
+        ++version.mismatches;
+      }
+
+      for (int i = 0; i < num_cells; ++i) {
+        cells[i].occ_prob = probs[i];
+        cells[i].occ_dist = dists[i];
+      }
+      middle = ros::WallTime::now();
+      version.cost(&cells[0], num_cells, max_occ_dist, lethal_occ_dist,
+                   cost_occ_prob, cost_occ_dist);
+      ros::WallTime end = ros::WallTime::now();
+      version.cost_time += (end - middle).toSec();
+      if (v == 0) {
+        costed = cells;
+      } else if (!sameCells(cells, costed)) {
+        ++version.mismatches;
+      }
+    }
+  }
+
+  int mismatches = 0;
+  ROS_INFO("%i cells, %i trials", num_cells, trials);
+  for (size_t v = 0; v < versions.size(); ++v) {
+    const Version &version = versions[v];
+    ROS_INFO("%-7s convertCells %7.3f ms  computeCosts %7.3f ms  %i/%i differ",
+             version.name, 1000.0 * version.convert_time / trials,
+             1000.0 * version.cost_time / trials, version.mismatches,
+             2 * trials);
+    mismatches += version.mismatches;
+  }
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,308 @@
+#include "cell_kernels.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
+// The vector versions store whole cells, so they depend on the x86-64 layout
+// of map_cell_t
+#ifdef CELL_KERNELS_X86
+#include <immintrin.h>
+// (the anonymous enum in map_cell_t also declares a member, occ_state_t)
+typedef char map_cell_layout_check[(sizeof(map_cell_t) == 32 &&
+                                    offsetof(map_cell_t, occ_state) == 4 &&
+                                    offsetof(map_cell_t, occ_prob) == 8 &&
+                                    offsetof(map_cell_t, occ_dist) == 16 &&
+                                    offsetof(map_cell_t, cost) == 24) ? 1 : -1];
+#endif
+
+namespace scarab {
+
+//============================== Scalar ===================================//
+
+void convertCellsScalar(const int8_t *data, int n, int free_threshold,
+                        int occupied_threshold, map_cell_t *cells) {
+  for (int i = 0; i < n; ++i) {
+    int value = data[i];
+    bool free = 0 <= value && value <= free_threshold;
+    bool occupied = occupied_threshold <= value && value <= 100;
+    cells[i].occ_state = free ? map_cell_t::FREE :
+      (occupied ? map_cell_t::OCCUPIED : map_cell_t::UNKNOWN);
+    cells[i].occ_prob = value;
+    cells[i].occ_dist = 0;
+    cells[i].cost = 0.;
+  }
+}
+
+// The vector versions repeat each rounding to float of this one
+void computeCostsScalar(map_cell_t *cells, int n,
+                        double max_occ_dist, double lethal_occ_dist,
+                        double cost_occ_prob, double cost_occ_dist) {
+  for (int i = 0; i < n; ++i) {
+    const map_cell_t &cell = cells[i];
+    bool known = 0 <= cell.occ_prob && cell.occ_prob <= 100;
+    float cost = 0.0;
+    cost += known ? cost_occ_prob * float(cell.occ_prob) / 100.0 :
+      cost_occ_prob * 0.5;
+    float dist_cost = 1.0 - (cell.occ_dist - lethal_occ_dist) /
+      (max_occ_dist - lethal_occ_dist);
+    cost += cost_occ_dist * dist_cost;
+    bool lethal = cell.occ_state == map_cell_t::OCCUPIED ||
+      cell.occ_dist <= lethal_occ_dist;
+    cells[i].cost = lethal ? std::numeric_limits<float>::infinity() : cost;
+  }
+}
+
+#ifdef CELL_KERNELS_X86
+
+//============================== SSE4.1 ===================================//
+
+// Write 4 cells from 32 bit states and values
+__attribute__((target("sse4.1")))
+static inline void storeCells4(map_cell_t *cells, __m128i state, __m128i value) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_unpacklo_epi32(state, value); // s0 v0 s1 v1
+  __m128i hi = _mm_unpackhi_epi32(state, value); // s2 v2 s3 v3
+  // Each cell is occ_state_t, occ_state, occ_prob and padding, then
+  // occ_dist, cost and padding
+  _mm_storeu_si128((__m128i*)(cells + 0), _mm_slli_si128(_mm_move_epi64(lo), 4));
+  _mm_storeu_si128((__m128i*)&cells[0].occ_dist, zero);
+  _mm_storeu_si128((__m128i*)(cells + 1), _mm_slli_si128(_mm_srli_si128(lo, 8), 4));
+  _mm_storeu_si128((__m128i*)&cells[1].occ_dist, zero);
+  _mm_storeu_si128((__m128i*)(cells + 2), _mm_slli_si128(_mm_move_epi64(hi), 4));
+  _mm_storeu_si128((__m128i*)&cells[2].occ_dist, zero);
+  _mm_storeu_si128((__m128i*)(cells + 3), _mm_slli_si128(_mm_srli_si128(hi, 8), 4));
+  _mm_storeu_si128((__m128i*)&cells[3].occ_dist, zero);
+}
+
+// Write 16 cells from 8 bit states and values
+__attribute__((target("sse4.1")))
+static inline void storeCells16(map_cell_t *cells, __m128i state, __m128i value) {
+  storeCells4(cells, _mm_cvtepu8_epi32(state), _mm_cvtepi8_epi32(value));
+  storeCells4(cells + 4, _mm_cvtepu8_epi32(_mm_srli_si128(state, 4)),
+              _mm_cvtepi8_epi32(_mm_srli_si128(value, 4)));
+  storeCells4(cells + 8, _mm_cvtepu8_epi32(_mm_srli_si128(state, 8)),
+              _mm_cvtepi8_epi32(_mm_srli_si128(value, 8)));
+  storeCells4(cells + 12, _mm_cvtepu8_epi32(_mm_srli_si128(state, 12)),
+              _mm_cvtepi8_epi32(_mm_srli_si128(value, 12)));
+}
+
+// Thresholds are clamped to the range of int8_t, which doesn't change the
+// outcome of any comparison with a grid value
+static inline int8_t clampThreshold(int threshold) {
+  return std::max(-128, std::min(127, threshold));
+}
+
+__attribute__((target("sse4.1")))
+void convertCellsSSE4(const int8_t *data, int n, int free_threshold,
+                      int occupied_threshold, map_cell_t *cells) {
+  const __m128i ones = _mm_set1_epi8(-1);
+  const __m128i free_max = _mm_set1_epi8(clampThreshold(free_threshold));
+  const __m128i occupied_min = _mm_set1_epi8(clampThreshold(occupied_threshold));
+  const __m128i hundred = _mm_set1_epi8(100);
+  const __m128i free = _mm_set1_epi8(map_cell_t::FREE);
+  const __m128i occupied = _mm_set1_epi8(map_cell_t::OCCUPIED);
+  const __m128i unknown = _mm_set1_epi8(map_cell_t::UNKNOWN);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i value = _mm_loadu_si128((const __m128i*)(data + i));
+    // 0 <= value <= free_threshold
+    __m128i is_free = _mm_andnot_si128(_mm_cmpgt_epi8(value, free_max),
+                                       _mm_cmpgt_epi8(value, ones));
+    // occupied_threshold <= value <= 100
+    __m128i is_occupied =
+      _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi8(occupied_min, value),
+                                    _mm_cmpgt_epi8(value, hundred)), ones);
+    __m128i state = _mm_blendv_epi8(unknown, occupied, is_occupied);
+    state = _mm_blendv_epi8(state, free, is_free);
+    storeCells16(cells + i, state, value);
+  }
+  convertCellsScalar(data + i, n - i, free_threshold, occupied_threshold,
+                     cells + i);
+}
+
+__attribute__((target("sse4.1")))
+void computeCostsSSE4(map_cell_t *cells, int n,
+                      double max_occ_dist, double lethal_occ_dist,
+                      double cost_occ_prob, double cost_occ_dist) {
+  const __m128i ones = _mm_set1_epi32(-1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i hundred = _mm_set1_epi32(100);
+  const __m128i occupied = _mm_set1_epi32(map_cell_t::OCCUPIED);
+  const __m128d lethal_dist = _mm_set1_pd(lethal_occ_dist);
+  const __m128d dist_range = _mm_set1_pd(max_occ_dist - lethal_occ_dist);
+  const __m128d prob_factor = _mm_set1_pd(cost_occ_prob);
+  const __m128d unknown_cost = _mm_set1_pd(cost_occ_prob * 0.5);
+  const __m128d dist_factor = _mm_set1_pd(cost_occ_dist);
+  const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    map_cell_t *c = cells + i;
+    __m128i state = _mm_set_epi32(0, 0, c[1].occ_state, c[0].occ_state);
+    __m128i prob = _mm_set_epi32(0, 0, c[1].occ_prob, c[0].occ_prob);
+    __m128d dist = _mm_set_pd(c[1].occ_dist, c[0].occ_dist);
+
+    // 0 <= occ_prob <= 100; masks are widened to 64 bits by sign extension
+    __m128i known32 = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(zero, prob),
+                                                    _mm_cmpgt_epi32(prob, hundred)),
+                                       ones);
+    __m128d known = _mm_castsi128_pd(_mm_cvtepi32_epi64(known32));
+    __m128d prob_d = _mm_cvtps_pd(_mm_cvtepi32_ps(prob));
+    __m128d prob_cost = _mm_blendv_pd(unknown_cost,
+                                      _mm_div_pd(_mm_mul_pd(prob_factor, prob_d),
+                                                 _mm_set1_pd(100.0)),
+                                      known);
+    __m128d cost = _mm_cvtps_pd(_mm_cvtpd_ps(_mm_add_pd(_mm_setzero_pd(),
+                                                        prob_cost)));
+    __m128d dist_cost =
+      _mm_sub_pd(_mm_set1_pd(1.0),
+                 _mm_div_pd(_mm_sub_pd(dist, lethal_dist), dist_range));
+    dist_cost = _mm_cvtps_pd(_mm_cvtpd_ps(dist_cost));
+    cost = _mm_add_pd(cost, _mm_mul_pd(dist_factor, dist_cost));
+
+    __m128d lethal =
+      _mm_or_pd(_mm_castsi128_pd(_mm_cvtepi32_epi64(_mm_cmpeq_epi32(state, occupied))),
+                _mm_cmple_pd(dist, lethal_dist));
+    __m128 result = _mm_cvtpd_ps(_mm_blendv_pd(cost, inf, lethal));
+    _mm_store_ss(&c[0].cost, result);
+    _mm_store_ss(&c[1].cost, _mm_shuffle_ps(result, result, 1));
+  }
+  computeCostsScalar(cells + i, n - i, max_occ_dist, lethal_occ_dist,
+                     cost_occ_prob, cost_occ_dist);
+}
+
+//=============================== AVX2 ====================================//
+
+__attribute__((target("avx2")))
+void convertCellsAVX2(const int8_t *data, int n, int free_threshold,
+                      int occupied_threshold, map_cell_t *cells) {
+  const __m256i ones = _mm256_set1_epi8(-1);
+  const __m256i free_max = _mm256_set1_epi8(clampThreshold(free_threshold));
+  const __m256i occupied_min =
+    _mm256_set1_epi8(clampThreshold(occupied_threshold));
+  const __m256i hundred = _mm256_set1_epi8(100);
+  const __m256i free = _mm256_set1_epi8(map_cell_t::FREE);
+  const __m256i occupied = _mm256_set1_epi8(map_cell_t::OCCUPIED);
+  const __m256i unknown = _mm256_set1_epi8(map_cell_t::UNKNOWN);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i value = _mm256_loadu_si256((const __m256i*)(data + i));
+    __m256i is_free = _mm256_andnot_si256(_mm256_cmpgt_epi8(value, free_max),
+                                          _mm256_cmpgt_epi8(value, ones));
+    __m256i is_occupied =
+      _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpgt_epi8(occupied_min, value),
+                                          _mm256_cmpgt_epi8(value, hundred)),
+                          ones);
+    __m256i state = _mm256_blendv_epi8(unknown, occupied, is_occupied);
+    state = _mm256_blendv_epi8(state, free, is_free);
+    storeCells16(cells + i, _mm256_castsi256_si128(state),
+                 _mm256_castsi256_si128(value));
+    storeCells16(cells + i + 16, _mm256_extracti128_si256(state, 1),
+                 _mm256_extracti128_si256(value, 1));
+  }
+  convertCellsScalar(data + i, n - i, free_threshold, occupied_threshold,
+                     cells + i);
+}
+
+__attribute__((target("avx2")))
+void computeCostsAVX2(map_cell_t *cells, int n,
+                      double max_occ_dist, double lethal_occ_dist,
+                      double cost_occ_prob, double cost_occ_dist) {
+  // Cells are 32 bytes apart; gather 4 at a time
+  const __m128i int_stride = _mm_setr_epi32(0, 8, 16, 24);
+  const __m128i double_stride = _mm_setr_epi32(0, 4, 8, 12);
+  const __m128i ones = _mm_set1_epi32(-1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i hundred = _mm_set1_epi32(100);
+  const __m128i occupied = _mm_set1_epi32(map_cell_t::OCCUPIED);
+  const __m256d lethal_dist = _mm256_set1_pd(lethal_occ_dist);
+  const __m256d dist_range = _mm256_set1_pd(max_occ_dist - lethal_occ_dist);
+  const __m256d prob_factor = _mm256_set1_pd(cost_occ_prob);
+  const __m256d unknown_cost = _mm256_set1_pd(cost_occ_prob * 0.5);
+  const __m256d dist_factor = _mm256_set1_pd(cost_occ_dist);
+  const __m256d inf = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    map_cell_t *c = cells + i;
+    __m128i state = _mm_i32gather_epi32(&c->occ_state, int_stride, 4);
+    __m128i prob = _mm_i32gather_epi32(&c->occ_prob, int_stride, 4);
+    __m256d dist = _mm256_i32gather_pd(&c->occ_dist, double_stride, 8);
+
+    __m128i known32 = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi32(zero, prob),
+                                                    _mm_cmpgt_epi32(prob, hundred)),
+                                       ones);
+    __m256d known = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(known32));
+    __m256d prob_d = _mm256_cvtps_pd(_mm_cvtepi32_ps(prob));
+    __m256d prob_cost =
+      _mm256_blendv_pd(unknown_cost,
+                       _mm256_div_pd(_mm256_mul_pd(prob_factor, prob_d),
+                                     _mm256_set1_pd(100.0)),
+                       known);
+    __m256d cost =
+      _mm256_cvtps_pd(_mm256_cvtpd_ps(_mm256_add_pd(_mm256_setzero_pd(),
+                                                    prob_cost)));
+    __m256d dist_cost =
+      _mm256_sub_pd(_mm256_set1_pd(1.0),
+                    _mm256_div_pd(_mm256_sub_pd(dist, lethal_dist), dist_range));
+    dist_cost = _mm256_cvtps_pd(_mm256_cvtpd_ps(dist_cost));
+    cost = _mm256_add_pd(cost, _mm256_mul_pd(dist_factor, dist_cost));
+
+    __m256d lethal =
+      _mm256_or_pd(_mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_cmpeq_epi32(state, occupied))),
+                   _mm256_cmp_pd(dist, lethal_dist, _CMP_LE_OQ));
+    __m128 result = _mm256_cvtpd_ps(_mm256_blendv_pd(cost, inf, lethal));
+    _mm_store_ss(&c[0].cost, result);
+    _mm_store_ss(&c[1].cost, _mm_shuffle_ps(result, result, 1));
+    _mm_store_ss(&c[2].cost, _mm_shuffle_ps(result, result, 2));
+    _mm_store_ss(&c[3].cost, _mm_shuffle_ps(result, result, 3));
+  }
+  computeCostsScalar(cells + i, n - i, max_occ_dist, lethal_occ_dist,
+                     cost_occ_prob, cost_occ_dist);
+}
+
+#endif // CELL_KERNELS_X86
+
+//============================= Dispatch ==================================//
+
+void convertCells(const int8_t *data, int n, int free_threshold,
+                  int occupied_threshold, map_cell_t *cells) {
+#ifdef CELL_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    convertCellsAVX2(data, n, free_threshold, occupied_threshold, cells);
+    return;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    convertCellsSSE4(data, n, free_threshold, occupied_threshold, cells);
+    return;
+  }
+#endif
+  convertCellsScalar(data, n, free_threshold, occupied_threshold, cells);
+}
+
+void computeCosts(map_cell_t *cells, int n,
+                  double max_occ_dist, double lethal_occ_dist,
+                  double cost_occ_prob, double cost_occ_dist) {
+  // Every cell is lethal without a margin between lethal and max distance
+  if (!(lethal_occ_dist < max_occ_dist)) {
+    for (int i = 0; i < n; ++i) {
+      cells[i].cost = std::numeric_limits<float>::infinity();
+    }
+    return;
+  }
+#ifdef CELL_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    computeCostsAVX2(cells, n, max_occ_dist, lethal_occ_dist,
+                     cost_occ_prob, cost_occ_dist);
+    return;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    computeCostsSSE4(cells, n, max_occ_dist, lethal_occ_dist,
+                     cost_occ_prob, cost_occ_dist);
+    return;
+  }
+#endif
+  computeCostsScalar(cells, n, max_occ_dist, lethal_occ_dist,
+                     cost_occ_prob, cost_occ_dist);
+}
+
+} // end namespace scarab
@@ -0,0 +1,48 @@
+#ifndef CELL_KERNELS_HPP
+#define CELL_KERNELS_HPP
+
+#include <stdint.h>
+
+#include "player_map/map.h"
+
+namespace scarab {
+
+// Per cell passes over Player maps.  Each has AVX2 and SSE4.1 versions that
+// are picked at runtime on x86, and a scalar version used everywhere else;
+// all of them give bit-identical results.
+
+// Initialize n cells from occupancy grid values (0-100, -1 = unknown)
+void convertCells(const int8_t *data, int n, int free_threshold,
+                  int occupied_threshold, map_cell_t *cells);
+
+// Set the cost of n cells from their occupancy state, probability and
+// distance to obstacles (see OccupancyMap::updateCSpace())
+void computeCosts(map_cell_t *cells, int n,
+                  double max_occ_dist, double lethal_occ_dist,
+                  double cost_occ_prob, double cost_occ_dist);
+
+// The versions picked between above, for comparing them (see cell_bench).
+// The vector versions must only be called if the CPU supports them; none of
+// them special case lethal_occ_dist >= max_occ_dist like computeCosts() does.
+void convertCellsScalar(const int8_t *data, int n, int free_threshold,
+                        int occupied_threshold, map_cell_t *cells);
+void computeCostsScalar(map_cell_t *cells, int n,
+                        double max_occ_dist, double lethal_occ_dist,
+                        double cost_occ_prob, double cost_occ_dist);
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CELL_KERNELS_X86
+void convertCellsSSE4(const int8_t *data, int n, int free_threshold,
+                      int occupied_threshold, map_cell_t *cells);
+void computeCostsSSE4(map_cell_t *cells, int n,
+                      double max_occ_dist, double lethal_occ_dist,
+                      double cost_occ_prob, double cost_occ_dist);
+void convertCellsAVX2(const int8_t *data, int n, int free_threshold,
+                      int occupied_threshold, map_cell_t *cells);
+void computeCostsAVX2(map_cell_t *cells, int n,
+                      double max_occ_dist, double lethal_occ_dist,
+                      double cost_occ_prob, double cost_occ_dist);
+#endif
+
+} // end namespace scarab
+#endif
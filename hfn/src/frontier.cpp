@@ -0,0 +1,233 @@
+#include "player_map/frontier.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+
+#include <ros/ros.h>
+
+using namespace std;
+namespace scarab {
+
+bool diffGrids(const nav_msgs::OccupancyGrid &a, const nav_msgs::OccupancyGrid &b,
+               int *min_i, int *min_j, int *max_i, int *max_j) {
+  const nav_msgs::MapMetaData &ia = a.info, &ib = b.info;
+  if (ia.width != ib.width || ia.height != ib.height ||
+      ia.resolution != ib.resolution ||
+      ia.origin.position.x != ib.origin.position.x ||
+      ia.origin.position.y != ib.origin.position.y ||
+      a.data.size() != b.data.size() ||
+      a.data.size() != size_t(ia.width) * ia.height) {
+    return false;
+  }
+
+  int width = ia.width, height = ia.height;
+  *min_i = width;
+  *min_j = height;
+  *max_i = -1;
+  *max_j = -1;
+  // Most rows are usually unchanged, and memcmp() finds those quickly
+  for (int j = 0; j < height; ++j) {
+    const int8_t *ra = &a.data[j * width], *rb = &b.data[j * width];
+    if (memcmp(ra, rb, width) == 0) {
+      continue;
+    }
+    int first = 0, last = width - 1;
+    while (ra[first] == rb[first]) {
+      ++first;
+    }
+    while (ra[last] == rb[last]) {
+      --last;
+    }
+    *min_i = min(*min_i, first);
+    *max_i = max(*max_i, last);
+    *min_j = min(*min_j, j);
+    *max_j = j;
+  }
+  return true;
+}
+
+FrontierTracker::FrontierTracker(int free_threshold, int occupied_threshold,
+                                 int min_size)
+  : free_threshold_(free_threshold), occupied_threshold_(occupied_threshold),
+    min_size_(min_size), next_label_(0) {
+}
+
+void FrontierTracker::update(const nav_msgs::OccupancyGrid &grid) {
+  int min_i, min_j, max_i, max_j;
+  bool same = !grid_.data.empty() &&
+    diffGrids(grid_, grid, &min_i, &min_j, &max_i, &max_j);
+  grid_ = grid;
+  int width = grid_.info.width, height = grid_.info.height;
+  if (grid_.data.size() != size_t(width) * height) {
+    ROS_WARN("FrontierTracker::update() Grid has %zu cells, expected %i x %i",
+             grid_.data.size(), width, height);
+    grid_.data.clear();
+    frontier_.clear();
+    label_.clear();
+    clusters_.clear();
+    return;
+  }
+
+  if (!same) {
+    frontier_.assign(width * height, 0);
+    label_.assign(width * height, -1);
+    clusters_.clear();
+    updateRegion(0, 0, width - 1, height - 1);
+  } else if (min_i <= max_i) {
+    // A cell is a frontier because of its neighbors, so those of changed
+    // cells may change too
+    updateRegion(max(min_i - 1, 0), max(min_j - 1, 0),
+                 min(max_i + 1, width - 1), min(max_j + 1, height - 1));
+  }
+}
+
+bool FrontierTracker::isFrontier(int i, int j) const {
+  int width = grid_.info.width, height = grid_.info.height;
+  int index = i + j * width;
+  if (!isFree(index)) {
+    return false;
+  }
+  return (i > 0 && isUnknown(index - 1)) ||
+    (i + 1 < width && isUnknown(index + 1)) ||
+    (j > 0 && isUnknown(index - width)) ||
+    (j + 1 < height && isUnknown(index + width));
+}
+
+void FrontierTracker::updateRegion(int min_i, int min_j, int max_i, int max_j) {
+  int width = grid_.info.width, height = grid_.info.height;
+  for (int j = min_j; j <= max_j; ++j) {
+    for (int i = min_i; i <= max_i; ++i) {
+      frontier_[i + j * width] = isFrontier(i, j);
+    }
+  }
+
+  // Clusters with a cell in or next to the region may have split, merged or
+  // shrunk, so they're taken apart and rebuilt along with the new frontier
+  // cells.  Clusters further away can't touch any cell that changed.
+  vector<int> seeds;
+  set<int> dissolved;
+  for (int j = max(min_j - 1, 0); j <= min(max_j + 1, height - 1); ++j) {
+    for (int i = max(min_i - 1, 0); i <= min(max_i + 1, width - 1); ++i) {
+      int label = label_[i + j * width];
+      if (label >= 0 && dissolved.insert(label).second) {
+        vector<int> &cells = clusters_[label].cells;
+        for (size_t k = 0; k < cells.size(); ++k) {
+          label_[cells[k]] = -1;
+        }
+        seeds.insert(seeds.end(), cells.begin(), cells.end());
+        clusters_.erase(label);
+      }
+    }
+  }
+  for (int j = min_j; j <= max_j; ++j) {
+    for (int i = min_i; i <= max_i; ++i) {
+      seeds.push_back(i + j * width);
+    }
+  }
+
+  vector<int> stack;
+  for (size_t k = 0; k < seeds.size(); ++k) {
+    if (!frontier_[seeds[k]] || label_[seeds[k]] >= 0) {
+      continue;
+    }
+    int label = next_label_++;
+    Cluster &cluster = clusters_[label];
+    label_[seeds[k]] = label;
+    stack.push_back(seeds[k]);
+    while (!stack.empty()) {
+      int index = stack.back();
+      stack.pop_back();
+      cluster.cells.push_back(index);
+      int ci = index % width, cj = index / width;
+      for (int j = max(cj - 1, 0); j <= min(cj + 1, height - 1); ++j) {
+        for (int i = max(ci - 1, 0); i <= min(ci + 1, width - 1); ++i) {
+          int n = i + j * width;
+          if (frontier_[n] && label_[n] < 0) {
+            label_[n] = label;
+            stack.push_back(n);
+          }
+        }
+      }
+    }
+  }
+}
+
+FrontierTracker::Frontier FrontierTracker::summarize(const Cluster &cluster) const {
+  int width = grid_.info.width;
+  double resolution = grid_.info.resolution;
+  // Same cell coordinates as OccupancyMap
+  Eigen::Vector2f origin(grid_.info.origin.position.x,
+                         grid_.info.origin.position.y);
+
+  Frontier frontier;
+  frontier.size = cluster.cells.size();
+  frontier.cost = 0.0;
+  Eigen::Vector2f sum(0.0, 0.0);
+  for (size_t k = 0; k < cluster.cells.size(); ++k) {
+    sum += Eigen::Vector2f(cluster.cells[k] % width, cluster.cells[k] / width);
+  }
+  frontier.centroid = origin + sum * resolution / frontier.size;
+
+  // The centroid of a curved frontier may not be on it
+  float best = numeric_limits<float>::infinity();
+  for (size_t k = 0; k < cluster.cells.size(); ++k) {
+    Eigen::Vector2f p = origin + resolution *
+      Eigen::Vector2f(cluster.cells[k] % width, cluster.cells[k] / width);
+    float dist = (p - frontier.centroid).squaredNorm();
+    if (dist < best) {
+      best = dist;
+      frontier.target = p;
+    }
+  }
+  return frontier;
+}
+
+vector<FrontierTracker::Frontier> FrontierTracker::frontiers() const {
+  vector<Frontier> result;
+  for (map<int, Cluster>::const_iterator it = clusters_.begin();
+       it != clusters_.end(); ++it) {
+    if (int(it->second.cells.size()) >= min_size_) {
+      result.push_back(summarize(it->second));
+    }
+  }
+  return result;
+}
+
+static bool cheaper(const FrontierTracker::Frontier &a,
+                    const FrontierTracker::Frontier &b) {
+  return a.cost < b.cost;
+}
+
+vector<FrontierTracker::Frontier>
+FrontierTracker::rank(OccupancyMap *map, double x, double y,
+                      double max_occ_dist, bool allow_unknown,
+                      OccupancyMap::SearchContext *context) const {
+  return rank(frontiers(), map, x, y, max_occ_dist, allow_unknown, context);
+}
+
+vector<FrontierTracker::Frontier>
+FrontierTracker::rank(const vector<Frontier> &frontiers, OccupancyMap *map,
+                      double x, double y, double max_occ_dist,
+                      bool allow_unknown, OccupancyMap::SearchContext *context) {
+  vector<Frontier> all(frontiers), reachable;
+  if (all.empty()) {
+    return reachable;
+  }
+  Path targets;
+  for (size_t k = 0; k < all.size(); ++k) {
+    targets.push_back(all[k].target);
+  }
+  vector<double> costs;
+  map->pathCosts(x, y, targets, max_occ_dist, allow_unknown, &costs, context);
+  for (size_t k = 0; k < all.size(); ++k) {
+    if (!isinf(costs[k])) {
+      all[k].cost = costs[k];
+      reachable.push_back(all[k]);
+    }
+  }
+  sort(reachable.begin(), reachable.end(), cheaper);
+  return reachable;
+}
+
+} // end namespace scarab
@@ -0,0 +1,217 @@
+// Time FrontierTracker::update() on a grid that changes a few rectangles at a
+// time, as a map being explored does, and check after every update that its
+// frontier cells and clusters are the ones found from scratch.  Now and then
+// the grid is resized or moved, which makes the tracker start over.
+// Mismatches are reported, and make the exit status nonzero.
+//
+// usage: frontier_bench [width] [height] [updates]
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "player_map/frontier.hpp"
+
+using namespace std;
+using namespace scarab;
+
+static const int kFreeThreshold = 20;
+static const int kOccupiedThreshold = 65;
+static const int kMinSize = 3;
+
+// A value that is free, occupied or unknown; values between the thresholds,
+// and outside of 0-100, are unknown too
+int8_t randomValue() {
+  double r = drand48();
+  if (r < 0.35) {
+    return int8_t(lrand48() % (kFreeThreshold + 1));
+  } else if (r < 0.6) {
+    return -1;
+  } else if (r < 0.85) {
+    return int8_t(kOccupiedThreshold + lrand48() % (101 - kOccupiedThreshold));
+  } else if (r < 0.95) {
+    return int8_t(kFreeThreshold + 1 + lrand48() %
+                  (kOccupiedThreshold - kFreeThreshold - 1));
+  }
+  return int8_t(lrand48() % 256 - 128);
+}
+
+// Fill a random rectangle, which may run off the edges of the grid
+void randomRectangle(nav_msgs::OccupancyGrid *grid) {
+  int width = grid->info.width, height = grid->info.height;
+  int w = 1 + lrand48() % 20, h = 1 + lrand48() % 20;
+  int i0 = lrand48() % (width + w) - w, j0 = lrand48() % (height + h) - h;
+  int8_t value = randomValue();
+  // Sometimes only unknown cells are uncovered, as exploring does
+  bool explore = drand48() < 0.3;
+  for (int j = max(j0, 0); j < min(j0 + h, height); ++j) {
+    for (int i = max(i0, 0); i < min(i0 + w, width); ++i) {
+      int8_t &cell = grid->data[i + j * width];
+      if (!explore || cell == -1) {
+        cell = value;
+      }
+    }
+  }
+}
+
+void newGrid(int width, int height, nav_msgs::OccupancyGrid *grid) {
+  grid->info.width = width;
+  grid->info.height = height;
+  grid->info.resolution = 0.05;
+  grid->info.origin.position.x = -0.05 * (lrand48() % 100);
+  grid->info.origin.position.y = -0.05 * (lrand48() % 100);
+  grid->data.assign(width * height, -1);
+  for (int k = 0; k < width * height / 50; ++k) {
+    randomRectangle(grid);
+  }
+}
+
+bool isFree(int value) {
+  return 0 <= value && value <= kFreeThreshold;
+}
+
+bool isUnknown(int value) {
+  return !isFree(value) && !(kOccupiedThreshold <= value && value <= 100);
+}
+
+// Label each frontier cell of grid with its 8 connected cluster, and every
+// other cell with -1; returns the size of each cluster
+vector<int> findFrontiers(const nav_msgs::OccupancyGrid &grid,
+                          vector<int> *label) {
+  int width = grid.info.width, height = grid.info.height;
+  const vector<int8_t> &data = grid.data;
+  vector<bool> frontier(width * height, false);
+  for (int j = 0; j < height; ++j) {
+    for (int i = 0; i < width; ++i) {
+      int index = i + j * width;
+      frontier[index] = isFree(data[index]) &&
+        ((i > 0 && isUnknown(data[index - 1])) ||
+         (i + 1 < width && isUnknown(data[index + 1])) ||
+         (j > 0 && isUnknown(data[index - width])) ||
+         (j + 1 < height && isUnknown(data[index + width])));
+    }
+  }
+
+  vector<int> sizes;
+  label->assign(width * height, -1);
+  vector<int> stack;
+  for (int start = 0; start < width * height; ++start) {
+    if (!frontier[start] || label->at(start) >= 0) {
+      continue;
+    }
+    int cluster = sizes.size();
+    sizes.push_back(0);
+    label->at(start) = cluster;
+    stack.push_back(start);
+    while (!stack.empty()) {
+      int index = stack.back();
+      stack.pop_back();
+      ++sizes[cluster];
+      int ci = index % width, cj = index / width;
+      for (int j = max(cj - 1, 0); j <= min(cj + 1, height - 1); ++j) {
+        for (int i = max(ci - 1, 0); i <= min(ci + 1, width - 1); ++i) {
+          int n = i + j * width;
+          if (frontier[n] && label->at(n) < 0) {
+            label->at(n) = cluster;
+            stack.push_back(n);
+          }
+        }
+      }
+    }
+  }
+  return sizes;
+}
+
+// True if tracker has the same frontier cells as label, grouped the same way,
+// and reports the clusters of at least kMinSize cells
+bool sameFrontiers(const FrontierTracker &tracker, const vector<int> &label,
+                   const vector<int> &sizes) {
+  // Tracker clusters map one to one onto those found from scratch
+  map<int, int> to_expected, to_tracker;
+  for (size_t index = 0; index < label.size(); ++index) {
+    int expected = label[index], found = tracker.cluster(index);
+    if ((expected < 0) != (found < 0)) {
+      return false;
+    }
+    if (expected < 0) {
+      continue;
+    }
+    int mapped = to_expected.insert(make_pair(found, expected)).first->second;
+    int back = to_tracker.insert(make_pair(expected, found)).first->second;
+    if (mapped != expected || back != found) {
+      return false;
+    }
+  }
+
+  vector<int> expected_sizes, found_sizes;
+  for (size_t k = 0; k < sizes.size(); ++k) {
+    if (sizes[k] >= kMinSize) {
+      expected_sizes.push_back(sizes[k]);
+    }
+  }
+  vector<FrontierTracker::Frontier> frontiers = tracker.frontiers();
+  for (size_t k = 0; k < frontiers.size(); ++k) {
+    found_sizes.push_back(frontiers[k].size);
+  }
+  sort(expected_sizes.begin(), expected_sizes.end());
+  sort(found_sizes.begin(), found_sizes.end());
+  return expected_sizes == found_sizes;
+}
+
+int main(int argc, char **argv) {
+  int width = argc > 1 ? atoi(argv[1]) : 400;
+  int height = argc > 2 ? atoi(argv[2]) : 300;
+  int updates = argc > 3 ? atoi(argv[3]) : 2000;
+
+  srand48(1);
+  nav_msgs::OccupancyGrid grid;
+  newGrid(width, height, &grid);
+  FrontierTracker tracker(kFreeThreshold, kOccupiedThreshold, kMinSize);
+  double update_time = 0.0, full_time = 0.0;
+  int mismatches = 0, restarts = 0;
+  vector<int> label;
+  for (int update = 0; update < updates; ++update) {
+    double r = drand48();
+    if (r < 0.01) {
+      // A map that grew, or moved
+      int w = max(1, width + int(lrand48() % 21) - 10);
+      int h = max(1, height + int(lrand48() % 21) - 10);
+      newGrid(w, h, &grid);
+      ++restarts;
+    } else if (r < 0.05) {
+      // Unchanged
+    } else {
+      int edits = 1 + lrand48() % 4;
+      for (int k = 0; k < edits; ++k) {
+        randomRectangle(&grid);
+      }
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    tracker.update(grid);
+    ros::WallTime middle = ros::WallTime::now();
+    FrontierTracker full(kFreeThreshold, kOccupiedThreshold, kMinSize);
+    full.update(grid);
+    ros::WallTime end = ros::WallTime::now();
+    update_time += (middle - start).toSec();
+    full_time += (end - middle).toSec();
+
+    vector<int> sizes = findFrontiers(grid, &label);
+    if (!sameFrontiers(tracker, label, sizes)) {
+      if (mismatches < 10) {
+        ROS_ERROR("Update %i: frontiers differ from those found from scratch",
+                  update);
+      }
+      ++mismatches;
+    }
+  }
+
+  ROS_INFO("%i x %i cells, %i updates, %i restarts", width, height, updates,
+           restarts);
+  ROS_INFO("update() %7.3f ms  from scratch %7.3f ms  %i/%i differ",
+           1000.0 * update_time / updates, 1000.0 * full_time / updates,
+           mismatches, updates);
+  return mismatches == 0 ? 0 : 1;
+}
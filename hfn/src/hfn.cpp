@@ -1,4 +1,5 @@
 #include "hfn.hpp"
+#include "tour.hpp"
 
 #include <tf/tf.h>
 #include <nav_msgs/Path.h>
@@ -20,12 +21,35 @@ double linear_distance(const geometry_msgs::Pose &start,
                start.position.y - stop.position.y);
 }
 
+// Publishers aren't advertised when HFNWrapper isn't connected
+template <class M>
+void publish(const ros::Publisher &pub, const M &msg) {
+  if (pub) {
+    pub.publish(msg);
+  }
+}
+
 double ang_distance(const geometry_msgs::Pose &start,
                     const geometry_msgs::Pose &stop) {
   return fabs(angles::shortest_angular_distance(tf::getYaw(start.orientation),
                                                 tf::getYaw(stop.orientation)));
 }
 
+// Calls a function from a callback queue
+class FunctionCallback : public ros::CallbackInterface {
+public:
+  explicit FunctionCallback(const boost::function<void()> &function)
+    : function_(function) {}
+
+  CallResult call() {
+    function_();
+    return Success;
+  }
+
+private:
+  boost::function<void()> function_;
+};
+
 //=========================== HumanFriendlyNav ============================//
 namespace scarab {
 
@@ -364,13 +388,26 @@ void HumanFriendlyNav::twistToWheelVel(const geometry_msgs::Twist &twist,
 //=============================== HFNWrapper ================================//
 
 
-HFNWrapper::HFNWrapper(const Params &params, HumanFriendlyNav *hfn) :
-  active_(false), turning_(false), map_(new scarab::OccupancyMap()),
-  params_(params), hfn_(hfn) {
+HFNWrapper::HFNWrapper(const Params &params, HumanFriendlyNav *hfn,
+                       bool connect) :
+  connected_(connect), active_(false), flow_leg_(0), plan_count_(0),
+  goal_count_(0), reserving_(false), map_(new scarab::OccupancyMap()),
+  frontier_tracker_(params.free_threshold, params.occupied_threshold,
+                    params.min_frontier_size),
+  params_(params), hfn_(hfn), deadline_misses_(0),
+  have_pending_map_(false), shutdown_(false), replan_queued_(false) {
   flags_.have_pose = false;
   flags_.have_odom = false;
   flags_.have_map = false;
   flags_.have_laser = false;
+  command_.active = false;
+  command_.turning = false;
+
+  map_->setThresholds(params_.free_threshold, params_.occupied_threshold);
+  map_->setLandmarks(params_.num_landmarks);
+  if (!connected_) {
+    return;
+  }
 
   path_pub_ = nh_.advertise<nav_msgs::Path>("path", 5, true);
   vis_pub_ = nh_.advertise<visualization_msgs::Marker>("marker", 10, true);
@@ -382,13 +419,50 @@ HFNWrapper::HFNWrapper(const Params &params, HumanFriendlyNav *hfn) :
   map_sub_ = nh_.subscribe("map", 1, &HFNWrapper::onMap, this);
   laser_sub_ = nh_.subscribe("scan", 1, &HFNWrapper::onLaserScan, this);
   odom_sub_ = nh_.subscribe("odom", 1, &HFNWrapper::onOdom, this);
-
-  map_->setThresholds(params_.free_threshold, params_.occupied_threshold);
+  if (!params_.reservation_service.empty()) {
+    reservation_client_ =
+      nh_.serviceClient<scarab_msgs::ReservePath>(params_.reservation_service);
+  }
 
   pubWaypoints();
+
+  // Commands are computed on a separate queue so that the control rate doesn't
+  // depend on when scans arrive or how long the other callbacks take
+  control_nh_.setCallbackQueue(&control_queue_);
+  control_timer_ = control_nh_.createTimer(ros::Duration(1.0 / hfn_->params().freq),
+                                           &HFNWrapper::control, this);
+  control_spinner_.reset(new ros::AsyncSpinner(1, &control_queue_));
+  control_spinner_->start();
+
+  map_thread_ = boost::thread(&HFNWrapper::mapLoop, this);
+  reservation_thread_ = boost::thread(&HFNWrapper::reservationLoop, this);
 }
 
 HFNWrapper::~HFNWrapper() {
+  if (!connected_) {
+    return;
+  }
+  control_timer_.stop();
+  control_spinner_->stop();
+  {
+    boost::mutex::scoped_lock lock(map_mutex_);
+    shutdown_ = true;
+  }
+  map_cond_.notify_one();
+  reservation_cond_.notify_one();
+  map_thread_.join();
+  reservation_thread_.join();
+  nh_.getCallbackQueue()->removeByID(reinterpret_cast<uint64_t>(this));
+
+  // The robot stays parked at the end of its path in the reservation table
+  // until it's released, and every other robot would plan around it
+  if (!params_.reservation_service.empty()) {
+    scarab_msgs::ReservePath srv;
+    srv.request.robot = params_.name_space;
+    if (!reservation_client_.call(srv)) {
+      ROS_WARN("HFNWrapper: Couldn't release reserved path");
+    }
+  }
 }
 
 
@@ -396,7 +470,12 @@ void HFNWrapper::registerStatusCallback(const boost::function<void(Status)> &cal
   callback_ = callback;
 }
 
-HFNWrapper* HFNWrapper::ROSInit(ros::NodeHandle& nh) {
+void HFNWrapper::registerCommandCallback(
+  const boost::function<void(const geometry_msgs::Twist&)> &callback) {
+  command_callback_ = callback;
+}
+
+HFNWrapper* HFNWrapper::ROSInit(ros::NodeHandle& nh, bool connect) {
   Params p;
   nh.param("max_occ_dist", p.max_occ_dist, 0.5);
   nh.param("lethal_occ_dist", p.lethal_occ_dist, 0.23);
@@ -416,13 +495,24 @@ HFNWrapper* HFNWrapper::ROSInit(ros::NodeHandle& nh) {
   nh.param("occupied_threshold", p.occupied_threshold, 100);
   nh.param("allow_unknown_path", p.allow_unknown_path, true);
   nh.param("allow_unknown_los", p.allow_unknown_los, false);
+  nh.param("bidirectional_search", p.bidirectional_search, false);
+  nh.param("num_landmarks", p.num_landmarks, 8);
+  nh.param("flow_field", p.flow_field, false);
+  nh.param("flow_lookahead", p.flow_lookahead, 0.5);
+  nh.param("obstacle_window", p.obstacle_window, 0.0);
+  nh.param("reorder_goals", p.reorder_goals, false);
+  nh.param("reorder_time", p.reorder_time, 0.1);
+  nh.param("min_frontier_size", p.min_frontier_size, 10);
+  nh.param("reservation_service", p.reservation_service, string(""));
+  nh.param("reservation_slack", p.reservation_slack, 1.0);
   nh.param("map_frame_id", p.map_frame, string("/map"));
   nh.param("min_map_update", p.min_map_update, 0.0);
+  nh.param("max_cmd_age", p.max_cmd_age, 0.5);
   p.name_space = nh.getNamespace();
 
   HumanFriendlyNav *hfn = HumanFriendlyNav::ROSInit(nh);
 
-  HFNWrapper *wrapper = new HFNWrapper(p, hfn);
+  HFNWrapper *wrapper = new HFNWrapper(p, hfn, connect);
   return wrapper;
 }
 
@@ -449,11 +539,13 @@ void HFNWrapper::ensureValidPose() {
 
 
 void HFNWrapper::onPose(const geometry_msgs::PoseStamped &input) {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
   pose_ = input;
   flags_.have_pose = true;
   hfn_->setPose(pose_);
 
   ensureValidPose();
+  updateCommandInputs();
 
   if (!initialized()) {
     return;
@@ -472,7 +564,12 @@ void HFNWrapper::onPose(const geometry_msgs::PoseStamped &input) {
   geometry_msgs::Twist cmd;
   hfn_->getCommandVel(&cmd);
 
-  bool xy_ok = turning_ ||
+  bool turning;
+  {
+    boost::mutex::scoped_lock command_lock(command_mutex_);
+    turning = command_.turning;
+  }
+  bool xy_ok = turning ||
     linear_distance(pose_.pose, goals_.back().pose) < params_.goal_tol;
   if (xy_ok &&
       (params_.goal_tol_ang >= M_PI ||
@@ -480,7 +577,9 @@ void HFNWrapper::onPose(const geometry_msgs::PoseStamped &input) {
     stop();
     ROS_INFO("HFNWrapper: FINISHED");
     callback_(FINISHED);
-  } else if ((ros::Time::now() - goal_time_).toSec() > params_.stuck_start) {
+  } else if ((ros::Time::now() - max(goal_time_, hold_time_)).toSec() >
+             params_.stuck_start) {
+    // Waiting for other robots isn't being stuck
     bool stuck = true;
     // Check if we've moved
     for (list<geometry_msgs::PoseStamped>::iterator it = pose_history_.begin();
@@ -501,26 +600,86 @@ void HFNWrapper::onPose(const geometry_msgs::PoseStamped &input) {
 }
 
 void HFNWrapper::onMap(const nav_msgs::OccupancyGrid &input) {
-  geometry_msgs::PoseStamped goal;
   if ((input.header.stamp - last_map_update_).toSec() < params_.min_map_update) {
     ROS_DEBUG("HFNWrapper: NOT updating map!");
     return;
   }
-  ROS_DEBUG("HFNWrapper: Updating map");
   last_map_update_ = ros::Time::now();
+  if (!connected_) {
+    buildMap(input);
+    return;
+  }
+  // Only the newest map matters; one that hasn't been built yet is dropped
+  {
+    boost::mutex::scoped_lock lock(map_mutex_);
+    pending_map_ = input;
+    have_pending_map_ = true;
+  }
+  map_cond_.notify_one();
+}
+
+void HFNWrapper::mapLoop() {
+  nav_msgs::OccupancyGrid grid;
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(map_mutex_);
+      while (!have_pending_map_ && !shutdown_) {
+        map_cond_.wait(lock);
+      }
+      if (shutdown_) {
+        return;
+      }
+      grid.data.swap(pending_map_.data);
+      grid.header = pending_map_.header;
+      grid.info = pending_map_.info;
+      have_pending_map_ = false;
+    }
+    buildMap(grid);
+  }
+}
+
+void HFNWrapper::buildMap(const nav_msgs::OccupancyGrid &grid) {
+  ROS_DEBUG("HFNWrapper: Updating map");
+  // Readers see the old map until the new one is published
+  map_->setMap(grid, params_.max_occ_dist, params_.lethal_occ_dist,
+               params_.cost_occ_prob, params_.cost_occ_dist);
+  frontier_tracker_.update(grid);
+  vector<scarab::FrontierTracker::Frontier> frontiers =
+    frontier_tracker_.frontiers();
+
+  boost::recursive_mutex::scoped_lock lock(mutex_);
   flags_.have_map = true;
-  map_->setMap(input);
-  map_->updateCSpace(params_.max_occ_dist, params_.lethal_occ_dist,
-                     params_.cost_occ_prob, params_.cost_occ_dist);
+  frontiers_.swap(frontiers);
+  pubFrontiers();
   //~ costmap_pub_.publish(map_->getCSpace());
   if (costmap_pub_.getNumSubscribers() > 0) {
-    costmap_pub_.publish(map_->getCostMap());
+    publish(costmap_pub_, map_->getCostMap());
   }
 
   ensureValidPose();
+  updateCommandInputs();
 
+  if (!active_) {
+    return;
+  }
+  if (!connected_) {
+    planGoals(goals_);
+  } else if (!replan_queued_) {
+    // Planning can end in a call to the status callback, which would take the
+    // action server's lock while holding mutex_
+    replan_queued_ = true;
+    ros::CallbackInterfacePtr callback(
+      new FunctionCallback(boost::bind(&HFNWrapper::replan, this)));
+    nh_.getCallbackQueue()->addCallback(callback,
+                                        reinterpret_cast<uint64_t>(this));
+  }
+}
+
+void HFNWrapper::replan() {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
+  replan_queued_ = false;
   if (active_) {
-    setGoal(goals_);
+    planGoals(goals_);
   }
 }
 
@@ -547,7 +706,46 @@ void HFNWrapper::pubPolygon(const HumanFriendlyNav::Polygon_2 &polygon) {
     m.points.at(i).y = it->y();
   }
   m.points.push_back(m.points.front());
-  vis_pub_.publish(m);
+  publish(vis_pub_, m);
+}
+
+void HFNWrapper::pubFrontiers() {
+  visualization_msgs::Marker m;
+  m.header.stamp = ros::Time();
+  m.header.frame_id = params_.map_frame;
+  m.action = visualization_msgs::Marker::ADD;
+  m.type = visualization_msgs::Marker::POINTS;
+  m.id = 100;
+  m.ns = params_.name_space + "/frontiers";
+  m.pose.orientation.w = 1.0;
+  m.scale.x = 0.1;
+  m.scale.y = 0.1;
+  m.color.a = 1.0;
+  m.color.g = 1.0;
+  m.points.resize(frontiers_.size());
+  for (size_t i = 0; i < frontiers_.size(); ++i) {
+    m.points[i].x = frontiers_[i].target.x();
+    m.points[i].y = frontiers_[i].target.y();
+  }
+  publish(vis_pub_, m);
+}
+
+vector<scarab::FrontierTracker::Frontier> HFNWrapper::frontiers() {
+  vector<scarab::FrontierTracker::Frontier> all;
+  double x, y;
+  {
+    boost::recursive_mutex::scoped_lock lock(mutex_);
+    if (!flags_.have_pose || !flags_.have_map) {
+      return all;
+    }
+    all = frontiers_;
+    x = pose_.pose.position.x;
+    y = pose_.pose.position.y;
+  }
+  // One search to every frontier; like orderGoals(), it doesn't need mutex_
+  return scarab::FrontierTracker::rank(all, map_.get(), x, y,
+                                       params_.lethal_occ_dist,
+                                       params_.allow_unknown_path);
 }
 
 string HFNWrapper::uninitializedString() {
@@ -560,50 +758,238 @@ string HFNWrapper::uninitializedString() {
 }
 
 void HFNWrapper::onLaserScan(const sensor_msgs::LaserScan &scan) {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
   flags_.have_laser = true;
   hfn_->setLaserScan(scan);
-  inflated_pub_.publish(hfn_->inflatedScan());
+  last_scan_time_ = scan.header.stamp;
+  updateCommandInputs();
+  publish(inflated_pub_, hfn_->inflatedScan());
 
   pubPolygon(hfn_->inflatedPolygon());
 
+  if (params_.obstacle_window > 0.0 && flags_.have_map && flags_.have_pose) {
+    addObstacles(scan);
+  }
+
   if (!initialized() || !active_) {
     return;
   }
-  bool valid_waypoint = updateWaypoint();
-  if (valid_waypoint) {
-    geometry_msgs::Twist cmd;
-    hfn_->getCommandVel(&cmd);
-    if (!turning_ &&
-        linear_distance(pose_.pose, goals_.back().pose) < 0.8*params_.goal_tol) {
-      turning_ = 0.0 <= params_.goal_tol_ang && params_.goal_tol_ang <= M_PI;
-      if (turning_) {
-        ROS_INFO("Ignoring HFN and turning instead");
-      }
-    }
-    if (turning_) {
-      cmd.linear.x = 0.0;
-      double diff =
-        angles::shortest_angular_distance(tf::getYaw(pose_.pose.orientation),
-                                          tf::getYaw(goals_.back().pose.orientation));
-      double speed = hfn_->params().w_max;
-      if (fabs(diff) < M_PI / 8.0) {
-        speed /= 1.5;
+  // Don't wait for the mapper to notice a blocked doorway
+  if (params_.obstacle_window > 0.0 && pathBlocked()) {
+    ROS_INFO("HFNWrapper: Path is blocked, replanning");
+    if (!params_.flow_field) {
+      planGoals(goals_);
+      if (!active_) {
+        return;
       }
-      cmd.angular.z = copysign(speed, diff);
+    } else if (!planFlowLeg()) {
+      ROS_WARN("HFNWrapper: UNREACHABLE (No path found to goal)");
+      stop();
+      callback_(UNREACHABLE);
+      return;
     }
-    vel_pub_.publish(cmd);
-  } else {
+  }
+  // Commands are published by control(); just pick the waypoint to follow
+  bool valid_waypoint = updateWaypoint();
+  if (!valid_waypoint) {
     stop();
     callback_(UNREACHABLE);
   }
 }
 
+void HFNWrapper::control() {
+  control(ros::TimerEvent());
+}
+
+void HFNWrapper::publishCommand(const geometry_msgs::Twist &cmd) {
+  publish(vel_pub_, cmd);
+  if (command_callback_) {
+    command_callback_(cmd);
+  }
+}
+
+void HFNWrapper::updateCommandInputs() {
+  geometry_msgs::Twist cmd;
+  hfn_->getCommandVel(&cmd);
+  boost::mutex::scoped_lock lock(command_mutex_);
+  command_.active = initialized() && active_;
+  command_.cmd = cmd;
+  command_.pose = pose_.pose;
+  if (!goals_.empty()) {
+    command_.goal = goals_.back().pose;
+  }
+  command_.scan_time = last_scan_time_;
+}
+
+void HFNWrapper::control(const ros::TimerEvent &event) {
+  // Only command_ is used, so callbacks that are planning don't hold this up
+  boost::mutex::scoped_lock lock(command_mutex_);
+  double period = 1.0 / hfn_->params().freq;
+  if (event.last_real != ros::Time() &&
+      (event.current_real - event.current_expected).toSec() > period) {
+    ++deadline_misses_;
+    ROS_WARN_THROTTLE(5.0, "HFNWrapper: Control loop %.3fs late "
+                      "(%i deadline misses so far)",
+                      (event.current_real - event.current_expected).toSec(),
+                      deadline_misses_);
+  }
+
+  if (!command_.active) {
+    return;
+  }
+
+  geometry_msgs::Twist cmd;
+  double age = (ros::Time::now() - command_.scan_time).toSec();
+  if (age > params_.max_cmd_age) {
+    // Scans have stopped arriving or aren't being processed; don't keep
+    // driving on stale data
+    ROS_WARN_THROTTLE(1.0, "HFNWrapper: Newest scan is %.3fs old; stopping", age);
+    cmd.linear.x = 0.0;
+    cmd.angular.z = 0.0;
+    publishCommand(cmd);
+    return;
+  }
+
+  cmd = command_.cmd;
+  if (!command_.turning &&
+      linear_distance(command_.pose, command_.goal) < 0.8*params_.goal_tol) {
+    command_.turning = 0.0 <= params_.goal_tol_ang && params_.goal_tol_ang <= M_PI;
+    if (command_.turning) {
+      ROS_INFO("Ignoring HFN and turning instead");
+    }
+  }
+  if (command_.turning) {
+    cmd.linear.x = 0.0;
+    double diff =
+      angles::shortest_angular_distance(tf::getYaw(command_.pose.orientation),
+                                        tf::getYaw(command_.goal.orientation));
+    double speed = hfn_->params().w_max;
+    if (fabs(diff) < M_PI / 8.0) {
+      speed /= 1.5;
+    }
+    cmd.angular.z = copysign(speed, diff);
+  }
+  publishCommand(cmd);
+}
+
 void HFNWrapper::onOdom(const nav_msgs::Odometry &odom) {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
   flags_.have_odom = true;
   hfn_->setOdom(odom);
+  updateCommandInputs();
 }
 
 void HFNWrapper::setGoal(const vector<geometry_msgs::PoseStamped> &p) {
+  geometry_msgs::Pose start;
+  int plan, request;
+  {
+    boost::recursive_mutex::scoped_lock lock(mutex_);
+    ++goal_count_;
+    if (!params_.reorder_goals || !initialized() || p.size() < 3) {
+      planGoals(p);
+      return;
+    }
+    start = pose_.pose;
+    plan = plan_count_;
+    request = goal_count_;
+  }
+
+  // Reordering can take a while, and the callbacks keep feeding control()
+  // meanwhile
+  vector<geometry_msgs::PoseStamped> goals(p);
+  orderGoals(start, &goals);
+
+  boost::recursive_mutex::scoped_lock lock(mutex_);
+  if (plan != plan_count_ || request != goal_count_) {
+    ROS_INFO("HFNWrapper: Goals changed while reordering, dropping the order");
+    return;
+  }
+  planGoals(goals);
+}
+
+void HFNWrapper::orderGoals(const geometry_msgs::Pose &from,
+                            vector<geometry_msgs::PoseStamped> *goals) {
+  // The last goal is where the robot ends up, so there's nothing to reorder
+  // unless there are at least two others
+  if (goals->size() < 3) {
+    return;
+  }
+
+  // Route starts at the robot; goals too close to obstacles are moved like
+  // planGoals() does, and goals outside of the map are left for it to reject
+  scarab::Path points;
+  points.push_back(Eigen::Vector2f(from.position.x, from.position.y));
+  for (size_t i = 0; i < goals->size(); ++i) {
+    points.push_back(Eigen::Vector2f(goals->at(i).pose.position.x,
+                                     goals->at(i).pose.position.y));
+  }
+  for (size_t i = 0; i < points.size(); ++i) {
+    map_cell_t cell;
+    if (!map_->getCell(points[i].x(), points[i].y(), &cell)) {
+      return;
+    }
+    double x, y;
+    if (cell.occ_dist < params_.lethal_occ_dist &&
+        map_->nearestPoint(points[i].x(), points[i].y(),
+                           params_.lethal_occ_dist, &x, &y)) {
+      points[i] = Eigen::Vector2f(x, y);
+    }
+  }
+
+  // One search per row, spread over all cores; nothing leaves the last goal
+  ros::WallTime start = ros::WallTime::now();
+  scarab::CostMatrix cost(points.size(), vector<double>(points.size(), 0.0));
+  size_t next_row = 0;
+  boost::mutex row_mutex;
+  size_t num_threads = min<size_t>(max(boost::thread::hardware_concurrency(), 1u),
+                                   points.size() - 1);
+  boost::thread_group threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.create_thread(boost::bind(&HFNWrapper::costRows, this,
+                                      boost::cref(points), &next_row,
+                                      &row_mutex, &cost));
+  }
+  threads.join_all();
+  double matrix_time = (ros::WallTime::now() - start).toSec();
+
+  vector<int> given(points.size());
+  for (size_t i = 0; i < given.size(); ++i) {
+    given[i] = i;
+  }
+  vector<int> order = scarab::orderVisits(cost, params_.reorder_time);
+  ROS_INFO("HFNWrapper: Reordered %zu goals, route cost %.2f -> %.2f "
+           "(%.3fs for costs, %.3fs total)", goals->size(),
+           scarab::routeCost(cost, given), scarab::routeCost(cost, order),
+           matrix_time, (ros::WallTime::now() - start).toSec());
+
+  vector<geometry_msgs::PoseStamped> ordered;
+  for (size_t k = 1; k < order.size(); ++k) {
+    ordered.push_back(goals->at(order[k] - 1));
+  }
+  goals->swap(ordered);
+}
+
+void HFNWrapper::costRows(const scarab::Path &points, size_t *next_row,
+                          boost::mutex *row_mutex,
+                          vector<vector<double> > *cost) {
+  scarab::OccupancyMap::SearchContext context;
+  while (true) {
+    size_t row;
+    {
+      boost::mutex::scoped_lock lock(*row_mutex);
+      row = (*next_row)++;
+    }
+    if (row + 1 >= points.size()) {
+      return;
+    }
+    map_->pathCosts(points[row].x(), points[row].y(), points,
+                    params_.lethal_occ_dist, params_.allow_unknown_path,
+                    &cost->at(row), &context);
+  }
+}
+
+void HFNWrapper::planGoals(const vector<geometry_msgs::PoseStamped> &p) {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
   ROS_INFO("HFNWrapper: Got final goal: (%.2f, %.2f, %.2f)",
            p.back().pose.position.x, p.back().pose.position.y, p.back().pose.position.z);
 
@@ -617,7 +1003,8 @@ void HFNWrapper::setGoal(const vector<geometry_msgs::PoseStamped> &p) {
   for (int i = 0; i < p.size(); ++i) {
     const geometry_msgs::PoseStamped &pose = p.at(i);
     double x = pose.pose.position.x, y = pose.pose.position.y;
-    if (map_->getCell(x, y) == NULL) {
+    map_cell_t cell;
+    if (!map_->getCell(x, y, &cell)) {
       ROS_WARN("HFNWrapper: UNREACHABLE (Goal %f %f is outside map limits)", x, y);
       callback_(UNREACHABLE);
       return;
@@ -626,13 +1013,20 @@ void HFNWrapper::setGoal(const vector<geometry_msgs::PoseStamped> &p) {
 
 
   goals_ = p;
+  ++plan_count_;
+  reserving_ = false;
   waypoints_.clear();
+  waypoint_times_.clear();
   pose_history_.clear();
   goal_time_ = ros::Time::now();
   // If we were turning to orient towards the last goal, and we're still pretty
   // close to goal, don't bother moving closer, just keep on turning
-  turning_ = (turning_ &&
-              linear_distance(goals_.back().pose, pose_.pose) < 2 * params_.goal_tol);
+  {
+    boost::mutex::scoped_lock command_lock(command_mutex_);
+    command_.turning =
+      (command_.turning &&
+       linear_distance(goals_.back().pose, pose_.pose) < 2 * params_.goal_tol);
+  }
 
   // Plan path from current location to the final location in goals_,
   // passing through all intermediate points in goals_
@@ -641,8 +1035,9 @@ void HFNWrapper::setGoal(const vector<geometry_msgs::PoseStamped> &p) {
   for (std::vector<geometry_msgs::PoseStamped>::iterator it = goals_.begin();
        it != goals_.end(); ++it) {
     // Check if goals_ location is reachable
-    if (map_->getCell(it->pose.position.x, it->pose.position.y)->occ_dist <
-        params_.lethal_occ_dist) {
+    map_cell_t cell;
+    if (!map_->getCell(it->pose.position.x, it->pose.position.y, &cell) ||
+        cell.occ_dist < params_.lethal_occ_dist) {
 
       double startx = it->pose.position.x, starty = it->pose.position.y;
       double newx, newy;
@@ -660,15 +1055,27 @@ void HFNWrapper::setGoal(const vector<geometry_msgs::PoseStamped> &p) {
         return;
       }
     }
+    if (params_.flow_field) {
+      continue;
+    }
     // Plan a path to goals_ location
     geometry_msgs::Pose last_pose;
     last_pose.position.x = path.back().x();
     last_pose.position.y = path.back().y();
     if (linear_distance(last_pose, it->pose) > params_.waypoint_spacing) {
-      scarab::Path path_segment =
-        map_->astar(last_pose.position.x, last_pose.position.y,
-                    it->pose.position.x, it->pose.position.y,
-                    params_.lethal_occ_dist, params_.allow_unknown_path);
+      scarab::Path path_segment;
+      if (params_.bidirectional_search) {
+        path_segment =
+          map_->bidirectionalAstar(last_pose.position.x, last_pose.position.y,
+                                   it->pose.position.x, it->pose.position.y,
+                                   params_.lethal_occ_dist,
+                                   params_.allow_unknown_path);
+      } else {
+        path_segment =
+          map_->astar(last_pose.position.x, last_pose.position.y,
+                      it->pose.position.x, it->pose.position.y,
+                      params_.lethal_occ_dist, params_.allow_unknown_path);
+      }
       if (path_segment.size() != 0) {
         for (size_t i=0; i<path_segment.size(); ++i) {
           path.push_back(path_segment[i]);
@@ -684,46 +1091,232 @@ void HFNWrapper::setGoal(const vector<geometry_msgs::PoseStamped> &p) {
     }
   }
 
-  // Generate evenly spaced path
-  waypoints_.push_back(path[0]);
-  for (size_t i = 0; i < path.size() - 1; ++i) {
-    const Eigen::Vector2f& prev = waypoints_.back();
-    const Eigen::Vector2f& curr = path[i];
-    if ((prev - curr).norm() > params_.waypoint_spacing) {
-      waypoints_.push_back(path[i-1]);
+  if (params_.flow_field) {
+    flow_leg_ = 0;
+    if (!planFlowLeg()) {
+      ROS_WARN("HFNWrapper: UNREACHABLE (No path found to goal)");
+      stop();
+      callback_(UNREACHABLE);
+      return;
+    }
+  } else {
+    // Generate evenly spaced path
+    waypoints_.push_back(path[0]);
+    for (size_t i = 0; i < path.size() - 1; ++i) {
+      const Eigen::Vector2f& prev = waypoints_.back();
+      const Eigen::Vector2f& curr = path[i];
+      if ((prev - curr).norm() > params_.waypoint_spacing) {
+        waypoints_.push_back(path[i-1]);
+      }
+    }
+    waypoints_.push_back(path.back());
+    pubWaypoints();
+    // Followed if no path can be reserved
+    if (!params_.reservation_service.empty()) {
+      reservePath();
+      return;
     }
   }
-  waypoints_.push_back(path.back());
-  pubWaypoints();
 
   timeout_timer_ = nh_.createTimer(ros::Duration(params_.timeout),
                                    &HFNWrapper::timeout,
                                    this, true);
   active_ = true;
+  updateCommandInputs();
 }
 
-void HFNWrapper::stop() {
-  ROS_INFO("HFNWrapper: Stopping");
+void HFNWrapper::halt() {
   active_ = false;
 
   geometry_msgs::Twist cmd_vel;
   cmd_vel.linear.x = 0.0;
   cmd_vel.angular.z = 0.0;
-  vel_pub_.publish(cmd_vel);
+  // No command from control() can follow this one
+  boost::mutex::scoped_lock command_lock(command_mutex_);
+  command_.active = false;
+  publishCommand(cmd_vel);
+}
+
+void HFNWrapper::stop() {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
+  ROS_INFO("HFNWrapper: Stopping");
+  halt();
 
   timeout_timer_.stop();
 
+  // A robot that reached its goal stays parked there in the reservation
+  // table; otherwise the rest of its path, or the one being reserved, is
+  // given up
+  if (reserving_ || (!waypoint_times_.empty() &&
+                     linear_distance(pose_.pose, goals_.back().pose) >=
+                     params_.goal_tol)) {
+    scarab_msgs::ReservePath srv;
+    srv.request.robot = params_.name_space;
+    queueReservation(srv);
+  }
+  ++plan_count_;
+  reserving_ = false;
   waypoints_.clear();
+  waypoint_times_.clear();
   pubWaypoints();
 }
 
 void HFNWrapper::timeout(const ros::TimerEvent &event) {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
   ROS_WARN("HFNWrapper: TIMEOUT (Didn't get to goal in time)");
   stop();
   callback_(TIMEOUT);
 }
 
-bool HFNWrapper::updateWaypoint() {
+bool HFNWrapper::planFlowLeg() {
+  const geometry_msgs::Pose &goal = goals_.at(flow_leg_).pose;
+  map_->prepareNavigationFunction(goal.position.x, goal.position.y,
+                                  params_.lethal_occ_dist,
+                                  params_.allow_unknown_path);
+  waypoints_ = map_->navigationPath(pose_.pose.position.x,
+                                    pose_.pose.position.y);
+  pubWaypoints();
+  return !waypoints_.empty();
+}
+
+void HFNWrapper::addObstacles(const sensor_msgs::LaserScan &scan) {
+  // Like HumanFriendlyNav, assume the laser is at the center of the robot
+  double x = pose_.pose.position.x, y = pose_.pose.position.y;
+  double yaw = tf::getYaw(pose_.pose.orientation);
+  scarab::Path hits, misses;
+  for (size_t i = 0; i < scan.ranges.size(); ++i) {
+    float range = scan.ranges[i];
+    if (isnan(range) || range < scan.range_min) {
+      continue;
+    }
+    double angle = yaw + scan.angle_min + i * scan.angle_increment;
+    if (range < scan.range_max) {
+      hits.push_back(Eigen::Vector2f(x + range * cos(angle),
+                                     y + range * sin(angle)));
+    } else {
+      misses.push_back(Eigen::Vector2f(x + scan.range_max * cos(angle),
+                                       y + scan.range_max * sin(angle)));
+    }
+  }
+  map_->updateObstacles(x, y, hits, misses, params_.obstacle_window);
+}
+
+void HFNWrapper::reservePath() {
+  scarab_msgs::ReservePath srv;
+  srv.request.robot = params_.name_space;
+  srv.request.start = pose_.pose.position;
+  for (size_t i = 0; i < goals_.size(); ++i) {
+    srv.request.goals.push_back(goals_[i].pose.position);
+  }
+  // Don't follow the old path, or the new one before it's known whether it
+  // can be reserved
+  halt();
+  timeout_timer_.stop();
+  reserving_ = true;
+  queueReservation(srv);
+}
+
+void HFNWrapper::queueReservation(const scarab_msgs::ReservePath &srv) {
+  if (!connected_) {
+    scarab_msgs::ReservePath copy(srv);
+    callReservation(plan_count_, &copy);
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(map_mutex_);
+    reservations_.push_back(make_pair(plan_count_, srv));
+  }
+  reservation_cond_.notify_one();
+}
+
+void HFNWrapper::reservationLoop() {
+  while (true) {
+    pair<int, scarab_msgs::ReservePath> request;
+    {
+      boost::mutex::scoped_lock lock(map_mutex_);
+      while (reservations_.empty() && !shutdown_) {
+        reservation_cond_.wait(lock);
+      }
+      if (reservations_.empty()) {
+        return;
+      }
+      request = reservations_.front();
+      reservations_.pop_front();
+      // Releases queued by stop() still go out on shutdown, but there's no
+      // one left to follow a new path
+      if (shutdown_ && !request.second.request.goals.empty()) {
+        continue;
+      }
+    }
+    callReservation(request.first, &request.second);
+  }
+}
+
+void HFNWrapper::callReservation(int plan, scarab_msgs::ReservePath *srv) {
+  bool ok = reservation_client_.call(*srv);
+  if (!srv->request.goals.empty()) {
+    applyReservation(plan, *srv, ok);
+  } else if (!ok) {
+    ROS_WARN("HFNWrapper: Couldn't release reserved path");
+  }
+}
+
+void HFNWrapper::applyReservation(int plan, const scarab_msgs::ReservePath &srv,
+                                  bool ok) {
+  boost::recursive_mutex::scoped_lock lock(mutex_);
+  // The goals were changed or given up while waiting; a later request
+  // replaces or releases this reservation
+  if (plan != plan_count_) {
+    return;
+  }
+  reserving_ = false;
+  // The path from planGoals() is kept if this fails
+  if (!ok || !srv.response.success) {
+    ROS_WARN("HFNWrapper: Couldn't reserve a path, planning without other robots");
+  } else {
+    // Waits are repeated waypoints, so waypoints_ isn't thinned out
+    waypoints_.clear();
+    waypoint_times_.clear();
+    for (size_t i = 0; i < srv.response.path.size(); ++i) {
+      const geometry_msgs::PoseStamped &p = srv.response.path[i];
+      waypoints_.push_back(Eigen::Vector2f(p.pose.position.x, p.pose.position.y));
+      waypoint_times_.push_back(p.header.stamp);
+    }
+  }
+  pubWaypoints();
+
+  // Waiting for the reply isn't being stuck
+  goal_time_ = ros::Time::now();
+  pose_history_.clear();
+  timeout_timer_ = nh_.createTimer(ros::Duration(params_.timeout),
+                                   &HFNWrapper::timeout,
+                                   this, true);
+  active_ = true;
+  updateCommandInputs();
+}
+
+bool HFNWrapper::pathBlocked() {
+  // Waypoints behind the robot don't matter, and neither does the one it's
+  // at, which may be too close to an obstacle already
+  Eigen::Vector2f pos(pose_.pose.position.x, pose_.pose.position.y);
+  size_t closest = 0;
+  for (size_t i = 1; i < waypoints_.size(); ++i) {
+    if ((waypoints_[i] - pos).squaredNorm() <
+        (waypoints_[closest] - pos).squaredNorm()) {
+      closest = i;
+    }
+  }
+  for (size_t i = closest + 1; i < waypoints_.size(); ++i) {
+    map_cell_t cell;
+    if (map_->getCell(waypoints_[i].x(), waypoints_[i].y(), &cell) &&
+        isinf(cell.cost)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HFNWrapper::nextWaypoint(Eigen::Vector2f *waypoint) {
   // Direct robot towards successor of point that it is closest to
   float min_dist = numeric_limits<float>::infinity();
   int min_ind = -1;
@@ -745,22 +1338,64 @@ bool HFNWrapper::updateWaypoint() {
   int ind_delta = 0;
   if (min_ind == -1) {
     return false;
-  } else {
-    while (ind_delta < 20 &&
-           static_cast<unsigned>(min_ind + 1) < waypoints_.size() &&
-           map_->lineOfSight(pos.x(), pos.y(),
-                             waypoints_[min_ind+1].x(), waypoints_[min_ind+1].y(),
-                             params_.los_margin, params_.allow_unknown_los)) {
-      ++min_ind;
-      ++ind_delta;
+  }
+  while (ind_delta < 20 &&
+         static_cast<unsigned>(min_ind + 1) < waypoints_.size() &&
+         map_->lineOfSight(pos.x(), pos.y(),
+                           waypoints_[min_ind+1].x(), waypoints_[min_ind+1].y(),
+                           params_.los_margin, params_.allow_unknown_los)) {
+    ++min_ind;
+    ++ind_delta;
+  }
+  // Don't get ahead of a reserved schedule, or other robots' paths may no
+  // longer avoid this one
+  if (!waypoint_times_.empty()) {
+    ros::Time limit = ros::Time::now() + ros::Duration(params_.reservation_slack);
+    int closest = min_ind - ind_delta;
+    while (min_ind > closest && waypoint_times_[min_ind] > limit) {
+      --min_ind;
+      hold_time_ = ros::Time::now();
     }
+  }
+  *waypoint = waypoints_[min_ind];
+  return true;
+}
 
+bool HFNWrapper::flowWaypoint(Eigen::Vector2f *waypoint) {
+  // Each intermediate goal has its own navigation function, computed once the
+  // previous one has been reached
+  while (flow_leg_ + 1 < goals_.size() &&
+         linear_distance(pose_.pose, goals_[flow_leg_].pose) < params_.goal_tol) {
+    ++flow_leg_;
+    if (!planFlowLeg()) {
+      return false;
+    }
+  }
 
+  const geometry_msgs::Pose &goal = goals_[flow_leg_].pose;
+  if (linear_distance(pose_.pose, goal) < params_.flow_lookahead) {
+    *waypoint = Eigen::Vector2f(goal.position.x, goal.position.y);
+    return true;
+  }
+  double x, y;
+  if (!map_->descend(pose_.pose.position.x, pose_.pose.position.y,
+                     params_.flow_lookahead, &x, &y)) {
+    return false;
+  }
+  *waypoint = Eigen::Vector2f(x, y);
+  return true;
+}
+
+bool HFNWrapper::updateWaypoint() {
+  Eigen::Vector2f waypoint;
+  if (params_.flow_field ? !flowWaypoint(&waypoint) : !nextWaypoint(&waypoint)) {
+    return false;
+  } else {
     geometry_msgs::PoseStamped goal;
     goal.header.stamp = ros::Time::now();
     goal.header.frame_id = params_.map_frame;
-    goal.pose.position.x = waypoints_[min_ind].x();
-    goal.pose.position.y = waypoints_[min_ind].y();
+    goal.pose.position.x = waypoint.x();
+    goal.pose.position.y = waypoint.y();
     goal.pose.position.z = goals_.back().pose.position.z;
 
     hfn_->setGoal(goal);
@@ -779,7 +1414,7 @@ bool HFNWrapper::updateWaypoint() {
     m.color.a = 1.0;
     m.color.r = 1.0;
     m.pose.position = goal.pose.position;
-    vis_pub_.publish(m);
+    publish(vis_pub_, m);
 
     hfn_->getGoal(&goal);
     m.id += 1;
@@ -787,7 +1422,7 @@ bool HFNWrapper::updateWaypoint() {
     m.color.r = 0.0;
     m.color.b = 1.0;
     m.pose = goal.pose;
-    vis_pub_.publish(m);
+    publish(vis_pub_, m);
     return true;
   }
 }
@@ -806,7 +1441,7 @@ void HFNWrapper::pubWaypoints() {
                              tf::Vector3(waypoints_[i].x(), waypoints_[i].y(), 0)),
                     ros_path.poses[i].pose);
   }
-  path_pub_.publish(ros_path);
+  publish(path_pub_, ros_path);
 }
 
 //=============================== MoveServer ================================//
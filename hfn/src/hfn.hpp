@@ -1,12 +1,19 @@
 #ifndef HFN_HPP
 #define HFN_HPP
 
+#include <deque>
+
 #include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
 #include <CGAL/Polygon_2.h>
 
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <geometry_msgs/Pose.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <nav_msgs/Odometry.h>
@@ -15,7 +22,9 @@
 #include <actionlib/server/simple_action_server.h>
 
 #include <scarab_msgs/MoveAction.h>
+#include <scarab_msgs/ReservePath.h>
 
+#include "player_map/frontier.hpp"
 #include "player_map/rosmap.hpp"
 
 namespace scarab {
@@ -112,7 +121,18 @@ public:
     int occupied_threshold;  // min occupancy grid value for occupied space
     bool allow_unknown_path; // allow paths through unknown space
     bool allow_unknown_los;  // allow line of sight through unknown space
+    bool bidirectional_search; // plan each leg with bidirectional A*
+    int num_landmarks;       // landmarks for the A* heuristic, 0 to disable
+    bool flow_field;         // follow a navigation function instead of a path
+    double flow_lookahead;   // distance along the navigation function to aim for
+    double obstacle_window;  // range of laser obstacles added to the map, 0 to disable
+    bool reorder_goals;      // visit intermediate goals in the cheapest order
+    double reorder_time;     // time allowed for improving the goal order
+    int min_frontier_size;   // smallest frontier to explore, in cells
+    std::string reservation_service; // shared space-time planner, empty to plan alone
+    double reservation_slack; // how far ahead of its reserved schedule a robot may get
     double min_map_update;   // Wait at least this time before updating map
+    double max_cmd_age;      // Stop if newest processed scan is older than this
     std::string map_frame;
     std::string name_space;
   };
@@ -125,10 +145,13 @@ public:
     UNREACHABLE // Goal is no longer reachable (e.g., due to map change)
   };
 
-  HFNWrapper(const Params &params, HumanFriendlyNav *hfn);
+  // Unless connect, nothing is advertised or subscribed, maps are built
+  // synchronously, and commands are only computed when control() is called;
+  // messages are fed in by calling the on*() methods (see hfn_replay)
+  HFNWrapper(const Params &params, HumanFriendlyNav *hfn, bool connect = true);
   ~HFNWrapper();
 
-  static HFNWrapper* ROSInit(ros::NodeHandle& nh);
+  static HFNWrapper* ROSInit(ros::NodeHandle& nh, bool connect = true);
 
   void onPose(const geometry_msgs::PoseStamped &input);
   void onMap(const nav_msgs::OccupancyGrid &input);
@@ -137,15 +160,68 @@ public:
   void stop();
   void setGoal(const std::vector<geometry_msgs::PoseStamped> &p);
   void registerStatusCallback(const boost::function<void(Status)> &callback);
+  // Called with each velocity command that is published
+  void registerCommandCallback(
+    const boost::function<void(const geometry_msgs::Twist&)> &callback);
+  // Compute and publish one velocity command, as the control timer does
+  void control();
+  // Frontiers of the current map that the robot can reach, cheapest first
+  std::vector<scarab::FrontierTracker::Frontier> frontiers();
 
 private:
   void ensureValidPose();
+  // Plan a path through p in the order given
+  void planGoals(const std::vector<geometry_msgs::PoseStamped> &p);
+  // Reorder all but the last of goals to shorten the route starting at from;
+  // only reads map_ and params_, so it runs without mutex_ held
+  void orderGoals(const geometry_msgs::Pose &from,
+                  std::vector<geometry_msgs::PoseStamped> *goals);
+  // Fill in rows of cost, the path costs between points, until none are left
+  void costRows(const scarab::Path &points, size_t *next_row,
+                boost::mutex *row_mutex, std::vector<std::vector<double> > *cost);
   void timeout(const ros::TimerEvent &event);
+  // Publish a velocity command; runs at HumanFriendlyNav::Params::freq on its
+  // own thread, using the most recently processed scan and pose
+  void control(const ros::TimerEvent &event);
+  // Build maps received by onMap() on a background thread, so that planning
+  // and control keep using the previous map until the new one is ready
+  void mapLoop();
+  void buildMap(const nav_msgs::OccupancyGrid &grid);
+  // Plan the current goals again on the new map; queued by buildMap() so that
+  // the status callback is only called from the spinner
+  void replan();
+  void publishCommand(const geometry_msgs::Twist &cmd);
+  // Clear active_ and publish a zero command
+  void halt();
+  // Copy what control() needs into command_; called with mutex_ held
+  void updateCommandInputs();
 
   // Return true if we can follow a waypoint, false otherwise
   bool updateWaypoint();
+  // Farthest visible waypoint on the planned path
+  bool nextWaypoint(Eigen::Vector2f *waypoint);
+  // Point a short way down the navigation function of the current leg
+  bool flowWaypoint(Eigen::Vector2f *waypoint);
+  // Compute the navigation function to goals_[flow_leg_]
+  bool planFlowLeg();
+  // Add scan to the live obstacle layer of map_
+  void addObstacles(const sensor_msgs::LaserScan &scan);
+  // Ask the reservation service for a path through goals_; the robot waits
+  // for the reply, which applyReservation() acts on
+  void reservePath();
+  // Hand srv to reservationLoop(), which calls the reservation service
+  // without mutex_ held; requests without goals release the robot's path
+  void queueReservation(const scarab_msgs::ReservePath &srv);
+  void reservationLoop();
+  void callReservation(int plan, scarab_msgs::ReservePath *srv);
+  // Replace waypoints_ with a reserved path, unless plan is out of date, and
+  // start following them
+  void applyReservation(int plan, const scarab_msgs::ReservePath &srv, bool ok);
+  // True if a waypoint still ahead of the robot is no longer traversable
+  bool pathBlocked();
   void pubWaypoints();
   void pubPolygon(const HumanFriendlyNav::Polygon_2 &polygon);
+  void pubFrontiers();
   bool initialized() {
     return flags_.have_pose && flags_.have_odom && flags_.have_map &&
       flags_.have_laser;
@@ -153,22 +229,62 @@ private:
   // Get string describing which things have not been initialized yet
   std::string uninitializedString();
 
-  ros::NodeHandle nh_;
+  ros::NodeHandle nh_, control_nh_;
+  ros::CallbackQueue control_queue_;
+  boost::scoped_ptr<ros::AsyncSpinner> control_spinner_;
+  // Held by every callback; control() runs concurrently with the rest
+  boost::recursive_mutex mutex_;
+  // Protects command_; only held to copy it in or out, and for publishing
+  // commands, so control() never waits for planning
+  boost::mutex command_mutex_;
   ros::Publisher path_pub_, vis_pub_, vel_pub_, inflated_pub_, costmap_pub_;
   ros::Subscriber pose_sub_, map_sub_, odom_sub_, laser_sub_;
+  ros::ServiceClient reservation_client_;
 
   boost::function<void(Status)> callback_;
+  boost::function<void(const geometry_msgs::Twist&)> command_callback_;
+  bool connected_;
   bool active_; // True if we're navigating to a goal
-  bool turning_; // True if we've reached goal and are just turning
   geometry_msgs::PoseStamped pose_;
   std::vector<geometry_msgs::PoseStamped> goals_;
+  size_t flow_leg_; // goal that the navigation function leads to
   std::list<geometry_msgs::PoseStamped> pose_history_;
   scarab::Path waypoints_;
+  // When to reach each waypoint if the path was reserved, otherwise empty
+  std::vector<ros::Time> waypoint_times_;
+  ros::Time hold_time_; // last time the robot waited for its schedule
+  int plan_count_; // changed by planGoals() and stop()
+  int goal_count_; // changed by each setGoal()
+  bool reserving_; // waiting for the reply to reservePath()
   boost::scoped_ptr<scarab::OccupancyMap> map_;
+  // Only used by buildMap(), so it's kept up to date without mutex_ held
+  scarab::FrontierTracker frontier_tracker_;
+  // Unranked frontiers of map_
+  std::vector<scarab::FrontierTracker::Frontier> frontiers_;
   Params params_;
   HumanFriendlyNav *hfn_;
-  ros::Timer timeout_timer_;
+  ros::Timer timeout_timer_, control_timer_;
   ros::Time goal_time_, last_map_update_;
+  ros::Time last_scan_time_; // stamp of the last scan given to hfn_
+  // Inputs to control(), as of the last callback
+  struct {
+    bool active;  // initialized() && active_
+    bool turning; // True if we've reached goal and are just turning
+    geometry_msgs::Twist cmd; // hfn_->getCommandVel()
+    geometry_msgs::Pose pose, goal; // pose_ and the last of goals_
+    ros::Time scan_time;
+  } command_;
+  int deadline_misses_;
+  boost::thread map_thread_, reservation_thread_;
+  // Protects the work for map_thread_ and reservation_thread_, and the flags
+  // below
+  boost::mutex map_mutex_;
+  boost::condition_variable map_cond_, reservation_cond_;
+  nav_msgs::OccupancyGrid pending_map_;
+  // Requests to make, with the plan_count_ that each was made for
+  std::deque<std::pair<int, scarab_msgs::ReservePath> > reservations_;
+  bool have_pending_map_, shutdown_;
+  bool replan_queued_; // protected by mutex_
   struct {
     bool have_pose, have_odom, have_map, have_laser;
   } flags_;
@@ -1,12 +1,23 @@
+#include <signal.h>
+
 #include "ros/ros.h"
 
 #include "hfn.hpp"
 
 using namespace scarab;
 
+static volatile sig_atomic_t g_shutdown = 0;
+
+static void onSigint(int sig) {
+  g_shutdown = 1;
+}
+
 int main(int argc, char **argv)
 {
-  ros::init(argc, argv, "hfn");
+  // ROS is shut down after the wrapper is, so that it can still release its
+  // reservation
+  ros::init(argc, argv, "hfn", ros::init_options::NoSigintHandler);
+  signal(SIGINT, onSigint);
   ros::NodeHandle nh("~");
 
   boost::scoped_ptr<HFNWrapper> hfn(HFNWrapper::ROSInit(nh));
@@ -20,7 +31,11 @@ int main(int argc, char **argv)
   MoveServer mover("move", hfn.get());
 
   mover.start();
-  ros::spin();
+  while (ros::ok() && !g_shutdown) {
+    ros::getGlobalCallbackQueue()->callAvailable(ros::WallDuration(0.1));
+  }
   mover.stop();
+  hfn.reset();
+  ros::shutdown();
   return 0;
 }
@@ -0,0 +1,190 @@
+// Replay a bag through HFNWrapper as fast as possible, without a ROS master,
+// to profile the controller and to check that its commands haven't changed.
+// Scans, poses, odometry, maps and move action goals are read from
+// <prefix>/scan, pose, odom, map and move/goal.  Bag time is used as ROS time
+// and the control loop runs at its usual rate in bag time, so replays are
+// deterministic.  There's no parameter server, so parameters have their
+// default values.
+//
+// usage: hfn_replay bagfile [topic prefix] [commands.csv]
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <ros/ros.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include <scarab_msgs/MoveActionGoal.h>
+
+#include "hfn.hpp"
+
+using namespace std;
+using namespace scarab;
+
+struct Latency {
+  void start() {
+    begin = ros::WallTime::now();
+  }
+  void stop() {
+    ms.push_back(1000.0 * (ros::WallTime::now() - begin).toSec());
+  }
+  ros::WallTime begin;
+  vector<double> ms;
+};
+
+void report(const char *name, Latency *latency) {
+  vector<double> &ms = latency->ms;
+  if (ms.empty()) {
+    ROS_INFO("%-10s no calls", name);
+    return;
+  }
+  sort(ms.begin(), ms.end());
+  double total = 0.0;
+  for (size_t i = 0; i < ms.size(); ++i) {
+    total += ms[i];
+  }
+  ROS_INFO("%-10s %6zu calls %8.3f ms mean %8.3f ms median %8.3f ms 99%% "
+           "%8.3f ms max", name, ms.size(), total / ms.size(),
+           ms[ms.size() / 2], ms[ms.size() * 99 / 100], ms.back());
+}
+
+// Commands as CSV rows of bag time, linear and angular velocity
+struct CommandLog {
+  CommandLog() : file(NULL), count(0) { }
+  void operator()(const geometry_msgs::Twist &cmd) {
+    ++count;
+    if (file != NULL) {
+      fprintf(file, "%.6f,%.9g,%.9g\n", ros::Time::now().toSec(),
+              cmd.linear.x, cmd.angular.z);
+    }
+  }
+  FILE *file;
+  int count;
+};
+
+void onStatus(HFNWrapper::Status status) {
+  ROS_INFO("hfn_replay: Status %i at %.3f", status, ros::Time::now().toSec());
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "hfn_replay",
+            ros::init_options::AnonymousName | ros::init_options::NoRosout);
+  if (argc < 2 || argc > 4) {
+    ROS_ERROR("usage: hfn_replay bagfile [topic prefix] [commands.csv]");
+    return 1;
+  }
+  string prefix = argc > 2 ? argv[2] : "";
+  CommandLog log;
+  if (argc > 3) {
+    log.file = fopen(argv[3], "w");
+    if (log.file == NULL) {
+      ROS_ERROR("hfn_replay: Couldn't open %s", argv[3]);
+      return 1;
+    }
+  }
+
+  ros::NodeHandle pnh("~");
+  double freq;
+  pnh.param("freq", freq, 5.0);
+  boost::scoped_ptr<HFNWrapper> hfn(HFNWrapper::ROSInit(pnh, false));
+  hfn->registerStatusCallback(onStatus);
+  hfn->registerCommandCallback(boost::ref(log));
+
+  rosbag::Bag bag(argv[1]);
+  vector<string> topics;
+  topics.push_back(prefix + "/scan");
+  topics.push_back(prefix + "/pose");
+  topics.push_back(prefix + "/odom");
+  topics.push_back(prefix + "/map");
+  topics.push_back(prefix + "/move/goal");
+  rosbag::View view(bag, rosbag::TopicQuery(topics));
+
+  Latency scan, pose, odom, map, goal, control;
+  ros::Duration period(1.0 / freq);
+  ros::Time next_control;
+  ros::WallTime start = ros::WallTime::now();
+  BOOST_FOREACH(const rosbag::MessageInstance &m, view) {
+    ros::Time t = m.getTime();
+    if (next_control.isZero()) {
+      next_control = t;
+    }
+    while (next_control <= t) {
+      ros::Time::setNow(next_control);
+      control.start();
+      hfn->control();
+      control.stop();
+      next_control += period;
+    }
+    ros::Time::setNow(t);
+
+    // Messages of other types on these topics are skipped
+    const string &topic = m.getTopic();
+    if (topic == topics[0]) {
+      sensor_msgs::LaserScan::ConstPtr msg = m.instantiate<sensor_msgs::LaserScan>();
+      if (!msg) {
+        continue;
+      }
+      scan.start();
+      hfn->onLaserScan(*msg);
+      scan.stop();
+    } else if (topic == topics[1]) {
+      geometry_msgs::PoseStamped::ConstPtr msg =
+        m.instantiate<geometry_msgs::PoseStamped>();
+      if (!msg) {
+        continue;
+      }
+      pose.start();
+      hfn->onPose(*msg);
+      pose.stop();
+    } else if (topic == topics[2]) {
+      nav_msgs::Odometry::ConstPtr msg = m.instantiate<nav_msgs::Odometry>();
+      if (!msg) {
+        continue;
+      }
+      odom.start();
+      hfn->onOdom(*msg);
+      odom.stop();
+    } else if (topic == topics[3]) {
+      nav_msgs::OccupancyGrid::ConstPtr msg =
+        m.instantiate<nav_msgs::OccupancyGrid>();
+      if (!msg) {
+        continue;
+      }
+      map.start();
+      hfn->onMap(*msg);
+      map.stop();
+    } else {
+      scarab_msgs::MoveActionGoal::ConstPtr msg =
+        m.instantiate<scarab_msgs::MoveActionGoal>();
+      if (!msg) {
+        continue;
+      }
+      goal.start();
+      if (msg->goal.stop) {
+        hfn->stop();
+      } else if (!msg->goal.target_poses.empty()) {
+        hfn->setGoal(msg->goal.target_poses);
+      }
+      goal.stop();
+    }
+  }
+
+  ROS_INFO("hfn_replay: Replayed %.1fs of %s in %.3fs, %i commands",
+           (view.getEndTime() - view.getBeginTime()).toSec(), argv[1],
+           (ros::WallTime::now() - start).toSec(), log.count);
+  report("scan", &scan);
+  report("pose", &pose);
+  report("odom", &odom);
+  report("map", &map);
+  report("goal", &goal);
+  report("control", &control);
+  if (log.file != NULL) {
+    fclose(log.file);
+  }
+  return 0;
+}
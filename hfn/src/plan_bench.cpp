@@ -0,0 +1,109 @@
+// Time OccupancyMap's planners on random queries over the map from a map
+// server.  For each query every planner must find a path of the same length;
+// mismatches are counted and reported.
+//
+// usage: rosrun hfn plan_bench _queries:=200 _min_distance:=10.0
+#include <cstdlib>
+
+#include <boost/scoped_ptr.hpp>
+
+#include <ros/ros.h>
+
+#include "player_map/rosmap.hpp"
+
+using namespace std;
+using namespace scarab;
+
+struct Stats {
+  Stats() : seconds(0.0), expanded(0), found(0) { }
+  double seconds;
+  long expanded;
+  int found;
+};
+
+void samplePoint(OccupancyMap *map, double lethal_occ_dist,
+                 double *x, double *y) {
+  do {
+    *x = map->minX() + (map->maxX() - map->minX()) * drand48();
+    *y = map->minY() + (map->maxY() - map->minY()) * drand48();
+  } while (!map->safePoint(*x, *y, lethal_occ_dist));
+}
+
+void report(const char *name, const Stats &stats, int queries) {
+  ROS_INFO("%-14s %8.3f ms/query %10.0f expanded/query %4i/%i found",
+           name, 1000.0 * stats.seconds / queries,
+           double(stats.expanded) / queries, stats.found, queries);
+}
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "plan_bench");
+  ros::NodeHandle pnh("~");
+
+  int queries, seed;
+  double max_occ_dist, lethal_occ_dist, min_distance;
+  bool allow_unknown;
+  string map_service;
+  pnh.param("queries", queries, 100);
+  pnh.param("seed", seed, 0);
+  pnh.param("max_occ_dist", max_occ_dist, 0.5);
+  pnh.param("lethal_occ_dist", lethal_occ_dist, 0.23);
+  pnh.param("min_distance", min_distance, 5.0);
+  pnh.param("allow_unknown", allow_unknown, false);
+  pnh.param("map_service", map_service, string("static_map"));
+
+  // Landmarks only guide astar(), so compare against a map without them
+  boost::scoped_ptr<OccupancyMap> map(OccupancyMap::FromMapServer(map_service.c_str()));
+  map->setLandmarks(0);
+  map->updateCSpace(max_occ_dist, lethal_occ_dist);
+  boost::scoped_ptr<OccupancyMap> alt_map(OccupancyMap::FromMapServer(map_service.c_str()));
+  ros::WallTime start = ros::WallTime::now();
+  alt_map->updateCSpace(max_occ_dist, lethal_occ_dist);
+  ROS_INFO("C-space and landmarks took %.3f ms",
+           1000.0 * (ros::WallTime::now() - start).toSec());
+  srand48(seed);
+
+  Stats unidirectional, alt, bidirectional;
+  int mismatches = 0;
+  for (int q = 0; q < queries; ++q) {
+    double x1, y1, x2, y2;
+    do {
+      samplePoint(map.get(), lethal_occ_dist, &x1, &y1);
+      samplePoint(map.get(), lethal_occ_dist, &x2, &y2);
+    } while (hypot(x2 - x1, y2 - y1) < min_distance);
+
+    start = ros::WallTime::now();
+    Path uni = map->astar(x1, y1, x2, y2, lethal_occ_dist, allow_unknown);
+    unidirectional.seconds += (ros::WallTime::now() - start).toSec();
+    unidirectional.expanded += map->expanded();
+    unidirectional.found += !uni.empty();
+
+    start = ros::WallTime::now();
+    Path landmarks = alt_map->astar(x1, y1, x2, y2, lethal_occ_dist, allow_unknown);
+    alt.seconds += (ros::WallTime::now() - start).toSec();
+    alt.expanded += alt_map->expanded();
+    alt.found += !landmarks.empty();
+
+    start = ros::WallTime::now();
+    Path bi = map->bidirectionalAstar(x1, y1, x2, y2, lethal_occ_dist,
+                                      allow_unknown);
+    bidirectional.seconds += (ros::WallTime::now() - start).toSec();
+    bidirectional.expanded += map->expanded();
+    bidirectional.found += !bi.empty();
+
+    // Ties can be broken differently, but lengths must agree
+    if (uni.empty() != bi.empty() || uni.empty() != landmarks.empty() ||
+        (!uni.empty() && (fabs(pathLength(uni) - pathLength(bi)) > 1e-3 ||
+                          fabs(pathLength(uni) - pathLength(landmarks)) > 1e-3))) {
+      ++mismatches;
+    }
+  }
+
+  report("astar", unidirectional, queries);
+  report("astar (ALT)", alt, queries);
+  report("bidirectional", bidirectional, queries);
+  if (mismatches > 0) {
+    ROS_ERROR("%i queries had paths of different lengths", mismatches);
+    return 1;
+  }
+  return 0;
+}
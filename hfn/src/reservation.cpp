@@ -0,0 +1,268 @@
+#include "reservation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+#include <boost/unordered_set.hpp>
+
+namespace scarab {
+
+ReservationPlanner::ReservationPlanner(const Params &p)
+  : params_(p), step_time_(0.0), epoch_(ros::Time::now()),
+    size_x_(0), size_y_(0), min_x_(0.0), min_y_(0.0), resolution_(0.0) {
+}
+
+void ReservationPlanner::setMap(const OccupancyMap &map) {
+  int size_x = map.numX(), size_y = map.numY();
+  double min_x = map.minX(), min_y = map.minY();
+  double resolution = (map.maxX() - min_x) / size_x;
+  // Reserved cells refer to the old grid
+  if (size_x != size_x_ || size_y != size_y_ || min_x != min_x_ ||
+      min_y != min_y_ || resolution != resolution_) {
+    if (!reservations_.empty()) {
+      ROS_WARN("ReservationPlanner: Map geometry changed, dropping %zu reservations",
+               reservations_.size());
+    }
+    table_.clear();
+    reservations_.clear();
+  }
+  size_x_ = size_x;
+  size_y_ = size_y;
+  min_x_ = min_x;
+  min_y_ = min_y;
+  resolution_ = resolution;
+  step_time_ = M_SQRT2 * resolution_ / params_.speed;
+
+  cost_.resize(size_x_ * size_y_);
+  unknown_.resize(size_x_ * size_y_);
+  for (int j = 0; j < size_y_; ++j) {
+    for (int i = 0; i < size_x_; ++i) {
+      map_cell_t cell = map.at(i, j);
+      cost_[i + j * size_x_] = cell.cost;
+      unknown_[i + j * size_x_] = cell.occ_state == map_cell_t::UNKNOWN;
+    }
+  }
+
+  footprint_.clear();
+  double r = 2.0 * params_.robot_radius / resolution_;
+  int n = ceil(r);
+  for (int dj = -n; dj <= n; ++dj) {
+    for (int di = -n; di <= n; ++di) {
+      if (di * di + dj * dj <= r * r) {
+        footprint_.push_back(std::make_pair(di, dj));
+      }
+    }
+  }
+}
+
+int ReservationPlanner::toCell(const Eigen::Vector2f &p) const {
+  int i = floor((p.x() - min_x_) / resolution_ + 0.5);
+  int j = floor((p.y() - min_y_) / resolution_ + 0.5);
+  if (i < 0 || i >= size_x_ || j < 0 || j >= size_y_) {
+    return -1;
+  }
+  return i + j * size_x_;
+}
+
+void ReservationPlanner::mark(const Reservation &r, int delta) {
+  for (size_t k = 0; k < r.cells.size(); ++k) {
+    int ci = r.cells[k] % size_x_, cj = r.cells[k] / size_x_;
+    for (size_t f = 0; f < footprint_.size(); ++f) {
+      int i = ci + footprint_[f].first, j = cj + footprint_[f].second;
+      if (i < 0 || i >= size_x_ || j < 0 || j >= size_y_) {
+        continue;
+      }
+      uint64_t k2 = key(i + j * size_x_, r.first_step + k);
+      if (delta > 0) {
+        ++table_[k2];
+      } else {
+        boost::unordered_map<uint64_t, uint16_t>::iterator it = table_.find(k2);
+        if (it != table_.end() && --it->second == 0) {
+          table_.erase(it);
+        }
+      }
+    }
+  }
+}
+
+void ReservationPlanner::expire(int now_step) {
+  for (std::map<std::string, Reservation>::iterator it = reservations_.begin();
+       it != reservations_.end(); ++it) {
+    Reservation &r = it->second;
+    // The last cell is kept; it's where the robot is parked
+    int n = std::min<int>(now_step - r.first_step, r.cells.size() - 1);
+    if (n <= 0) {
+      continue;
+    }
+    Reservation past;
+    past.first_step = r.first_step;
+    past.cells.assign(r.cells.begin(), r.cells.begin() + n);
+    mark(past, -1);
+    r.cells.erase(r.cells.begin(), r.cells.begin() + n);
+    r.first_step += n;
+  }
+}
+
+int ReservationPlanner::endStep() const {
+  int end = 0;
+  for (std::map<std::string, Reservation>::const_iterator it = reservations_.begin();
+       it != reservations_.end(); ++it) {
+    end = std::max<int>(end, it->second.first_step + it->second.cells.size());
+  }
+  return end;
+}
+
+bool ReservationPlanner::conflicts(int cell, int step) const {
+  if (table_.find(key(cell, step)) != table_.end()) {
+    return true;
+  }
+  // Parked robots stay in the table only for their last step
+  int i = cell % size_x_, j = cell / size_x_;
+  double r = 2.0 * params_.robot_radius / resolution_;
+  for (std::map<std::string, Reservation>::const_iterator it = reservations_.begin();
+       it != reservations_.end(); ++it) {
+    const Reservation &res = it->second;
+    if (step < res.first_step + int(res.cells.size())) {
+      continue;
+    }
+    int di = i - res.cells.back() % size_x_, dj = j - res.cells.back() / size_x_;
+    if (di * di + dj * dj <= r * r) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ReservationPlanner::canPark(int cell, int step) const {
+  // After endStep() only parked robots remain, so one more step covers them
+  int end = std::max(endStep(), step);
+  for (int s = step; s <= end; ++s) {
+    if (conflicts(cell, s)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReservationPlanner::search(int start, int stop, int first_step,
+                                int last_step, bool park,
+                                std::vector<int> *cells) {
+  static const int kNeighborI[] = { 1, 0, -1, 0, 1, -1, -1, 1, 0 };
+  static const int kNeighborJ[] = { 0, 1, 0, -1, 1, 1, -1, -1, 0 };
+  int stopi = stop % size_x_, stopj = stop / size_x_;
+
+  std::vector<Node> pool;
+  NodeCompare compare;
+  compare.pool = &pool;
+  std::priority_queue<int, std::vector<int>, NodeCompare> open(compare);
+  boost::unordered_set<uint64_t> closed;
+
+  // Each step moves at most one cell, so Chebyshev distance is a lower bound
+  // on the steps left, and steps are the least part of the cost
+  int starti = start % size_x_, startj = start / size_x_;
+  pool.push_back(Node(start, first_step, 0.0,
+                      std::max(abs(starti - stopi), abs(startj - stopj)), -1));
+  open.push(0);
+  int expansions = 0;
+  while (!open.empty() && expansions < params_.max_expansions) {
+    int index = open.top();
+    open.pop();
+    const Node node = pool[index];
+    if (!closed.insert(key(node.cell, node.step)).second) {
+      continue;
+    }
+    ++expansions;
+
+    if (node.cell == stop && (!park || canPark(stop, node.step))) {
+      std::vector<int> reversed;
+      for (int k = index; pool[k].parent != -1; k = pool[k].parent) {
+        reversed.push_back(pool[k].cell);
+      }
+      cells->insert(cells->end(), reversed.rbegin(), reversed.rend());
+      return true;
+    }
+    if (node.step >= last_step) {
+      continue;
+    }
+
+    int ci = node.cell % size_x_, cj = node.cell / size_x_;
+    // The last neighbor is waiting in place
+    for (int k = 0; k < 9; ++k) {
+      int i = ci + kNeighborI[k], j = cj + kNeighborJ[k];
+      if (i < 0 || i >= size_x_ || j < 0 || j >= size_y_) {
+        continue;
+      }
+      int cell = i + j * size_x_;
+      int step = node.step + 1;
+      if (!traversable(cell) || conflicts(cell, step) ||
+          closed.count(key(cell, step))) {
+        continue;
+      }
+      float g = node.true_cost + 1.0 + cost_[cell];
+      float h = std::max(abs(i - stopi), abs(j - stopj));
+      pool.push_back(Node(cell, step, g, g + h, index));
+      open.push(pool.size() - 1);
+    }
+  }
+  return false;
+}
+
+bool ReservationPlanner::plan(const std::string &robot,
+                              const Eigen::Vector2f &start,
+                              const Path &goals, const ros::Time &now,
+                              Path *path, std::vector<ros::Time> *times) {
+  path->clear();
+  times->clear();
+  release(robot);
+  if (cost_.empty()) {
+    ROS_WARN("ReservationPlanner::plan() Map not set");
+    return false;
+  }
+
+  int now_step = std::max(0.0, floor((now - epoch_).toSec() / step_time_));
+  expire(now_step);
+  int last_step = now_step + int(params_.horizon / step_time_);
+
+  Reservation r;
+  r.first_step = now_step;
+  r.cells.push_back(toCell(start));
+  if (r.cells.back() < 0) {
+    ROS_WARN("ReservationPlanner: %s starts outside of the map", robot.c_str());
+    return false;
+  }
+  for (size_t k = 0; k < goals.size(); ++k) {
+    int stop = toCell(goals[k]);
+    if (stop < 0 || !traversable(stop)) {
+      ROS_WARN("ReservationPlanner: Goal (%.2f, %.2f) of %s isn't traversable",
+               goals[k].x(), goals[k].y(), robot.c_str());
+      return false;
+    }
+    if (!search(r.cells.back(), stop, r.first_step + r.cells.size() - 1,
+                last_step, k + 1 == goals.size(), &r.cells)) {
+      ROS_WARN("ReservationPlanner: No conflict free path for %s to (%.2f, %.2f)",
+               robot.c_str(), goals[k].x(), goals[k].y());
+      return false;
+    }
+  }
+
+  mark(r, 1);
+  reservations_[robot] = r;
+  for (size_t k = 0; k < r.cells.size(); ++k) {
+    int i = r.cells[k] % size_x_, j = r.cells[k] / size_x_;
+    path->push_back(Eigen::Vector2f(min_x_ + i * resolution_,
+                                    min_y_ + j * resolution_));
+    times->push_back(epoch_ + ros::Duration((r.first_step + k) * step_time_));
+  }
+  return true;
+}
+
+void ReservationPlanner::release(const std::string &robot) {
+  std::map<std::string, Reservation>::iterator it = reservations_.find(robot);
+  if (it != reservations_.end()) {
+    mark(it->second, -1);
+    reservations_.erase(it);
+  }
+}
+
+} // end namespace scarab
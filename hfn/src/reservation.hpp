@@ -0,0 +1,113 @@
+#ifndef RESERVATION_HPP
+#define RESERVATION_HPP
+
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+#include <ros/ros.h>
+
+#include "player_map/rosmap.hpp"
+
+namespace scarab {
+
+// Prioritized planning for several robots sharing a map: each robot's path
+// is found with A* over space and time, avoiding the paths reserved by robots
+// that asked earlier, and is then reserved in turn.  Time is split into steps
+// in which a robot moves to a neighboring cell or waits.  A robot stays at
+// the end of its path until it reserves a new one or releases it.
+class ReservationPlanner {
+public:
+  struct Params {
+    double robot_radius;   // robots whose centers are closer than twice this collide
+    double speed;          // nominal speed of the robots (m/s)
+    double horizon;        // longest path to plan, in seconds
+    int max_expansions;    // give up after expanding this many states
+    bool allow_unknown;    // allow paths through unknown space
+  };
+
+  explicit ReservationPlanner(const Params &p);
+
+  // Copy the costs of map; existing reservations are kept
+  void setMap(const OccupancyMap &map);
+
+  // Plan a path for robot from start through each of goals, starting at now,
+  // and reserve it in place of the robot's previous path.  Each point of path
+  // comes with the time at which the robot should be there.  On failure the
+  // robot keeps no reservation.
+  bool plan(const std::string &robot, const Eigen::Vector2f &start,
+            const Path &goals, const ros::Time &now,
+            Path *path, std::vector<ros::Time> *times);
+  void release(const std::string &robot);
+
+  // Seconds per step; long enough to cross a cell diagonally
+  double stepTime() const { return step_time_; }
+
+private:
+  struct Node {
+    Node(int c, int s, float g, float f, int p)
+      : cell(c), step(s), true_cost(g), heuristic(f), parent(p) { }
+    int cell, step;
+    float true_cost, heuristic; // heuristic is true_cost + cost to go
+    int parent;                 // index of parent in the node pool, -1 if none
+  };
+
+  struct NodeCompare {
+    const std::vector<Node> *pool;
+    bool operator()(int l, int r) const {
+      return (*pool)[l].heuristic > (*pool)[r].heuristic;
+    }
+  };
+
+  // Reserved path of a robot; the robot is parked at the last cell
+  struct Reservation {
+    int first_step;
+    std::vector<int> cells; // cell at each step from first_step on
+  };
+
+  static uint64_t key(int cell, int step) {
+    return (uint64_t(step) << 32) | uint32_t(cell);
+  }
+  bool traversable(int cell) const {
+    return cost_[cell] != std::numeric_limits<float>::infinity() &&
+      (params_.allow_unknown || !unknown_[cell]);
+  }
+  // True if a robot at cell during step would collide with another robot
+  bool conflicts(int cell, int step) const;
+  // True if a robot could stay at cell from step on
+  bool canPark(int cell, int step) const;
+  // Space-time A* from start at first_step to stop, finishing by last_step;
+  // appends the cells after start to cells.  If park, the robot must be able
+  // to stay at stop.
+  bool search(int start, int stop, int first_step, int last_step, bool park,
+              std::vector<int> *cells);
+  int toCell(const Eigen::Vector2f &p) const;
+  // Add (1) or remove (-1) the footprint of r in the table
+  void mark(const Reservation &r, int delta);
+  // Forget steps that have passed
+  void expire(int now_step);
+  // Step after the last one in the table
+  int endStep() const;
+
+  Params params_;
+  double step_time_;
+  ros::Time epoch_; // start of step 0
+
+  // Copy of the map
+  int size_x_, size_y_;
+  double min_x_, min_y_, resolution_;
+  std::vector<float> cost_;
+  std::vector<uint8_t> unknown_;
+  // Cells within two robot radii of the origin
+  std::vector<std::pair<int, int> > footprint_;
+
+  // Number of robots whose footprint covers each (cell, step)
+  boost::unordered_map<uint64_t, uint16_t> table_;
+  std::map<std::string, Reservation> reservations_;
+};
+
+} // end namespace scarab
+#endif
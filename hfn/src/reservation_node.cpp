@@ -0,0 +1,108 @@
+// Serve paths planned by a ReservationPlanner to the robots sharing a map.
+// Each robot's HFNWrapper asks for its path with the ReservePath service when
+// its reservation_service param is set.
+//
+// usage: rosrun hfn reservation_server map:=/map
+#include <boost/scoped_ptr.hpp>
+
+#include <ros/ros.h>
+#include <nav_msgs/OccupancyGrid.h>
+
+#include <scarab_msgs/ReservePath.h>
+
+#include "player_map/rosmap.hpp"
+#include "reservation.hpp"
+
+using namespace std;
+using namespace scarab;
+
+class ReservationServer {
+public:
+  ReservationServer(ros::NodeHandle &pnh) : have_map_(false) {
+    ReservationPlanner::Params p;
+    pnh.param("robot_radius", p.robot_radius, 0.23);
+    pnh.param("speed", p.speed, 0.5);
+    pnh.param("horizon", p.horizon, 120.0);
+    pnh.param("max_expansions", p.max_expansions, 500000);
+    pnh.param("allow_unknown_path", p.allow_unknown, true);
+    pnh.param("max_occ_dist", max_occ_dist_, 0.5);
+    pnh.param("lethal_occ_dist", lethal_occ_dist_, 0.23);
+    pnh.param("cost_occ_prob", cost_occ_prob_, 0.0);
+    pnh.param("cost_occ_dist", cost_occ_dist_, 0.0);
+    int free_threshold, occupied_threshold;
+    pnh.param("free_threshold", free_threshold, 0);
+    pnh.param("occupied_threshold", occupied_threshold, 100);
+    pnh.param("map_frame_id", map_frame_, string("/map"));
+
+    map_.setThresholds(free_threshold, occupied_threshold);
+    // Only the cost of each cell is used
+    map_.setLandmarks(0);
+    planner_.reset(new ReservationPlanner(p));
+
+    map_sub_ = nh_.subscribe("map", 1, &ReservationServer::onMap, this);
+    service_ = nh_.advertiseService("reserve_path",
+                                    &ReservationServer::reservePath, this);
+  }
+
+  void onMap(const nav_msgs::OccupancyGrid &grid) {
+    map_.setMap(grid, max_occ_dist_, lethal_occ_dist_,
+                cost_occ_prob_, cost_occ_dist_);
+    planner_->setMap(map_);
+    have_map_ = true;
+  }
+
+  bool reservePath(scarab_msgs::ReservePath::Request &req,
+                   scarab_msgs::ReservePath::Response &res) {
+    if (req.goals.empty()) {
+      planner_->release(req.robot);
+      res.success = true;
+      return true;
+    }
+    if (!have_map_) {
+      ROS_WARN("ReservationServer: No map yet, can't plan for %s",
+               req.robot.c_str());
+      res.success = false;
+      return true;
+    }
+
+    Path goals, path;
+    vector<ros::Time> times;
+    for (size_t i = 0; i < req.goals.size(); ++i) {
+      goals.push_back(Eigen::Vector2f(req.goals[i].x, req.goals[i].y));
+    }
+    ros::WallTime start = ros::WallTime::now();
+    res.success = planner_->plan(req.robot,
+                                 Eigen::Vector2f(req.start.x, req.start.y),
+                                 goals, ros::Time::now(), &path, &times);
+    ROS_DEBUG("ReservationServer: Planned for %s in %.3fs", req.robot.c_str(),
+              (ros::WallTime::now() - start).toSec());
+
+    res.path.resize(path.size());
+    for (size_t i = 0; i < path.size(); ++i) {
+      res.path[i].header.frame_id = map_frame_;
+      res.path[i].header.stamp = times[i];
+      res.path[i].pose.position.x = path[i].x();
+      res.path[i].pose.position.y = path[i].y();
+      res.path[i].pose.orientation.w = 1.0;
+    }
+    return true;
+  }
+
+private:
+  ros::NodeHandle nh_;
+  ros::Subscriber map_sub_;
+  ros::ServiceServer service_;
+  OccupancyMap map_;
+  boost::scoped_ptr<ReservationPlanner> planner_;
+  bool have_map_;
+  double max_occ_dist_, lethal_occ_dist_, cost_occ_prob_, cost_occ_dist_;
+  string map_frame_;
+};
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "reservation_server");
+  ros::NodeHandle pnh("~");
+  ReservationServer server(pnh);
+  ros::spin();
+  return 0;
+}
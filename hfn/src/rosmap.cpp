@@ -1,14 +1,28 @@
 #include "player_map/rosmap.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <functional>
+#include <queue>
 
 #include <ros/ros.h>
 
 #include <nav_msgs/GetMap.h>
 
+#include "cell_kernels.hpp"
+
 using namespace std;
 namespace scarab {
 
+// Neighbor offsets used by searches; axis aligned neighbors come first so that
+// 4 connected searches can use a prefix
+static const int kNeighborI[8] = {1, 0, -1, 0, 1, -1, -1, 1};
+static const int kNeighborJ[8] = {0, 1, 0, -1, 1, 1, -1, -1};
+// Landmark distances are stored in quarter cells unless the map is too large
+// for that to fit in 16 bits
+static const float kLandmarkScale = 4.0;
+
 double pathLength(const Path &path) {
   double dist = 0.0;
   for (size_t i = 0; i < path.size() - 1; ++i) {
@@ -28,21 +42,24 @@ void convertMap(const nav_msgs::OccupancyGrid &map, map_t *pmap,
   // Convert to player format
   pmap->cells = (map_cell_t*)malloc(sizeof(map_cell_t)*pmap->size_x*pmap->size_y);
   ROS_ASSERT(pmap->cells);
-  for(int i = 0; i < pmap->size_x * pmap->size_y; ++i) {
-    if(0 <= map.data[i] && map.data[i] <= free_threshold) {
-      pmap->cells[i].occ_state = map_cell_t::FREE;
-    } else if(occupied_threshold <= map.data[i] && map.data[i] <= 100) {
-      pmap->cells[i].occ_state = map_cell_t::OCCUPIED;
-    } else {
-      pmap->cells[i].occ_state = map_cell_t::UNKNOWN;
-    }
-
-    pmap->cells[i].occ_prob = map.data[i];
-    pmap->cells[i].occ_dist = 0;
-    pmap->cells[i].cost = 0.;
+  if (!map.data.empty()) {
+    convertCells(&map.data[0], pmap->size_x * pmap->size_y, free_threshold,
+                 occupied_threshold, pmap->cells);
   }
 }
 
+// Deep copy, so that a copy of a published map can be changed
+map_t* copyMap(const map_t *map) {
+  map_t *copy = map_alloc();
+  ROS_ASSERT(copy);
+  *copy = *map;
+  size_t size = sizeof(map_cell_t) * map->size_x * map->size_y;
+  copy->cells = (map_cell_t*)malloc(size);
+  ROS_ASSERT(copy->cells);
+  memcpy(copy->cells, map->cells, size);
+  return copy;
+}
+
 
 map_t * requestCSpaceMap(const char *srv_name, const int free_threshold,
                          const int occupied_threshold) {
@@ -72,17 +89,141 @@ map_t * requestCSpaceMap(const char *srv_name, const int free_threshold,
   return map;
 }
 
+struct OccupancyMap::Snapshot : boost::noncopyable {
+  // Inclusive range of map cells; empty if min > max
+  struct Region {
+    Region() : min_i(0), min_j(0), max_i(-1), max_j(-1) { }
+    Region(int i0, int j0, int i1, int j1)
+      : min_i(i0), min_j(j0), max_i(i1), max_j(j1) { }
+    bool empty() const { return min_i > max_i || min_j > max_j; }
+    bool contains(int i, int j) const {
+      return min_i <= i && i <= max_i && min_j <= j && j <= max_j;
+    }
+    void add(int i, int j) {
+      if (empty()) {
+        *this = Region(i, j, i, j);
+      } else {
+        min_i = std::min(min_i, i);
+        min_j = std::min(min_j, j);
+        max_i = std::max(max_i, i);
+        max_j = std::max(max_j, j);
+      }
+    }
+    // Grow by n cells on every side, keeping within map
+    Region grow(int n, const map_t *map) const {
+      if (empty()) {
+        return *this;
+      }
+      return Region(std::max(min_i - n, 0), std::max(min_j - n, 0),
+                    std::min(max_i + n, map->size_x - 1),
+                    std::min(max_j + n, map->size_y - 1));
+    }
+    int min_i, min_j, max_i, max_j;
+  };
+
+  // Takes ownership of m
+  Snapshot(map_t *m)
+    : map(m), max_occ_dist(0.0), lethal_occ_dist(0.0),
+      cost_occ_prob(0.0), cost_occ_dist(0.0),
+      pad_x(0), pad_y(0), ncells(0), num_landmarks(0),
+      landmark_scale(kLandmarkScale) { }
+  ~Snapshot() {
+    map_free(map);
+  }
+
+  // These fill in a snapshot before it is published
+  bool updateCSpace(double max_occ_dist, double lethal_occ_dist,
+                    double cost_occ_prob, double cost_occ_dist);
+  void buildSearchGrid();
+  void buildLandmarks(int num_landmarks);
+  void updateSearchGrid(const Region &r);
+
+  // Live obstacles
+  // Copy of this snapshot with a live obstacle layer; the static map and
+  // landmarks are shared
+  Snapshot* clone() const;
+  // Copy the cells of r from other, a newer version of the same map
+  void copyRegion(const Snapshot &other, const Region &r);
+  // Recompute occupancy, distances and costs of the cells in r from the
+  // static map and the live obstacles
+  void updateRegion(const Region &r);
+
+  // Dijkstra over traversable cells using edge lengths only; dist must be
+  // initialized, and cells already closer than the source are left alone.
+  // Returns the number of cells reached.
+  int expandDistances(int source, float *dist) const;
+
+  // Convert between grid coordinates and indices into the padded grid
+  int gridIndex(int i, int j) const {
+    return (i + 1) + (j + 1) * pad_x;
+  }
+  void gridCoord(int index, int *i, int *j) const {
+    *i = index % pad_x - 1;
+    *j = index / pad_x - 1;
+  }
+
+  template <bool Reverse, class Heuristic, class Visitor>
+  void search(const Heuristic &h, bool allow_unknown, int connectivity,
+              Visitor *visitor, SearchState *state) const;
+  template <class Policy, class Visitor>
+  void searchLoop(const typename Policy::Heuristic &h, Visitor *visitor,
+                  SearchState *state) const;
+  template <class Heuristic>
+  void bidirectionalSearch(const Heuristic &hf, const Heuristic &hb,
+                           bool allow_unknown, int connectivity,
+                           SearchState *forward, SearchState *backward,
+                           Meeting *meeting) const;
+  template <class ForwardPolicy, class BackwardPolicy>
+  void bidirectionalLoop(const typename ForwardPolicy::Heuristic &hf,
+                         const typename BackwardPolicy::Heuristic &hb,
+                         SearchState *forward, SearchState *backward,
+                         Meeting *meeting) const;
+  template <class Policy>
+  void addNeighbors(const Node &node, const typename Policy::Heuristic &h,
+                    SearchState *state, Meeting *meeting = NULL) const;
+  void buildPath(int index, const SearchState &state, Path *path) const;
+  // Index of the cell to follow a navigation function from, -1 if none
+  int navigationIndex(const SearchState &navigation, int connectivity,
+                      int i, int j) const;
+
+  map_t *map;
+  double max_occ_dist, lethal_occ_dist;
+  double cost_occ_prob, cost_occ_dist;
+
+  // Search grid has a one cell border of untraversable cells around the map
+  // so that neighbors never need to be bounds checked
+  int pad_x, pad_y, ncells;
+  boost::scoped_array<float> search_cost;     // infinite if untraversable
+  boost::scoped_array<uint8_t> search_unknown;
+  int offsets[8];      // index offsets to neighbors; 4 connected ones first
+  float edge_costs[8]; // length of edge to each neighbor
+
+  // Distance to each landmark, in units of 1 / landmark_scale cells, stored
+  // num_landmarks per cell of the search grid; 0xffff if unreachable
+  int num_landmarks;
+  std::vector<int> landmarks;
+  float landmark_scale;
+  boost::shared_array<uint16_t> landmark_dist;
+
+  // Live obstacle layer, NULL until the first updateObstacles().  Landmark
+  // distances ignore it; obstacles only lengthen paths, so they remain lower
+  // bounds.
+  boost::shared_ptr<map_t> base; // map without live obstacles
+  boost::scoped_array<uint8_t> marks; // nonzero if a live obstacle is in cell
+  Region marked; // contains every marked cell
+  // Cells in which this differs from the published snapshot, if this is the
+  // spare
+  Region stale;
+};
+
 
 OccupancyMap::OccupancyMap()
-  : map_(NULL), ncells_(0), max_free_threshold_(0),
-    min_occupied_threshold_(100), max_occ_dist_(0.0), lethal_occ_dist_(0.0) {
+  : max_free_threshold_(0), min_occupied_threshold_(100), connectivity_(8),
+    num_landmarks_(8), context_(new SearchContext()) {
 
 }
 
 OccupancyMap::~OccupancyMap() {
-  if (map_ != NULL) {
-    map_free(map_);
-  }
 }
 
 OccupancyMap* OccupancyMap::FromMapServer(const char *srv_name,
@@ -93,20 +234,56 @@ OccupancyMap* OccupancyMap::FromMapServer(const char *srv_name,
   return occ_map;
 }
 
+boost::shared_ptr<const OccupancyMap::Snapshot> OccupancyMap::snapshot() const {
+  return boost::atomic_load(&snapshot_);
+}
+
+void OccupancyMap::publish(const boost::shared_ptr<const Snapshot> &snapshot) {
+  // Readers still holding the old snapshot keep it alive until they finish
+  boost::atomic_store(&snapshot_, snapshot);
+}
+
 void OccupancyMap::setMap(map_t *map) {
-  if (map_ != NULL) {
-    map_free(map_);
+  boost::mutex::scoped_lock lock(write_mutex_);
+  spare_.reset();
+  if (map == NULL) {
+    publish(boost::shared_ptr<const Snapshot>());
+    return;
   }
-  map_ = map;
+  boost::shared_ptr<Snapshot> snapshot(new Snapshot(map));
+  snapshot->buildSearchGrid();
+  publish(snapshot);
 }
 
 void OccupancyMap::setMap(const nav_msgs::OccupancyGrid &grid) {
-  if (map_ != NULL) {
-    map_free(map_);
+  boost::mutex::scoped_lock lock(write_mutex_);
+  spare_.reset();
+  map_t *map = map_alloc();
+  ROS_ASSERT(map);
+  convertMap(grid, map, max_free_threshold_, min_occupied_threshold_);
+  boost::shared_ptr<Snapshot> snapshot(new Snapshot(map));
+  snapshot->buildSearchGrid();
+  publish(snapshot);
+}
+
+void OccupancyMap::setMap(const nav_msgs::OccupancyGrid &grid,
+                          double max_occ_dist, double lethal_occ_dist,
+                          double cost_occ_prob /* = 0.0 */,
+                          double cost_occ_dist /* = 0.0 */) {
+  boost::mutex::scoped_lock lock(write_mutex_);
+  spare_.reset();
+  map_t *map = map_alloc();
+  ROS_ASSERT(map);
+  convertMap(grid, map, max_free_threshold_, min_occupied_threshold_);
+  boost::shared_ptr<Snapshot> snapshot(new Snapshot(map));
+  bool cspace = max_occ_dist > 0.0 &&
+    snapshot->updateCSpace(max_occ_dist, lethal_occ_dist,
+                           cost_occ_prob, cost_occ_dist);
+  snapshot->buildSearchGrid();
+  if (cspace) {
+    snapshot->buildLandmarks(num_landmarks_);
   }
-  map_ = map_alloc();
-  ROS_ASSERT(map_);
-  convertMap(grid, map_, max_free_threshold_, min_occupied_threshold_);
+  publish(snapshot);
 }
 
 bool OccupancyMap::safePoint(double x, double y) const {
@@ -114,60 +291,279 @@ bool OccupancyMap::safePoint(double x, double y) const {
 }
 
 bool OccupancyMap::safePoint(double x, double y, double safe_dist) const {
-  const map_cell_t *cell = getCell(x, y);
-  return (cell != NULL && cell->occ_state == map_cell_t::FREE &&
-          cell->occ_dist >= safe_dist);
+  map_cell_t cell;
+  return (getCell(x, y, &cell) && cell.occ_state == map_cell_t::FREE &&
+          cell.occ_dist >= safe_dist);
 }
 
 void OccupancyMap::updateCSpace(double max_occ_dist,
                                 double lethal_occ_dist,
                                 double cost_occ_prob /* = 0.0 */,
                                 double cost_occ_dist /* = 0.0 */) {
+  boost::mutex::scoped_lock lock(write_mutex_);
+  boost::shared_ptr<const Snapshot> current = snapshot();
   // check if cspace needs to be updated
-  if (map_ == NULL || map_->max_occ_dist >= max_occ_dist) {
+  if (!current || current->map->max_occ_dist >= max_occ_dist) {
+    return;
+  }
+  // The current map may be in use, so update a copy; live obstacles are
+  // dropped
+  map_t *map = copyMap(current->base ? current->base.get() : current->map);
+  boost::shared_ptr<Snapshot> snapshot(new Snapshot(map));
+  if (!snapshot->updateCSpace(max_occ_dist, lethal_occ_dist,
+                              cost_occ_prob, cost_occ_dist)) {
     return;
   }
+  snapshot->buildSearchGrid();
+  snapshot->buildLandmarks(num_landmarks_);
+  spare_.reset();
+  publish(snapshot);
+}
+
+bool OccupancyMap::Snapshot::updateCSpace(double max_occ_dist,
+                                          double lethal_occ_dist,
+                                          double cost_occ_prob,
+                                          double cost_occ_dist) {
   if (cost_occ_prob < 0.0) {
     ROS_ERROR("cost_occ_prob must be non-negative");
-    return;
+    return false;
   }
   if (cost_occ_dist < 0.0) {
     ROS_ERROR("cost_occ_dist must be non-negative");
-    return;
+    return false;
   }
   if (max_occ_dist < lethal_occ_dist) {
     ROS_ERROR("max_occ_dist must be at least lethal_occ_dist");
-    return;
+    return false;
   }
-  max_occ_dist_ = max_occ_dist;
-  lethal_occ_dist_ = lethal_occ_dist;
-  map_update_cspace(map_, max_occ_dist);
+  this->max_occ_dist = max_occ_dist;
+  this->lethal_occ_dist = lethal_occ_dist;
+  this->cost_occ_prob = cost_occ_prob;
+  this->cost_occ_dist = cost_occ_dist;
+  map_update_cspace(map, max_occ_dist);
   // compute cost for each cell
-  for (int i = 0; i < map_->size_x * map_->size_y; ++i) {
-    if (map_->cells[i].occ_state == map_cell_t::OCCUPIED ||
-        map_->cells[i].occ_dist <= lethal_occ_dist) {
-      map_->cells[i].cost = std::numeric_limits<float>::infinity();
-    } else {
-      map_->cells[i].cost = 0.0;
-      // Add cost occ prob
-      if (map_->cells[i].occ_prob < 0 || map_->cells[i].occ_prob > 100) {
-        map_->cells[i].cost += cost_occ_prob * 0.5;
+  computeCosts(map->cells, map->size_x * map->size_y, max_occ_dist,
+               lethal_occ_dist, cost_occ_prob, cost_occ_dist);
+  return true;
+}
+
+void OccupancyMap::updateObstacles(double x, double y, const Path &hits,
+                                   const Path &misses, double window) {
+  boost::mutex::scoped_lock lock(write_mutex_);
+  boost::shared_ptr<const Snapshot> current = snapshot();
+  if (!current) {
+    return;
+  }
+  if (current->max_occ_dist <= 0.0) {
+    ROS_WARN_ONCE("OccupancyMap::updateObstacles() C-space must be computed "
+                  "before adding obstacles");
+    return;
+  }
+  const map_t *map = current->map;
+
+  // Update the spare in place if nobody is using it; it only needs to catch
+  // up with the last update.  Otherwise, start from a copy.
+  boost::shared_ptr<Snapshot> next;
+  if (spare_ && spare_.unique() && spare_->marks) {
+    next.swap(spare_);
+    next->copyRegion(*current, next->stale);
+  } else {
+    spare_.reset();
+    next.reset(current->clone());
+  }
+
+  int ci = MAP_GXWX(map, x), cj = MAP_GYWY(map, y);
+  int w = ceil(window / map->scale);
+  Snapshot::Region bounds(std::max(ci - w, 0), std::max(cj - w, 0),
+                          std::min(ci + w, map->size_x - 1),
+                          std::min(cj + w, map->size_y - 1));
+  uint8_t *marks = next->marks.get();
+  Snapshot::Region changed, marked;
+
+  // Forget obstacles that have left the window
+  const Snapshot::Region &old = next->marked;
+  for (int j = old.min_j; j <= old.max_j; ++j) {
+    for (int i = old.min_i; i <= old.max_i; ++i) {
+      int index = MAP_INDEX(map, i, j);
+      if (!marks[index]) {
+        continue;
+      } else if (bounds.contains(i, j)) {
+        marked.add(i, j);
       } else {
-        map_->cells[i].cost += cost_occ_prob * float(map_->cells[i].occ_prob) / 100.0;
+        marks[index] = 0;
+        changed.add(i, j);
       }
-      // Add cost occ prob
-      if (lethal_occ_dist < max_occ_dist) {
-        float dist_cost = 1.0 - (map_->cells[i].occ_dist - lethal_occ_dist) / (max_occ_dist - lethal_occ_dist);
-        map_->cells[i].cost += cost_occ_dist * dist_cost;
-      } else {
-        map_->cells[i].cost = std::numeric_limits<float>::infinity();
+    }
+  }
+
+  // Clear along every beam, stopping at the edge of the window (Bresenham)
+  for (size_t k = 0; k < hits.size() + misses.size(); ++k) {
+    bool hit = k < hits.size();
+    const Eigen::Vector2f &end = hit ? hits[k] : misses[k - hits.size()];
+    int ei = MAP_GXWX(map, end.x()), ej = MAP_GYWY(map, end.y());
+    int di = abs(ei - ci), dj = abs(ej - cj);
+    int si = ei > ci ? 1 : -1, sj = ej > cj ? 1 : -1;
+    int err = di - dj;
+    int i = ci, j = cj;
+    while ((i != ei || j != ej) && bounds.contains(i, j)) {
+      int index = MAP_INDEX(map, i, j);
+      if (marks[index]) {
+        marks[index] = 0;
+        changed.add(i, j);
+      }
+      int e2 = 2 * err;
+      if (e2 > -dj) {
+        err -= dj;
+        i += si;
+      }
+      if (e2 < di) {
+        err += di;
+        j += sj;
+      }
+    }
+    if (!hit && bounds.contains(i, j) && marks[MAP_INDEX(map, i, j)]) {
+      marks[MAP_INDEX(map, i, j)] = 0;
+      changed.add(i, j);
+    }
+  }
+
+  // Then mark, so that one beam doesn't clear another's return
+  for (size_t k = 0; k < hits.size(); ++k) {
+    int i = MAP_GXWX(map, hits[k].x()), j = MAP_GYWY(map, hits[k].y());
+    if (!bounds.contains(i, j)) {
+      continue;
+    }
+    int index = MAP_INDEX(map, i, j);
+    if (!marks[index] &&
+        next->base->cells[index].occ_state != map_cell_t::OCCUPIED) {
+      marks[index] = 1;
+      changed.add(i, j);
+    }
+    marked.add(i, j);
+  }
+  next->marked = marked;
+
+  if (changed.empty()) {
+    next->stale = Snapshot::Region();
+    spare_.swap(next);
+    return;
+  }
+
+  // Only cells within max_occ_dist of a change can have new distances
+  Snapshot::Region region =
+    changed.grow(ceil(current->max_occ_dist / map->scale), map);
+  next->updateRegion(region);
+  publish(next);
+  spare_ = boost::const_pointer_cast<Snapshot>(current);
+  spare_->stale = region;
+}
+
+OccupancyMap::Snapshot* OccupancyMap::Snapshot::clone() const {
+  Snapshot *copy = new Snapshot(copyMap(map));
+  copy->max_occ_dist = max_occ_dist;
+  copy->lethal_occ_dist = lethal_occ_dist;
+  copy->cost_occ_prob = cost_occ_prob;
+  copy->cost_occ_dist = cost_occ_dist;
+
+  copy->pad_x = pad_x;
+  copy->pad_y = pad_y;
+  copy->ncells = ncells;
+  copy->search_cost.reset(new float[ncells]);
+  std::copy(search_cost.get(), search_cost.get() + ncells,
+            copy->search_cost.get());
+  copy->search_unknown.reset(new uint8_t[ncells]);
+  std::copy(search_unknown.get(), search_unknown.get() + ncells,
+            copy->search_unknown.get());
+  std::copy(offsets, offsets + 8, copy->offsets);
+  std::copy(edge_costs, edge_costs + 8, copy->edge_costs);
+
+  copy->num_landmarks = num_landmarks;
+  copy->landmarks = landmarks;
+  copy->landmark_scale = landmark_scale;
+  copy->landmark_dist = landmark_dist;
+
+  // Without a live layer, this map is the static one
+  copy->base = base ? base : boost::shared_ptr<map_t>(copyMap(map), map_free);
+  int size = map->size_x * map->size_y;
+  copy->marks.reset(new uint8_t[size]);
+  if (marks) {
+    std::copy(marks.get(), marks.get() + size, copy->marks.get());
+  } else {
+    std::fill(copy->marks.get(), copy->marks.get() + size, 0);
+  }
+  copy->marked = marked;
+  return copy;
+}
+
+void OccupancyMap::Snapshot::copyRegion(const Snapshot &other,
+                                        const Region &r) {
+  for (int j = r.min_j; j <= r.max_j; ++j) {
+    int begin = MAP_INDEX(map, r.min_i, j), end = MAP_INDEX(map, r.max_i, j) + 1;
+    std::copy(other.map->cells + begin, other.map->cells + end,
+              map->cells + begin);
+    std::copy(other.marks.get() + begin, other.marks.get() + end,
+              marks.get() + begin);
+    begin = gridIndex(r.min_i, j);
+    end = gridIndex(r.max_i, j) + 1;
+    std::copy(other.search_cost.get() + begin, other.search_cost.get() + end,
+              search_cost.get() + begin);
+    std::copy(other.search_unknown.get() + begin,
+              other.search_unknown.get() + end, search_unknown.get() + begin);
+  }
+  marked = other.marked;
+}
+
+void OccupancyMap::Snapshot::updateRegion(const Region &r) {
+  for (int j = r.min_j; j <= r.max_j; ++j) {
+    for (int i = r.min_i; i <= r.max_i; ++i) {
+      int index = MAP_INDEX(map, i, j);
+      map_cell_t &cell = map->cells[index];
+      cell = base->cells[index];
+      if (marks[index]) {
+        cell.occ_state = map_cell_t::OCCUPIED;
+        cell.occ_dist = 0.0;
       }
     }
   }
+
+  // Same distances as map_update_cspace(); the nearest obstacle is either in
+  // the static map or is a mark within s cells
+  int s = ceil(map->max_occ_dist / map->scale);
+  Region sources = r.grow(s, map);
+  for (int mj = std::max(sources.min_j, marked.min_j);
+       mj <= std::min(sources.max_j, marked.max_j); ++mj) {
+    for (int mi = std::max(sources.min_i, marked.min_i);
+         mi <= std::min(sources.max_i, marked.max_i); ++mi) {
+      if (!marks[MAP_INDEX(map, mi, mj)]) {
+        continue;
+      }
+      for (int j = std::max(mj - s, r.min_j); j <= std::min(mj + s, r.max_j); ++j) {
+        for (int i = std::max(mi - s, r.min_i); i <= std::min(mi + s, r.max_i); ++i) {
+          map_cell_t &cell = map->cells[MAP_INDEX(map, i, j)];
+          int di = i - mi, dj = j - mj;
+          double d = map->scale * sqrt(double(di * di + dj * dj));
+          if (d < cell.occ_dist) {
+            cell.occ_dist = d;
+          }
+        }
+      }
+    }
+  }
+
+  for (int j = r.min_j; j <= r.max_j; ++j) {
+    computeCosts(map->cells + MAP_INDEX(map, r.min_i, j), r.max_i - r.min_i + 1,
+                 max_occ_dist, lethal_occ_dist, cost_occ_prob, cost_occ_dist);
+  }
+  updateSearchGrid(r);
 }
 
 bool OccupancyMap::nearestPoint(double x, double y, double max_obst_distance,
                                 double *out_x, double *out_y) const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
+    return false;
+  }
+
   // spiral out from current point until we hit unoccupied grid cell
   double theta_inc = 0.3;
   double radius_inc = 0.01;
@@ -177,7 +573,7 @@ bool OccupancyMap::nearestPoint(double x, double y, double max_obst_distance,
   *out_x = x;
   *out_y = y;
   while (true) {
-    const map_cell_t *cell = getCell(*out_x, *out_y);
+    const map_cell_t *cell = map_get_cell(snapshot->map, *out_x, *out_y, 0);
     if (cell &&
         cell->occ_state == map_cell_t::FREE &&
         cell->occ_dist > max_obst_distance) {
@@ -194,87 +590,138 @@ bool OccupancyMap::nearestPoint(double x, double y, double max_obst_distance,
 }
 
 
-nav_msgs::OccupancyGrid OccupancyMap::getCSpace() {
+nav_msgs::OccupancyGrid OccupancyMap::getCSpace() const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  const map_t *map = snapshot->map;
   nav_msgs::OccupancyGrid grid;
-  grid.info.width = map_->size_x;
-  grid.info.height = map_->size_y;
-  grid.info.resolution = map_->scale;
-  grid.info.origin.position.x = map_->origin_x - map_->size_x / 2 * map_->scale;
-  grid.info.origin.position.y = map_->origin_y - map_->size_y / 2 * map_->scale;
+  grid.info.width = map->size_x;
+  grid.info.height = map->size_y;
+  grid.info.resolution = map->scale;
+  grid.info.origin.position.x = map->origin_x - map->size_x / 2 * map->scale;
+  grid.info.origin.position.y = map->origin_y - map->size_y / 2 * map->scale;
 
   // Convert to player format
-  grid.data.resize(map_->size_x*map_->size_y);
-  ROS_ASSERT(map_->cells);
-  for (int i = 0; i < map_->size_x * map_->size_y; ++i) {
-    grid.data[i] = 100 - int(100. * map_->cells[i].occ_dist / map_->max_occ_dist);
+  grid.data.resize(map->size_x*map->size_y);
+  ROS_ASSERT(map->cells);
+  for (int i = 0; i < map->size_x * map->size_y; ++i) {
+    grid.data[i] = 100 - int(100. * map->cells[i].occ_dist / map->max_occ_dist);
   }
 
   return grid;
 }
 
-nav_msgs::OccupancyGrid OccupancyMap::getCostMap() {
+nav_msgs::OccupancyGrid OccupancyMap::getCostMap() const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  const map_t *map = snapshot->map;
   nav_msgs::OccupancyGrid grid;
-  grid.info.width = map_->size_x;
-  grid.info.height = map_->size_y;
-  grid.info.resolution = map_->scale;
-  grid.info.origin.position.x = map_->origin_x - map_->size_x / 2 * map_->scale;
-  grid.info.origin.position.y = map_->origin_y - map_->size_y / 2 * map_->scale;
+  grid.info.width = map->size_x;
+  grid.info.height = map->size_y;
+  grid.info.resolution = map->scale;
+  grid.info.origin.position.x = map->origin_x - map->size_x / 2 * map->scale;
+  grid.info.origin.position.y = map->origin_y - map->size_y / 2 * map->scale;
 
   // Convert to player format
-  grid.data.resize(map_->size_x*map_->size_y);
-  ROS_ASSERT(map_->cells);
+  grid.data.resize(map->size_x*map->size_y);
+  ROS_ASSERT(map->cells);
   float max_cost = -std::numeric_limits<float>::infinity();
-  for (int i = 0; i < map_->size_x * map_->size_y; ++i) {
-    if (map_->cells[i].cost > max_cost && !isinff(map_->cells[i].cost)) {
-      max_cost = map_->cells[i].cost;
+  for (int i = 0; i < map->size_x * map->size_y; ++i) {
+    if (map->cells[i].cost > max_cost && !isinff(map->cells[i].cost)) {
+      max_cost = map->cells[i].cost;
     }
   }
-  for (int i = 0; i < map_->size_x * map_->size_y; ++i) {
-    if (isinff(map_->cells[i].cost)) {
+  for (int i = 0; i < map->size_x * map->size_y; ++i) {
+    if (isinff(map->cells[i].cost)) {
       grid.data[i] = 100;
     } else {
-      grid.data[i] = int(100.0 * map_->cells[i].cost / max_cost);
+      grid.data[i] = int(100.0 * map->cells[i].cost / max_cost);
     }
   }
 
   return grid;
 }
 
-inline double OccupancyMap::minX() {
-  return MAP_WXGX(map_, 0);
+double OccupancyMap::minX() const {
+  return MAP_WXGX(snapshot()->map, 0);
+}
+
+double OccupancyMap::minY() const {
+  return MAP_WYGY(snapshot()->map, 0);
 }
 
-inline double OccupancyMap::minY() {
-  return MAP_WYGY(map_, 0);
+double OccupancyMap::maxX() const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  return MAP_WXGX(snapshot->map, snapshot->map->size_x);
 }
 
-inline double OccupancyMap::maxX() {
-  return MAP_WXGX(map_, map_->size_x);
+double OccupancyMap::maxY() const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  return MAP_WYGY(snapshot->map, snapshot->map->size_y);
 }
 
-inline double OccupancyMap::maxY() {
-  return MAP_WYGY(map_, map_->size_y);
+double OccupancyMap::lethalOccDist() const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  return snapshot ? snapshot->lethal_occ_dist : 0.0;
 }
 
-const map_cell_t* OccupancyMap::getCell(double x, double y) const {
-  return map_get_cell(map_, x, y, 0);
+double OccupancyMap::maxOccDist() const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  return snapshot ? snapshot->max_occ_dist : 0.0;
+}
+
+bool OccupancyMap::getCell(double x, double y, map_cell_t *cell) const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
+    return false;
+  }
+  const map_cell_t *map_cell = map_get_cell(snapshot->map, x, y, 0);
+  if (map_cell == NULL) {
+    return false;
+  }
+  *cell = *map_cell;
+  return true;
+}
+
+int OccupancyMap::coordIndex(double x, double y) const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  int xi = MAP_GXWX(snapshot->map, x);
+  int yi = MAP_GYWY(snapshot->map, y);
+  if (!MAP_VALID(snapshot->map, xi, yi)) {
+    return -1;
+  } else {
+    return MAP_INDEX(snapshot->map, xi, yi);
+  }
+}
+
+int OccupancyMap::numX() const {
+  return snapshot()->map->size_x;
+}
+
+int OccupancyMap::numY() const {
+  return snapshot()->map->size_y;
+}
+
+map_cell_t OccupancyMap::at(int xi, int yi) const {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  return snapshot->map->cells[MAP_INDEX(snapshot->map, xi, yi)];
 }
 
 bool OccupancyMap::lineOfSight(double x1, double y1, double x2, double y2,
                                double max_occ_dist /* = 0.0 */,
                                bool allow_unknown /* = false */) const {
-  if (map_ == NULL) {
-    return true;
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
+    return false;
   }
-  if (map_->max_occ_dist < max_occ_dist) {
+  map_t *map = snapshot->map;
+  if (map->max_occ_dist < max_occ_dist) {
     ROS_ERROR("OccupancyMap::lineOfSight() CSpace has been calculated up to %f, "
               "but max_occ_dist=%.2f",
-              map_->max_occ_dist, max_occ_dist);
+              map->max_occ_dist, max_occ_dist);
     ROS_BREAK();
   }
   // March along the line between (x1, y1) and (x2, y2) until the point passes
   // beyond (x2, y2).
-  double step_size = map_->scale / 2.0;
+  double step_size = map->scale / 2.0;
 
   double dy = y2 - y1;
   double dx = x2 - x1;
@@ -288,7 +735,7 @@ bool OccupancyMap::lineOfSight(double x1, double y1, double x2, double y2,
   // Terminate when current point defines a vector longer than original vector
   while (pow(line_x - x1, 2) + pow(line_y - y1, 2) < mag_sq) {
     // fprintf(stderr, "%f %f\n", line_x, line_y);
-    map_cell_t *cell = map_get_cell(map_, line_x, line_y, 0);
+    map_cell_t *cell = map_get_cell(map, line_x, line_y, 0);
     if (cell == NULL) {
       // ROS_WARN_THROTTLE(5, "lineOfSight() Beyond map edge");
       return false;
@@ -303,294 +750,778 @@ bool OccupancyMap::lineOfSight(double x1, double y1, double x2, double y2,
   return true;
 }
 
-void OccupancyMap::initializeSearch(double startx, double starty) {
-  starti_ = MAP_GXWX(map_, startx);
-  startj_ = MAP_GYWY(map_, starty);
+void OccupancyMap::Snapshot::buildSearchGrid() {
+  pad_x = map->size_x + 2;
+  pad_y = map->size_y + 2;
+  ncells = pad_x * pad_y;
+  search_cost.reset(new float[ncells]);
+  search_unknown.reset(new uint8_t[ncells]);
 
-  if (!MAP_VALID(map_, starti_, startj_)) {
-    ROS_ERROR("OccupancyMap::initializeSearch() Invalid starting position");
-    ROS_BREAK();
+  for (int i = 0; i < ncells; ++i) {
+    search_cost[i] = std::numeric_limits<float>::infinity();
+    search_unknown[i] = 0;
   }
+  updateSearchGrid(Region(0, 0, map->size_x - 1, map->size_y - 1));
 
-  int ncells = map_->size_x * map_->size_y;
-  if (ncells_ != ncells) {
-    ncells_ = ncells;
-    costs_.reset(new float[ncells]);
-    prev_i_.reset(new int[ncells]);
-    prev_j_.reset(new int[ncells]);
+  for (int k = 0; k < 8; ++k) {
+    offsets[k] = kNeighborI[k] + kNeighborJ[k] * pad_x;
+    edge_costs[k] = (kNeighborI[k] != 0 && kNeighborJ[k] != 0) ? M_SQRT2 : 1.0;
   }
+}
 
-  // TODO: Return to more efficient lazy-initialization
-  // // Map is large and initializing costs_ takes a while.  To speedup,
-  // // partially initialize costs_ in a rectangle surrounding start and stop
-  // // positions + margin.  If you run up against boundary, initialize the rest.
-  // int margin = 120;
-  // init_ul_ = make_pair(max(0, min(starti_, stopi) - margin),
-  //                      max(0, min(startj_, stopj) - margin));
-  // init_lr_ = make_pair(min(map_->size_x, max(starti_, stopi) + margin),
-  //                      min(map_->size_y, max(startj_, stopj) + margin));
-  // for (int j = init_ul.second; j < init_lr.second; ++j) {
-  //   for (int i = init_ul.first; i < init_lr.first; ++i) {
-  //     int ind = MAP_INDEX(map_, i, j);
-  //     costs_[ind] = std::numeric_limits<float>::infinity();
-  //   }
-  // }
-  // full_init_ = false;
-
-  for (int i = 0; i < ncells_; ++i) {
-    costs_[i] = std::numeric_limits<float>::infinity();
-    prev_i_[i] = -1;
-    prev_j_[i] = -1;
-  }
-
-  int start_ind = MAP_INDEX(map_, starti_, startj_);
-  costs_[start_ind] = 0.0;
-  prev_i_[starti_] = starti_;
-  prev_j_[startj_] = startj_;
-
-  Q_.reset(new set<Node, NodeCompare>());
-  Q_->insert(Node(make_pair(starti_, startj_), 0.0, 0.0));
-
-  stopi_ = -1;
-  stopj_ = -1;
-}
-
-void OccupancyMap::addNeighbors(const Node &node, double max_occ_dist, bool allow_unknown) {
-  // TODO: Return to more efficient lazy-initialization
-  // // Check if we're neighboring nodes whose costs_ are uninitialized.
-  // // if (!full_init &&
-  // //     ((ci + 1 >= init_lr.first) || (ci - 1 <= init_ul.first) ||
-  // //      (cj + 1 >= init_lr.second) || (cj - 1 <= init_ul.second))) {
-  // //   full_init = true;
-  // //   for (int j = 0; j < map_->size_y; ++j) {
-  // //     for (int i = 0; i < map_->size_x; ++i) {
-  // //       // Only initialize costs_ that are outside original rectangle
-  // //       if (!(init_ul.first <= i && i < init_lr.first &&
-  // //             init_ul.second <= j && j < init_lr.second)) {
-  // //         int ind = MAP_INDEX(map_, i, j);
-  // //         costs_[ind] = std::numeric_limits<float>::infinity();
-  // //       }
-  // //     }
-  // //   }
-  // // }
-
-  int ci = node.coord.first;
-  int cj = node.coord.second;
-
-  // Iterate over neighbors
-  for (int newj = cj - 1; newj <= cj + 1; ++newj) {
-    for (int newi = ci - 1; newi <= ci + 1; ++newi) {
-      // Skip self edges
-      if ((newi == ci && newj == cj) || !MAP_VALID(map_, newi, newj)) {
-        continue;
+void OccupancyMap::Snapshot::updateSearchGrid(const Region &r) {
+  for (int j = r.min_j; j <= r.max_j; ++j) {
+    for (int i = r.min_i; i <= r.max_i; ++i) {
+      const map_cell_t *cell = map->cells + MAP_INDEX(map, i, j);
+      int index = gridIndex(i, j);
+      search_cost[index] = cell->occ_state == map_cell_t::OCCUPIED ?
+        std::numeric_limits<float>::infinity() : cell->cost;
+      search_unknown[index] = cell->occ_state == map_cell_t::UNKNOWN;
+    }
+  }
+}
+
+void OccupancyMap::Snapshot::buildLandmarks(int n) {
+  num_landmarks = 0;
+  landmarks.clear();
+  landmark_dist.reset();
+  if (n == 0) {
+    return;
+  }
+
+  const float inf = std::numeric_limits<float>::infinity();
+  boost::scoped_array<float> dist(new float[ncells]);
+  boost::scoped_array<float> nearest(new float[ncells]);
+
+  // Start in the largest connected region so that landmarks aren't spent on
+  // small islands of free space
+  std::fill(dist.get(), dist.get() + ncells, inf);
+  int seed = -1, seed_size = 0;
+  for (int i = 0; i < ncells; ++i) {
+    if (!isinf(search_cost[i]) && isinf(dist[i])) {
+      int size = expandDistances(i, dist.get());
+      if (size > seed_size) {
+        seed = i;
+        seed_size = size;
       }
-      // fprintf(stderr, "  Examining %i %i ", newi, newj);
-      int index = MAP_INDEX(map_, newi, newj);
-      map_cell_t *cell = map_->cells + index;
-      // If cell is occupied or too close to occupied cell, continue
-
-      if (isinff(cell->cost) ||
-          (!allow_unknown && cell->occ_state == map_cell_t::UNKNOWN)) {
-        // fprintf(stderr, "occupado\n");
-        continue;
+    }
+  }
+  if (seed == -1) {
+    return;
+  }
+  std::fill(nearest.get(), nearest.get() + ncells, inf);
+  expandDistances(seed, nearest.get());
+
+  // Every landmark is in the seed's region, so no distance is more than twice
+  // the farthest distance from the seed
+  float radius = 0.0;
+  for (int i = 0; i < ncells; ++i) {
+    if (!isinf(nearest[i])) {
+      radius = std::max(radius, nearest[i]);
+    }
+  }
+  num_landmarks = n;
+  landmark_scale = std::min(kLandmarkScale, 65534.0f / std::max(2.0f * radius, 1.0f));
+  landmark_dist.reset(new uint16_t[size_t(ncells) * n]);
+  std::fill(landmark_dist.get(), landmark_dist.get() + size_t(ncells) * n,
+            0xffff);
+
+  // Farthest point selection: each landmark is the cell farthest from those
+  // already chosen (the first is farthest from the seed)
+  for (int l = 0; l < n; ++l) {
+    int landmark = -1;
+    for (int i = 0; i < ncells; ++i) {
+      if (!isinf(nearest[i]) && (landmark == -1 || nearest[i] > nearest[landmark])) {
+        landmark = i;
       }
-      // fprintf(stderr, "free\n");
-      double edge_cost = ci == newi || cj == newj ? 1 : sqrt(2);
-      double heur_cost = 0.0;
-      if (stopi_ != -1 && stopj_ != -1) {
-        heur_cost = hypot(newi - stopi_, newj - stopj_);
+    }
+    if (l > 0 && nearest[landmark] == 0.0) {
+      break;
+    }
+    landmarks.push_back(landmark);
+
+    std::fill(dist.get(), dist.get() + ncells, inf);
+    expandDistances(landmark, dist.get());
+    for (int i = 0; i < ncells; ++i) {
+      if (!isinf(dist[i])) {
+        landmark_dist[size_t(i) * n + l] = dist[i] * landmark_scale;
+        nearest[i] = l == 0 ? dist[i] : std::min(nearest[i], dist[i]);
       }
-      double total_cost = node.true_cost + edge_cost + cell->cost + heur_cost;
-      if (total_cost < costs_[index]) {
-        // fprintf(stderr, "    Better path: new cost= % 6.2f\n", ttl_cost);
-        // If node has finite cost, it's in queue and needs to be removed
-        if (!isinf(costs_[index])) {
-          Q_->erase(Node(make_pair(newi, newj), costs_[index], 0.0));
-        }
-        costs_[index] = total_cost;
-        prev_i_[index] = ci;
-        prev_j_[index] = cj;
-        Q_->insert(Node(make_pair(newi, newj),
-                        node.true_cost + edge_cost + cell->cost,
-                        total_cost));
+    }
+  }
+}
+
+int OccupancyMap::Snapshot::expandDistances(int source, float *dist) const {
+  typedef std::pair<float, int> Entry;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > Q;
+  dist[source] = 0.0;
+  Q.push(Entry(0.0, source));
+  int reached = 0;
+  while (!Q.empty()) {
+    Entry curr = Q.top();
+    Q.pop();
+    // Skip entries that were superseded by a shorter distance
+    if (curr.first > dist[curr.second]) {
+      continue;
+    }
+    ++reached;
+    for (int k = 0; k < 8; ++k) {
+      int index = curr.second + offsets[k];
+      float d = curr.first + edge_costs[k];
+      if (!isinf(search_cost[index]) && d < dist[index]) {
+        dist[index] = d;
+        Q.push(Entry(d, index));
       }
     }
   }
+  return reached;
+}
+
+OccupancyMap::LandmarkHeuristic::LandmarkHeuristic(const Snapshot *map,
+                                                   int stopi, int stopj)
+  : euclidean(stopi, stopj), dist(map->landmark_dist.get()),
+    pad_x(map->pad_x), n(map->num_landmarks),
+    inv_scale(1.0 / map->landmark_scale) {
+  const uint16_t *d = dist + size_t(map->gridIndex(stopi, stopj)) * n;
+  std::copy(d, d + n, goal);
 }
 
-void OccupancyMap::buildPath(int i, int j, Path *path) {
-  while (!(i == starti_ && j == startj_)) {
-    int index = MAP_INDEX(map_, i, j);
-    float x = MAP_WXGX(map_, i);
-    float y = MAP_WYGY(map_, j);
-    path->push_back(Eigen::Vector2f(x, y));
+void OccupancyMap::initializeSearch(const boost::shared_ptr<const Snapshot> &map,
+                                    double startx, double starty,
+                                    SearchContext *context) {
+  int starti = MAP_GXWX(map->map, startx);
+  int startj = MAP_GYWY(map->map, starty);
 
-    i = prev_i_[index];
-    j = prev_j_[index];
+  if (!MAP_VALID(map->map, starti, startj)) {
+    ROS_ERROR("OccupancyMap::initializeSearch() Invalid starting position");
+    ROS_BREAK();
   }
-  float x = MAP_WXGX(map_, i);
-  float y = MAP_WYGY(map_, j);
-  path->push_back(Eigen::Vector2f(x, y));
+
+  initializeSearch(map, map->gridIndex(starti, startj), &context->forward);
+  context->backward.expanded = 0;
 }
 
-bool OccupancyMap::nextNode(double max_occ_dist, Node *curr_node, bool allow_unknown) {
-  if (!Q_->empty()) {
+void OccupancyMap::initializeSearch(const boost::shared_ptr<const Snapshot> &map,
+                                    int start, SearchState *state) {
+  if (state->size != map->ncells) {
+    state->size = map->ncells;
+    state->costs.reset(new float[map->ncells]);
+    state->prev.reset(new int[map->ncells]);
+  }
+  state->map = map;
+
+  // TODO: Return to more efficient lazy-initialization
+  // // Map is large and initializing costs takes a while.  To speedup,
+  // // partially initialize costs in a rectangle surrounding start and stop
+  // // positions + margin.  If you run up against boundary, initialize the rest.
+  for (int i = 0; i < map->ncells; ++i) {
+    state->costs[i] = std::numeric_limits<float>::infinity();
+    state->prev[i] = -1;
+  }
+
+  state->start = start;
+  state->expanded = 0;
+  state->costs[start] = 0.0;
+  state->prev[start] = start;
+
+  state->Q.clear();
+  state->Q.insert(Node(start, 0.0, 0.0));
+}
+
+struct OccupancyMap::StopAtGoal {
+  StopAtGoal(int g) : goal(g), found(false) { }
+  bool operator()(const Node &node) {
+    found = node.index == goal;
+    return !found;
+  }
+  int goal;
+  bool found;
+};
+
+struct OccupancyMap::StopAtTargets {
+  // targets must be sorted; a cell may appear more than once
+  StopAtTargets(const std::vector<int> &t) : targets(t), remaining(t.size()) { }
+  bool operator()(const Node &node) {
+    std::pair<std::vector<int>::const_iterator,
+              std::vector<int>::const_iterator> range =
+      std::equal_range(targets.begin(), targets.end(), node.index);
+    remaining -= range.second - range.first;
+    return remaining > 0;
+  }
+  const std::vector<int> &targets;
+  int remaining;
+};
+
+struct OccupancyMap::CollectEndpoints {
+  CollectEndpoints(const Snapshot *m, Path *e, double min_d, double max_d)
+    : map(m), endpoints(e), min_distance(min_d), max_distance(max_d) { }
+  bool operator()(const Node &node) {
+    double node_dist = node.true_cost * map->map->scale;
+    if (min_distance <= node_dist && node_dist < max_distance) {
+      int i, j;
+      map->gridCoord(node.index, &i, &j);
+      endpoints->push_back(Eigen::Vector2f(MAP_WXGX(map->map, i),
+                                           MAP_WYGY(map->map, j)));
+    }
+    return node_dist <= max_distance;
+  }
+  const Snapshot *map;
+  Path *endpoints;
+  double min_distance, max_distance;
+};
+
+struct OccupancyMap::VisitAll {
+  bool operator()(const Node &node) { return true; }
+};
+
+template <bool Reverse, class Heuristic, class Visitor>
+void OccupancyMap::Snapshot::search(const Heuristic &h, bool allow_unknown,
+                                    int connectivity, Visitor *visitor,
+                                    SearchState *state) const {
+  if (allow_unknown) {
+    if (connectivity == 4) {
+      searchLoop<SearchPolicy<Heuristic, true, 4, Reverse> >(h, visitor, state);
+    } else {
+      searchLoop<SearchPolicy<Heuristic, true, 8, Reverse> >(h, visitor, state);
+    }
+  } else {
+    if (connectivity == 4) {
+      searchLoop<SearchPolicy<Heuristic, false, 4, Reverse> >(h, visitor, state);
+    } else {
+      searchLoop<SearchPolicy<Heuristic, false, 8, Reverse> >(h, visitor, state);
+    }
+  }
+}
+
+template <class Policy, class Visitor>
+void OccupancyMap::Snapshot::searchLoop(const typename Policy::Heuristic &h,
+                                        Visitor *visitor,
+                                        SearchState *state) const {
+  std::set<Node, NodeCompare> &Q = state->Q;
+  while (!Q.empty()) {
     // Copy node and then erase it
-    *curr_node = *Q_->begin();
-    int ci = curr_node->coord.first, cj = curr_node->coord.second;
-    // fprintf(stderr, "At %i %i (cost = %6.2f)  % 7.2f % 7.2f \n",
-    //     ci, cj, curr_node.true_dist, MAP_WXGX(map_, ci), MAP_WYGY(map_, cj));
-    costs_[MAP_INDEX(map_, ci, cj)] = curr_node->true_cost;
-    Q_->erase(Q_->begin());
-    addNeighbors(*curr_node, max_occ_dist, allow_unknown);
-    return true;
+    Node curr_node = *Q.begin();
+    Q.erase(Q.begin());
+    if (!(*visitor)(curr_node)) {
+      return;
+    }
+    addNeighbors<Policy>(curr_node, h, state);
+  }
+}
+
+template <class Heuristic>
+void OccupancyMap::Snapshot::bidirectionalSearch(const Heuristic &hf,
+                                                 const Heuristic &hb,
+                                                 bool allow_unknown,
+                                                 int connectivity,
+                                                 SearchState *forward,
+                                                 SearchState *backward,
+                                                 Meeting *meeting) const {
+  if (allow_unknown) {
+    if (connectivity == 4) {
+      bidirectionalLoop<SearchPolicy<Heuristic, true, 4>,
+                        SearchPolicy<Heuristic, true, 4, true> >(
+                          hf, hb, forward, backward, meeting);
+    } else {
+      bidirectionalLoop<SearchPolicy<Heuristic, true, 8>,
+                        SearchPolicy<Heuristic, true, 8, true> >(
+                          hf, hb, forward, backward, meeting);
+    }
   } else {
-    return false;
+    if (connectivity == 4) {
+      bidirectionalLoop<SearchPolicy<Heuristic, false, 4>,
+                        SearchPolicy<Heuristic, false, 4, true> >(
+                          hf, hb, forward, backward, meeting);
+    } else {
+      bidirectionalLoop<SearchPolicy<Heuristic, false, 8>,
+                        SearchPolicy<Heuristic, false, 8, true> >(
+                          hf, hb, forward, backward, meeting);
+    }
   }
 }
 
+template <class ForwardPolicy, class BackwardPolicy>
+void OccupancyMap::Snapshot::bidirectionalLoop(
+    const typename ForwardPolicy::Heuristic &hf,
+    const typename BackwardPolicy::Heuristic &hb,
+    SearchState *forward, SearchState *backward, Meeting *meeting) const {
+  // Keys include the potential of the start nodes
+  int i, j;
+  gridCoord(forward->start, &i, &j);
+  forward->Q.clear();
+  forward->Q.insert(Node(forward->start, 0.0, hf(i, j)));
+  gridCoord(backward->start, &i, &j);
+  backward->Q.clear();
+  backward->Q.insert(Node(backward->start, 0.0, hb(i, j)));
+
+  Meeting backward_meeting(forward);
+  while (!forward->Q.empty() && !backward->Q.empty()) {
+    // The potentials cancel, so this is the stopping rule of bidirectional
+    // Dijkstra on the reduced costs: no path cheaper than the best one found
+    // so far can still be discovered
+    if (forward->Q.begin()->heuristic + backward->Q.begin()->heuristic >=
+        meeting->cost) {
+      break;
+    }
+
+    // Grow whichever frontier is smaller
+    if (forward->Q.size() <= backward->Q.size()) {
+      Node curr_node = *forward->Q.begin();
+      forward->Q.erase(forward->Q.begin());
+      addNeighbors<ForwardPolicy>(curr_node, hf, forward, meeting);
+    } else {
+      Node curr_node = *backward->Q.begin();
+      backward->Q.erase(backward->Q.begin());
+      backward_meeting.cost = meeting->cost;
+      addNeighbors<BackwardPolicy>(curr_node, hb, backward, &backward_meeting);
+      if (backward_meeting.cost < meeting->cost) {
+        meeting->cost = backward_meeting.cost;
+        meeting->index = backward_meeting.index;
+      }
+    }
+  }
+}
+
+template <class Policy>
+void OccupancyMap::Snapshot::addNeighbors(const Node &node,
+                                          const typename Policy::Heuristic &h,
+                                          SearchState *state,
+                                          Meeting *meeting) const {
+  ++state->expanded;
+  int ci, cj;
+  gridCoord(node.index, &ci, &cj);
+  float *costs = state->costs.get();
+  // Reverse searches pay for the cell they're leaving
+  const float node_cost = Policy::reverse ? search_cost[node.index] : 0.0;
+
+  for (int k = 0; k < Policy::connectivity; ++k) {
+    int index = node.index + offsets[k];
+    // Border cells have infinite cost, so this also stops at the map edge
+    float cell_cost = search_cost[index];
+    if (isinf(cell_cost) ||
+        (!Policy::allow_unknown && search_unknown[index])) {
+      continue;
+    }
+    float true_cost = node.true_cost + edge_costs[k] +
+      (Policy::reverse ? node_cost : cell_cost);
+    if (true_cost < costs[index]) {
+      float heur_cost = h(ci + kNeighborI[k], cj + kNeighborJ[k]);
+      // If node has finite cost, it's in queue and needs to be removed
+      if (!isinf(costs[index])) {
+        state->Q.erase(Node(index, costs[index], costs[index] + heur_cost));
+      }
+      costs[index] = true_cost;
+      state->prev[index] = node.index;
+      state->Q.insert(Node(index, true_cost, true_cost + heur_cost));
+
+      if (meeting != NULL) {
+        float total_cost = true_cost + meeting->other->costs[index];
+        if (total_cost < meeting->cost) {
+          meeting->cost = total_cost;
+          meeting->index = index;
+        }
+      }
+    }
+  }
+}
+
+void OccupancyMap::Snapshot::buildPath(int index, const SearchState &state,
+                                       Path *path) const {
+  int i, j;
+  while (index != state.start) {
+    gridCoord(index, &i, &j);
+    path->push_back(Eigen::Vector2f(MAP_WXGX(map, i), MAP_WYGY(map, j)));
+    index = state.prev[index];
+  }
+  gridCoord(index, &i, &j);
+  path->push_back(Eigen::Vector2f(MAP_WXGX(map, i), MAP_WYGY(map, j)));
+}
+
 Path OccupancyMap::astar(double startx, double starty,
                                 double stopx, double stopy,
                                 double max_occ_dist /* = 0.0 */,
-                                bool allow_unknown /* = false */) {
+                                bool allow_unknown /* = false */,
+                                SearchContext *context /* = NULL */) {
   Path path;
+  context = this->context(context);
 
-  if (map_ == NULL) {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
     ROS_WARN("OccupancyMap::astar() Map not set");
     return path;
   }
+  const map_t *map = snapshot->map;
 
-  int stopi = MAP_GXWX(map_, stopx), stopj = MAP_GYWY(map_, stopy);
-  if (!MAP_VALID(map_, stopi ,stopj)) {
+  int stopi = MAP_GXWX(map, stopx), stopj = MAP_GYWY(map, stopy);
+  if (!MAP_VALID(map, stopi ,stopj)) {
     ROS_ERROR("OccupancyMap::astar() Invalid stopping position");
     ROS_BREAK();
   }
-  if (map_->max_occ_dist < max_occ_dist) {
+  if (map->max_occ_dist < max_occ_dist) {
     ROS_ERROR("OccupancyMap::astar() CSpace has been calculated up to %f, "
               "but max_occ_dist=%.2f",
-              map_->max_occ_dist, max_occ_dist);
+              map->max_occ_dist, max_occ_dist);
     ROS_BREAK();
   }
 
-  initializeSearch(startx, starty);
-  // Set stop to use heuristic
-  stopi_ = stopi;
-  stopj_ = stopj;
-
-  bool found = false;
-  Node curr_node;
-  while (nextNode(max_occ_dist, &curr_node, allow_unknown)) {
-    if (curr_node.coord.first == stopi && curr_node.coord.second == stopj) {
-      found = true;
-      break;
-    }
+  initializeSearch(snapshot, startx, starty, context);
+  StopAtGoal visitor(snapshot->gridIndex(stopi, stopj));
+  if (snapshot->landmark_dist) {
+    snapshot->search<false>(LandmarkHeuristic(snapshot.get(), stopi, stopj),
+                            allow_unknown, connectivity_, &visitor,
+                            &context->forward);
+  } else {
+    snapshot->search<false>(EuclideanHeuristic(stopi, stopj),
+                            allow_unknown, connectivity_, &visitor,
+                            &context->forward);
   }
 
   // Recreate path
-  if (found) {
-    buildPath(stopi, stopj, &path);
+  if (visitor.found) {
+    snapshot->buildPath(visitor.goal, context->forward, &path);
   }
   return Path(path.rbegin(), path.rend());
 }
 
+Path OccupancyMap::bidirectionalAstar(double startx, double starty,
+                                      double stopx, double stopy,
+                                      double max_occ_dist /* = 0.0 */,
+                                      bool allow_unknown /* = false */,
+                                      SearchContext *context /* = NULL */) {
+  Path path;
+  context = this->context(context);
+
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
+    ROS_WARN("OccupancyMap::bidirectionalAstar() Map not set");
+    return path;
+  }
+  const map_t *map = snapshot->map;
+
+  int stopi = MAP_GXWX(map, stopx), stopj = MAP_GYWY(map, stopy);
+  if (!MAP_VALID(map, stopi ,stopj)) {
+    ROS_ERROR("OccupancyMap::bidirectionalAstar() Invalid stopping position");
+    ROS_BREAK();
+  }
+  if (map->max_occ_dist < max_occ_dist) {
+    ROS_ERROR("OccupancyMap::bidirectionalAstar() CSpace has been calculated up "
+              "to %f, but max_occ_dist=%.2f",
+              map->max_occ_dist, max_occ_dist);
+    ROS_BREAK();
+  }
+
+  SearchState &forward = context->forward, &backward = context->backward;
+  initializeSearch(snapshot, startx, starty, context);
+  int goal = snapshot->gridIndex(stopi, stopj);
+  initializeSearch(snapshot, goal, &backward);
+  // A single source search would never enter an untraversable goal
+  if (isinf(snapshot->search_cost[goal]) ||
+      (!allow_unknown && snapshot->search_unknown[goal])) {
+    return path;
+  }
+
+  int starti, startj;
+  snapshot->gridCoord(forward.start, &starti, &startj);
+  Meeting meeting(&backward);
+  if (goal == forward.start) {
+    meeting.cost = 0.0;
+    meeting.index = goal;
+  }
+  snapshot->bidirectionalSearch(BalancedHeuristic(stopi, stopj, starti, startj),
+                                BalancedHeuristic(starti, startj, stopi, stopj),
+                                allow_unknown, connectivity_,
+                                &forward, &backward, &meeting);
+  if (meeting.index == -1) {
+    return path;
+  }
+
+  // Start to meeting point, then meeting point to goal
+  snapshot->buildPath(meeting.index, forward, &path);
+  std::reverse(path.begin(), path.end());
+  int index = meeting.index;
+  while (index != backward.start) {
+    index = backward.prev[index];
+    int i, j;
+    snapshot->gridCoord(index, &i, &j);
+    path.push_back(Eigen::Vector2f(MAP_WXGX(map, i), MAP_WYGY(map, j)));
+  }
+  return path;
+}
+
+int OccupancyMap::expanded(const SearchContext *context /* = NULL */) const {
+  return this->context(context)->expanded();
+}
+
 const Path&
 OccupancyMap::prepareShortestPaths(double x, double y,
                                    double min_distance, double max_distance,
                                    double max_occ_dist,
-                                   bool allow_unknown) {
-  endpoints_.clear();
+                                   bool allow_unknown,
+                                   SearchContext *context) {
+  context = this->context(context);
+  context->endpoints.clear();
 
-  if (map_ == NULL) {
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
     ROS_WARN("OccupancyMap::prepareShortestPaths() Map not set");
-    return endpoints_;
+    return context->endpoints;
   }
 
-  if (map_->max_occ_dist < max_occ_dist) {
+  if (snapshot->map->max_occ_dist < max_occ_dist) {
     ROS_ERROR("OccupancyMap::prepareShortestPaths() CSpace has been calculated "
               "up to %f, but max_occ_dist=%.2f",
-              map_->max_occ_dist, max_occ_dist);
+              snapshot->map->max_occ_dist, max_occ_dist);
     ROS_BREAK();
   }
 
-  initializeSearch(x, y);
-
-  Node curr_node;
-  while (nextNode(max_occ_dist, &curr_node, allow_unknown)) {
-    double node_dist = curr_node.true_cost * map_->scale;
-    if (min_distance <= node_dist && node_dist < max_distance) {
-      float x = MAP_WXGX(map_, curr_node.coord.first);
-      float y = MAP_WYGY(map_, curr_node.coord.second);
-      endpoints_.push_back(Eigen::Vector2f(x, y));
-    } else if (node_dist > max_distance) {
-      break;
-    }
-  }
-  return endpoints_;
+  initializeSearch(snapshot, x, y, context);
+  CollectEndpoints visitor(snapshot.get(), &context->endpoints,
+                           min_distance, max_distance);
+  snapshot->search<false>(NoHeuristic(), allow_unknown, connectivity_,
+                          &visitor, &context->forward);
+  return context->endpoints;
 }
 
-Path OccupancyMap::buildShortestPath(int ind) {
+Path OccupancyMap::buildShortestPath(int ind,
+                                     const SearchContext *context) const {
   Path path;
+  context = this->context(context);
 
-  if (map_ == NULL) {
+  // Paths refer to the map that was searched, even if it has been replaced
+  const Snapshot *snapshot = context->forward.map.get();
+  if (snapshot == NULL) {
     ROS_WARN("OccupancyMap::buildShortestPath() Map not set");
     return path;
   }
 
   // Recreate path
-  const Eigen::Vector2f &stop = endpoints_.at(ind);
-  int stopi = MAP_GXWX(map_, stop(0)), stopj = MAP_GYWY(map_, stop(1));
-  buildPath(stopi, stopj, &path);
+  const Eigen::Vector2f &stop = context->endpoints.at(ind);
+  int stopi = MAP_GXWX(snapshot->map, stop(0));
+  int stopj = MAP_GYWY(snapshot->map, stop(1));
+  snapshot->buildPath(snapshot->gridIndex(stopi, stopj), context->forward,
+                      &path);
   return Path(path.rbegin(), path.rend());
 }
 
 void OccupancyMap::prepareAllShortestPaths(double x, double y,
                                            double max_occ_dist,
-                                           bool allow_unknown) {
-  if (map_ == NULL) {
+                                           bool allow_unknown,
+                                           SearchContext *context) {
+  context = this->context(context);
+
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
     ROS_WARN("OccupancyMap::prepareAllShortestPaths() Map not set");
     return;
   }
 
-  if (map_->max_occ_dist < max_occ_dist) {
+  if (snapshot->map->max_occ_dist < max_occ_dist) {
     ROS_ERROR("OccupancyMap::shortestToDests() CSpace has been calculated "
               "up to %f, but max_occ_dist=%.2f",
-              map_->max_occ_dist, max_occ_dist);
+              snapshot->map->max_occ_dist, max_occ_dist);
     ROS_BREAK();
   }
 
-  initializeSearch(x, y);
-
-  Node curr_node;
-  while (nextNode(max_occ_dist, &curr_node, allow_unknown)) {
-    ;
-  }
+  initializeSearch(snapshot, x, y, context);
+  VisitAll visitor;
+  snapshot->search<false>(NoHeuristic(), allow_unknown, connectivity_,
+                          &visitor, &context->forward);
 }
 
-Path OccupancyMap::shortestPath(double stopx, double stopy) {
+Path OccupancyMap::shortestPath(double stopx, double stopy,
+                                const SearchContext *context) const {
   Path path;
+  context = this->context(context);
 
-  if (map_ == NULL) {
+  const Snapshot *snapshot = context->forward.map.get();
+  if (snapshot == NULL) {
     ROS_WARN("OccupancyMap::shortestPath() Map not set");
     return path;
   }
 
-  int i = MAP_GXWX(map_, stopx);
-  int j = MAP_GYWY(map_, stopy);
-  int ind = MAP_INDEX(map_, i, j);
+  int i = MAP_GXWX(snapshot->map, stopx);
+  int j = MAP_GYWY(snapshot->map, stopy);
 
-  if (!MAP_VALID(map_, i, j)) {
+  if (!MAP_VALID(snapshot->map, i, j)) {
     ROS_ERROR("OccMap::shortestPath() Invalid destination: x=%f y=%f",
               stopx, stopy);
     ROS_BREAK();
     return path; // return to prevent compiler warning
-  } else if ( prev_i_[ind] == -1 || prev_j_[ind] == -1) {
+  } else if (context->forward.prev[snapshot->gridIndex(i, j)] == -1) {
     return path;
   } else {
-    buildPath(i, j, &path);
+    snapshot->buildPath(snapshot->gridIndex(i, j), context->forward, &path);
     return Path(path.rbegin(), path.rend());
   }
 }
 
+void OccupancyMap::pathCosts(double x, double y, const Path &targets,
+                             double max_occ_dist, bool allow_unknown,
+                             std::vector<double> *costs,
+                             SearchContext *context) {
+  context = this->context(context);
+  costs->assign(targets.size(), std::numeric_limits<double>::infinity());
+
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
+    ROS_WARN("OccupancyMap::pathCosts() Map not set");
+    return;
+  }
+
+  if (snapshot->map->max_occ_dist < max_occ_dist) {
+    ROS_ERROR("OccupancyMap::pathCosts() CSpace has been calculated "
+              "up to %f, but max_occ_dist=%.2f",
+              snapshot->map->max_occ_dist, max_occ_dist);
+    ROS_BREAK();
+  }
+
+  // Targets outside of the map are never reached, so they're left out
+  std::vector<int> indices(targets.size(), -1);
+  std::vector<int> sorted;
+  for (size_t k = 0; k < targets.size(); ++k) {
+    int i = MAP_GXWX(snapshot->map, targets[k].x());
+    int j = MAP_GYWY(snapshot->map, targets[k].y());
+    if (MAP_VALID(snapshot->map, i, j)) {
+      indices[k] = snapshot->gridIndex(i, j);
+      sorted.push_back(indices[k]);
+    }
+  }
+  std::sort(sorted.begin(), sorted.end());
+
+  initializeSearch(snapshot, x, y, context);
+  StopAtTargets visitor(sorted);
+  if (!sorted.empty()) {
+    snapshot->search<false>(NoHeuristic(), allow_unknown, connectivity_,
+                            &visitor, &context->forward);
+  }
+
+  // The search only ends early once every target has been reached, so their
+  // costs are final
+  const float *search_costs = context->forward.costs.get();
+  for (size_t k = 0; k < targets.size(); ++k) {
+    if (indices[k] >= 0 && !isinf(search_costs[indices[k]])) {
+      (*costs)[k] = search_costs[indices[k]] * snapshot->map->scale;
+    }
+  }
+}
+
+void OccupancyMap::prepareNavigationFunction(double x, double y,
+                                             double max_occ_dist,
+                                             bool allow_unknown,
+                                             SearchContext *context) {
+  context = this->context(context);
+
+  boost::shared_ptr<const Snapshot> snapshot = this->snapshot();
+  if (!snapshot) {
+    ROS_WARN("OccupancyMap::prepareNavigationFunction() Map not set");
+    return;
+  }
+
+  if (snapshot->map->max_occ_dist < max_occ_dist) {
+    ROS_ERROR("OccupancyMap::prepareNavigationFunction() CSpace has been "
+              "calculated up to %f, but max_occ_dist=%.2f",
+              snapshot->map->max_occ_dist, max_occ_dist);
+    ROS_BREAK();
+  }
+
+  int i = MAP_GXWX(snapshot->map, x);
+  int j = MAP_GYWY(snapshot->map, y);
+  if (!MAP_VALID(snapshot->map, i, j)) {
+    ROS_ERROR("OccupancyMap::prepareNavigationFunction() Invalid goal position");
+    ROS_BREAK();
+  }
+
+  // Search backwards from the goal so that costs are to the goal, and prev
+  // points one step closer to it
+  initializeSearch(snapshot, snapshot->gridIndex(i, j), &context->navigation);
+  VisitAll visitor;
+  snapshot->search<true>(NoHeuristic(), allow_unknown, connectivity_,
+                         &visitor, &context->navigation);
+}
+
+int OccupancyMap::Snapshot::navigationIndex(const SearchState &navigation,
+                                            int connectivity,
+                                            int i, int j) const {
+  if (!MAP_VALID(map, i, j)) {
+    return -1;
+  }
+  int index = gridIndex(i, j);
+  if (navigation.prev[index] != -1) {
+    return index;
+  }
+  // The search never enters untraversable cells, but a robot may still end up
+  // in one (e.g. pushed too close to an obstacle), so step to the neighbor
+  // that is cheapest to leave through
+  int best = -1;
+  float best_cost = std::numeric_limits<float>::infinity();
+  for (int k = 0; k < connectivity; ++k) {
+    int neighbor = index + offsets[k];
+    if (navigation.prev[neighbor] == -1) {
+      continue;
+    }
+    float cost = navigation.costs[neighbor] + edge_costs[k] +
+      search_cost[neighbor];
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = neighbor;
+    }
+  }
+  return best;
+}
+
+bool OccupancyMap::descend(double x, double y, double distance,
+                           double *out_x, double *out_y,
+                           const SearchContext *context) const {
+  const SearchState &navigation = this->context(context)->navigation;
+  const Snapshot *snapshot = navigation.map.get();
+  if (snapshot == NULL) {
+    return false;
+  }
+  const map_t *map = snapshot->map;
+  int index = snapshot->navigationIndex(navigation, connectivity_,
+                                        MAP_GXWX(map, x), MAP_GYWY(map, y));
+  if (index == -1) {
+    return false;
+  }
+
+  int i, j;
+  snapshot->gridCoord(index, &i, &j);
+  double remaining = distance / map->scale;
+  while (index != navigation.start && remaining > 0.0) {
+    int next = navigation.prev[index];
+    int nexti, nextj;
+    snapshot->gridCoord(next, &nexti, &nextj);
+    remaining -= (nexti != i && nextj != j) ? M_SQRT2 : 1.0;
+    index = next;
+    i = nexti;
+    j = nextj;
+  }
+  *out_x = MAP_WXGX(map, i);
+  *out_y = MAP_WYGY(map, j);
+  return true;
+}
+
+Path OccupancyMap::navigationPath(double x, double y,
+                                  const SearchContext *context) const {
+  Path path;
+  const SearchState &navigation = this->context(context)->navigation;
+  const Snapshot *snapshot = navigation.map.get();
+  if (snapshot == NULL) {
+    return path;
+  }
+  const map_t *map = snapshot->map;
+  int i = MAP_GXWX(map, x), j = MAP_GYWY(map, y);
+  int index = snapshot->navigationIndex(navigation, connectivity_, i, j);
+  if (index == -1) {
+    return path;
+  }
+  if (index != snapshot->gridIndex(i, j)) {
+    path.push_back(Eigen::Vector2f(MAP_WXGX(map, i), MAP_WYGY(map, j)));
+  }
+  snapshot->buildPath(index, navigation, &path);
+  return path;
+}
+
 void OccupancyMap::setThresholds(int free, int occ) {
   if (free < 0 || free >= 100) {
     ROS_ERROR("Unoccupied space threshold must be in the range [0,100)");
@@ -604,8 +1535,26 @@ void OccupancyMap::setThresholds(int free, int occ) {
     ROS_ERROR("Unoccupied space threshold must be less than occupied threshold");
     return;
   }
+  boost::mutex::scoped_lock lock(write_mutex_);
   max_free_threshold_ = free;
   min_occupied_threshold_ = occ;
 }
 
+void OccupancyMap::setConnectivity(int connectivity) {
+  if (connectivity != 4 && connectivity != 8) {
+    ROS_ERROR("Connectivity must be 4 or 8");
+    return;
+  }
+  connectivity_ = connectivity;
+}
+
+void OccupancyMap::setLandmarks(int num_landmarks) {
+  if (num_landmarks < 0 || num_landmarks > kMaxLandmarks) {
+    ROS_ERROR("Number of landmarks must be in the range [0,%i]", kMaxLandmarks);
+    return;
+  }
+  boost::mutex::scoped_lock lock(write_mutex_);
+  num_landmarks_ = num_landmarks;
+}
+
 } // end namespace scarab
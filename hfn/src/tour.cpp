@@ -0,0 +1,132 @@
+#include "tour.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <ros/ros.h>
+
+namespace scarab {
+
+double routeCost(const CostMatrix &cost, const std::vector<int> &order) {
+  double total = 0.0;
+  for (size_t k = 0; k + 1 < order.size(); ++k) {
+    total += cost[order[k]][order[k + 1]];
+  }
+  return total;
+}
+
+// Costs may be asymmetric, so moves are scored by the cost of the whole
+// route rather than by the edges they change.  Routes are short enough that
+// this is cheap.
+static bool twoOpt(const CostMatrix &cost, std::vector<int> *order,
+                   double *best, const ros::WallTime &deadline) {
+  bool improved = false;
+  int n = order->size();
+  for (int i = 1; i < n - 2; ++i) {
+    if (ros::WallTime::now() > deadline) {
+      break;
+    }
+    for (int j = i + 1; j < n - 1; ++j) {
+      std::reverse(order->begin() + i, order->begin() + j + 1);
+      double c = routeCost(cost, *order);
+      if (c < *best) {
+        *best = c;
+        improved = true;
+      } else {
+        std::reverse(order->begin() + i, order->begin() + j + 1);
+      }
+    }
+  }
+  return improved;
+}
+
+// Move runs of up to three points elsewhere in the route
+static bool orOpt(const CostMatrix &cost, std::vector<int> *order,
+                  double *best, const ros::WallTime &deadline) {
+  bool improved = false;
+  int n = order->size();
+  for (int len = 1; len <= 3; ++len) {
+    for (int i = 1; i + len < n; ++i) {
+      if (ros::WallTime::now() > deadline) {
+        return improved;
+      }
+      std::vector<int> rest(order->begin(), order->begin() + i);
+      rest.insert(rest.end(), order->begin() + i + len, order->end());
+      // Insert before rest[p]; the ends of the route stay put
+      for (size_t p = 1; p < rest.size(); ++p) {
+        if (p == size_t(i)) {
+          continue;
+        }
+        std::vector<int> candidate(rest.begin(), rest.begin() + p);
+        candidate.insert(candidate.end(), order->begin() + i,
+                         order->begin() + i + len);
+        candidate.insert(candidate.end(), rest.begin() + p, rest.end());
+        double c = routeCost(cost, candidate);
+        if (c < *best) {
+          *best = c;
+          *order = candidate;
+          improved = true;
+          break;
+        }
+      }
+    }
+  }
+  return improved;
+}
+
+std::vector<int> orderVisits(const CostMatrix &cost, double time_budget) {
+  ros::WallTime deadline = ros::WallTime::now() + ros::WallDuration(time_budget);
+  int n = cost.size();
+  std::vector<int> order;
+  if (n <= 3) {
+    for (int i = 0; i < n; ++i) {
+      order.push_back(i);
+    }
+    return order;
+  }
+
+  // Unreachable legs cost more than any route without them, so fewer of them
+  // is always better
+  double max_cost = 0.0;
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      if (!std::isinf(cost[i][j])) {
+        max_cost = std::max(max_cost, cost[i][j]);
+      }
+    }
+  }
+  CostMatrix c(cost);
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      if (std::isinf(c[i][j])) {
+        c[i][j] = 1.0 + n * max_cost;
+      }
+    }
+  }
+
+  // Nearest neighbor
+  std::vector<bool> visited(n, false);
+  visited[0] = visited[n - 1] = true;
+  order.push_back(0);
+  for (int k = 1; k < n - 1; ++k) {
+    int curr = order.back(), next = -1;
+    for (int j = 0; j < n; ++j) {
+      if (!visited[j] && (next == -1 || c[curr][j] < c[curr][next])) {
+        next = j;
+      }
+    }
+    visited[next] = true;
+    order.push_back(next);
+  }
+  order.push_back(n - 1);
+
+  double best = routeCost(c, order);
+  bool improved = true;
+  while (improved && ros::WallTime::now() < deadline) {
+    improved = twoOpt(c, &order, &best, deadline);
+    improved = orOpt(c, &order, &best, deadline) || improved;
+  }
+  return order;
+}
+
+} // end namespace scarab
@@ -0,0 +1,22 @@
+#ifndef TOUR_HPP
+#define TOUR_HPP
+
+#include <vector>
+
+namespace scarab {
+
+// cost[i][j] is the cost of traveling from point i to point j; it need not be
+// symmetric, and may be infinite if j can't be reached from i
+typedef std::vector<std::vector<double> > CostMatrix;
+
+// Order in which to visit every point, starting at the first one and ending
+// at the last.  Starts from the nearest neighbor route and improves it with
+// 2-opt and Or-opt moves until neither helps or time_budget seconds have
+// passed.
+std::vector<int> orderVisits(const CostMatrix &cost, double time_budget);
+
+// Total cost of visiting points in order
+double routeCost(const CostMatrix &cost, const std::vector<int> &order);
+
+} // end namespace scarab
+#endif
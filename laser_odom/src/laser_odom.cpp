@@ -1,30 +1,52 @@
 #include <ros/ros.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/OccupancyGrid.h>
 
 #include <tf/tf.h>
 #include <tf/transform_listener.h>
 
+#include <deque>
+
+#include <boost/lockfree/queue.hpp>
+
 #include "matcher.hpp"
+#include "spsc_queue.hpp"
 
 using std::string;
 
+// Longest gap in motor odometry to integrate over, in seconds
+const double kMaxOdomGap = 0.5;
+// Scans waiting for each stage of the pipeline
+const size_t kQueueSize = 16;
+
+// Scans go through three stages, each on its own thread: laserCb()
+// preprocesses them on the spinner thread, matchLoop() matches them and
+// publishes odometry, and mapLoop() adds them to the map.  So preprocessing
+// the next scan and updating the map with the last one overlap with
+// matching.
+
 class LaserOdomNode {
 public:
   LaserOdomNode()
     : pnh_("~"), matcher_(mrsl::ScanMatcher::Params::FromROS(pnh_)),
-      have_pose_(false) {
+      have_pose_(false), odom_motion_(0.0, 0.0, 0.0), odom_gap_(false),
+      scans_(kQueueSize), updates_(kQueueSize), free_frames_(3 * kQueueSize) {
     string laser_base_frame;
     pnh_.param("odom_frame", odom_frame_, string("odom_laser"));
     pnh_.param("base_frame", base_frame_, string("base_link"));
     pnh_.param("laser_base_frame", laser_base_frame, string("base_link"));
     pnh_.param("laser_frame", laser_frame_, string("laser"));
     pnh_.param("debug", debug_, false);
+    // Scans older than this when a newer one is waiting are skipped
+    pnh_.param("max_latency", max_latency_, 0.1);
 
     sscan_ = nh_.subscribe("scan", 5, &LaserOdomNode::laserCb, this);
     sub_motor_odom_ = nh_.subscribe("odom_motor", 5, &LaserOdomNode::motorOdomCb, this);
 
     podom_ = nh_.advertise<nav_msgs::Odometry>("odom_laser", 5, false);
+    pmatch_ = nh_.advertise<diagnostic_msgs::DiagnosticArray>("match_status", 5,
+                                                               false);
     if (debug_) {
       pmap_ = nh_.advertise<nav_msgs::OccupancyGrid>("map_local", 1, true);
     }
@@ -39,6 +61,7 @@ public:
                laser_base_frame.c_str(), laser_frame_.c_str());
       laser_tform_.setRotation(tf::createQuaternionFromYaw(0.0));
     }
+    laser_offset_ = Pose2d(laser_tform_);
 
     odom_.header.frame_id = odom_frame_;
     odom_.child_frame_id = base_frame_;
@@ -47,71 +70,237 @@ public:
     tf::Pose pose;
     tf::poseMsgToTF(matcher_.map().origin(), pose);
     tf::poseTFToMsg(pose * laser_tform_, matcher_.map().origin());
+
+    match_thread_ = boost::thread(&LaserOdomNode::matchLoop, this);
+    map_thread_ = boost::thread(&LaserOdomNode::mapLoop, this);
+  }
+
+  ~LaserOdomNode() {
+    // Each stage finishes the scans queued for it, and hands them on, before
+    // the next stage is told to stop
+    scans_.close();
+    match_thread_.join();
+    updates_.close();
+    map_thread_.join();
+    for (size_t i = 0; i < frames_.size(); ++i) {
+      delete frames_[i];
+    }
   }
 
   // Get 3D pose of laser in local map
-  tf::Pose laserPose() {
-    return laser_tform_ * matcher_.pose().tf();
+  tf::Pose laserPose(const Pose2d &pose) {
+    return laser_tform_ * pose.tf();
   }
 
+  // Integrate motor odometry velocities between scans, as the prior for
+  // matching the next one
   void motorOdomCb(const nav_msgs::Odometry &msg) {
+    if (motor_odom_) {
+      double dt = (msg.header.stamp - motor_odom_->header.stamp).toSec();
+      if (dt < 0.0 || dt > kMaxOdomGap) {
+        odom_gap_ = true;
+      } else {
+        const geometry_msgs::Twist &twist = msg.twist.twist;
+        odom_motion_ = odom_motion_.oplus(Pose2d(twist.linear.x * dt,
+                                                 twist.linear.y * dt,
+                                                 twist.angular.z * dt));
+      }
+    }
     motor_odom_ = msg;
   }
 
   void laserCb(const sensor_msgs::LaserScan &scan) {
-    // No odom estimate
-    bool map_change = matcher_.addScan(Pose2d(0.0, 0.0, 0.0), scan);
-    if (debug_) {
-      if (map_change) {
+    Frame *frame = newFrame();
+    matcher_.preprocess(scan, &frame->scan);
+    // The search window is only narrowed if odometry covered the whole time
+    // since the last scan.  Matching tracks the laser, which moves
+    // differently from the base when it isn't mounted on the axis of
+    // rotation.
+    frame->scan.odom = odom_motion_.oplus(laser_offset_).ominus(laser_offset_);
+    frame->scan.odom_valid = motor_odom_ && !odom_gap_ &&
+      fabs((scan.header.stamp - motor_odom_->header.stamp).toSec()) < kMaxOdomGap;
+    frame->have_motor_odom = bool(motor_odom_);
+    frame->motor_vx = motor_odom_ ? motor_odom_->twist.twist.linear.x : 0.0;
+    if (!scans_.push(frame)) {
+      // Matching has fallen far behind; odometry carries over to the next
+      // scan
+      ROS_WARN_THROTTLE(1.0, "Scan queue full, dropping scan");
+      free_frames_.push(frame);
+      return;
+    }
+    odom_motion_ = Pose2d(0.0, 0.0, 0.0);
+    odom_gap_ = false;
+  }
+
+private:
+  // A scan, and the motor odometry when it arrived
+  struct Frame {
+    Frame() : have_motor_odom(false), motor_vx(0.0) {}
+    mrsl::ScanMatcher::Scan scan;
+    bool have_motor_odom;
+    double motor_vx;
+  };
+
+  // A frame that no stage is using; frames are only allocated until there
+  // are enough of them in circulation
+  Frame* newFrame() {
+    Frame *frame;
+    if (!free_frames_.pop(frame)) {
+      frame = new Frame;
+      frames_.push_back(frame);
+    }
+    return frame;
+  }
+
+  void matchLoop() {
+    std::deque<Frame*> pending;
+    Frame *frame;
+    while (true) {
+      // Only wait for a scan if none are left over from the last round
+      if (pending.empty()) {
+        if (!scans_.pop(&frame)) {
+          return;
+        }
+        pending.push_back(frame);
+      }
+      while (scans_.tryPop(&frame)) {
+        pending.push_back(frame);
+      }
+      // Skip scans that would make odometry late, folding their odometry
+      // into the next one
+      while (pending.size() > 1 && (pending.back()->scan.stamp -
+             pending.front()->scan.stamp).toSec() > max_latency_) {
+        const mrsl::ScanMatcher::Scan &skipped = pending.front()->scan;
+        mrsl::ScanMatcher::Scan &next = pending[1]->scan;
+        next.odom = skipped.odom.oplus(next.odom);
+        next.odom_valid = next.odom_valid && skipped.odom_valid;
+        free_frames_.push(pending.front());
+        pending.pop_front();
+        ROS_WARN_THROTTLE(1.0, "Matching is behind, skipping scan");
+      }
+
+      frame = pending.front();
+      pending.pop_front();
+      matcher_.matchScan(&frame->scan);
+      publishOdom(*frame);
+      if (pmatch_.getNumSubscribers() > 0) {
+        publishMatch(frame->scan);
+      }
+      if (!updates_.push(frame)) {
+        ROS_WARN_THROTTLE(1.0, "Map update queue full, not adding scan");
+        free_frames_.push(frame);
+      }
+    }
+  }
+
+  void mapLoop() {
+    Frame *frame;
+    while (updates_.pop(&frame)) {
+      bool map_change = matcher_.update(&frame->scan);
+      free_frames_.push(frame);
+      if (debug_ && map_change) {
         pmap_.publish(matcher_.map().occGrid());
       }
     }
+  }
+
+  // Quality and resolution reached by matching, which can stop short of
+  // full resolution with a time budget
+  void publishMatch(const mrsl::ScanMatcher::Scan &scan) {
+    const mrsl::ScanMatcher::MatchInfo &match = scan.match;
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = scan.stamp;
+    msg.status.resize(1);
+    diagnostic_msgs::DiagnosticStatus &status = msg.status[0];
+    status.name = ros::this_node::getName() + ": scan matching";
+    status.hardware_id = laser_frame_;
+    if (match.levels == 0) {
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.message = "Not matched";
+    } else if (match.stride > 1) {
+      status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      status.message = "Stopped short of full resolution";
+    } else {
+      status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      status.message = "Full resolution";
+    }
+    addValue(&status, "quality", "%.3f", match.quality);
+    addValue(&status, "stride", "%.0f", match.stride);
+    addValue(&status, "points", "%.0f", match.points);
+    addValue(&status, "levels", "%.0f", match.levels);
+    addValue(&status, "match_time", "%.4f", scan.timing.match);
+    pmatch_.publish(msg);
+  }
 
-    odom_.header.stamp = scan.header.stamp;
-    tf::poseTFToMsg(laserPose(), odom_.pose.pose);
+  static void addValue(diagnostic_msgs::DiagnosticStatus *status,
+                       const char *key, const char *format, double value) {
+    char s[32];
+    snprintf(s, sizeof(s), format, value);
+    diagnostic_msgs::KeyValue kv;
+    kv.key = key;
+    kv.value = s;
+    status->values.push_back(kv);
+  }
+
+  void publishOdom(const Frame &frame) {
+    const mrsl::ScanMatcher::Scan &scan = frame.scan;
+    odom_.header.stamp = scan.stamp;
+    tf::poseTFToMsg(laserPose(scan.pose), odom_.pose.pose);
     // Get velocity estimate
     if (!have_pose_) {
-      last_pose_ = matcher_.pose();
+      last_pose_ = scan.pose;
       have_pose_ = true;
     } else {
-      double dt = (scan.header.stamp - last_pose_time_).toSec();
+      double dt = (scan.stamp - last_pose_time_).toSec();
       if (dt > 0.2) {
-        Pose2d change = matcher_.pose().ominus(last_pose_);
+        Pose2d change = scan.pose.ominus(last_pose_);
         odom_.twist.twist.linear.x = change.x() / dt;
         odom_.twist.twist.linear.y = change.y() / dt;
         odom_.twist.twist.angular.z = change.t() / dt;
-        last_pose_time_ = scan.header.stamp;
-        last_pose_ = matcher_.pose();
+        last_pose_time_ = scan.stamp;
+        last_pose_ = scan.pose;
       }
     }
 
-    if (motor_odom_) {
-      odom_.twist.twist.linear.x = motor_odom_->twist.twist.linear.x;
+    if (frame.have_motor_odom) {
+      odom_.twist.twist.linear.x = frame.motor_vx;
     } else {
       ROS_ERROR("No motor odometry");
     }
 
     podom_.publish(odom_);
     tf_.sendTransform(
-      tf::StampedTransform(laserPose(), scan.header.stamp,
+      tf::StampedTransform(laserPose(scan.pose), scan.stamp,
                            odom_frame_, base_frame_));
   }
 
-private:
   ros::NodeHandle nh_, pnh_;
   std::string odom_frame_, base_frame_, laser_frame_;
   tf::StampedTransform laser_tform_;
+  Pose2d laser_offset_; // laser_tform_ in the plane
   mrsl::ScanMatcher matcher_;
   ros::Subscriber sscan_, sub_motor_odom_;
-  ros::Publisher podom_, pmap_;
+  ros::Publisher podom_, pmap_, pmatch_;
   bool have_pose_;
   Pose2d last_pose_;
   ros::Time last_pose_time_;
   bool debug_;
+  double max_latency_;
   tf::TransformBroadcaster tf_;
   tf::TransformListener tf_listen_;
   nav_msgs::Odometry odom_;
   boost::optional<nav_msgs::Odometry> motor_odom_;
+  // Motion integrated from motor odometry since the last scan, and whether
+  // it has had a gap
+  Pose2d odom_motion_;
+  bool odom_gap_;
+  // Preprocessed scans for matchLoop(), and matched ones for mapLoop()
+  mrsl::SpscQueue<Frame*> scans_, updates_;
+  // Frames that have been through the pipeline or were dropped from it, for
+  // laserCb() to reuse; frames_ owns all of them
+  boost::lockfree::queue<Frame*> free_frames_;
+  std::vector<Frame*> frames_;
+  boost::thread match_thread_, map_thread_;
 };
 
 int main(int argc, char **argv) {
@@ -1,3 +1,17 @@
+// Run ScanMatcher over the scans of a bag, comparing its path to the one in
+// the bag's /tf.
+//
+// usage: laser_odom_bag bagfile [scan topic] [base frame] [report.json]
+//
+// By default paths, scans and maps are published for rviz as the bag is
+// played.  Given a report file ("-" for stdout), scans are instead run as
+// fast as possible with nothing published and no ROS master needed, and
+// throughput, per-stage latency percentiles, match quality and trajectory
+// error are written to it as JSON.  Without a master, matcher parameters keep their defaults.
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
 #include <boost/foreach.hpp>
@@ -9,11 +23,7 @@
 using namespace std;
 using namespace mrsl;
 
-const std::string scan_topic("/scarab44/scan");
-const std::string map_topic("/scarab44/map");
-
 const std::string map_frame("/map");
-const std::string base_frame("/scarab44/base_link");
 
 struct BagTF {
   BagTF(const rosbag::Bag &bag) {
@@ -42,7 +52,7 @@ struct BagTF {
   ros::Time end;
 };
 
-ros::Publisher publishMap(const rosbag::Bag &bag) {
+ros::Publisher publishMap(const rosbag::Bag &bag, const string &map_topic) {
   rosbag::View view(bag, rosbag::TopicQuery(map_topic));
   ros::NodeHandle nh;
   ros::Publisher pub = nh.advertise<nav_msgs::OccupancyGrid>(map_topic, 1, true);
@@ -62,12 +72,196 @@ void add_pose(const tf::Pose &tf_pose, nav_msgs::Path *path) {
   path->header.stamp = ros::Time::now();
 }
 
+// Latencies of a stage, in milliseconds
+struct Latency {
+  void add(double seconds) {
+    ms.push_back(1000.0 * seconds);
+  }
+  vector<double> ms;
+};
+
+void writeLatency(FILE *file, const char *name, Latency *latency,
+                  bool last) {
+  vector<double> &ms = latency->ms;
+  sort(ms.begin(), ms.end());
+  double total = 0.0;
+  for (size_t i = 0; i < ms.size(); ++i) {
+    total += ms[i];
+  }
+  double mean = ms.empty() ? 0.0 : total / ms.size();
+  // Nearest rank percentiles
+  double p[3] = {0.5, 0.9, 0.99}, value[3] = {0.0, 0.0, 0.0};
+  for (int k = 0; k < 3 && !ms.empty(); ++k) {
+    value[k] = ms[min(ms.size() - 1, size_t(p[k] * ms.size()))];
+  }
+  fprintf(file, "    \"%s\": {\"count\": %zu, \"mean\": %.4f, \"p50\": %.4f, "
+          "\"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n", name, ms.size(),
+          mean, value[0], value[1], value[2], ms.empty() ? 0.0 : ms.back(),
+          last ? "" : ",");
+}
+
+// Error of the estimated path against the true one, for each scan
+struct TrajectoryError {
+  TrajectoryError() : missing(0) {}
+  void add(const Pose2d &estimate, const tf::Transform &truth) {
+    Pose2d true_pose(truth);
+    translation.push_back(hypot(estimate.x() - true_pose.x(),
+                                estimate.y() - true_pose.y()));
+    rotation.push_back(fabs(angles::normalize_angle(estimate.t() -
+                                                    true_pose.t())));
+  }
+  vector<double> translation, rotation;
+  // Scans without ground truth
+  int missing;
+};
+
+double rms(const vector<double> &v) {
+  double sum = 0.0;
+  for (size_t i = 0; i < v.size(); ++i) {
+    sum += v[i] * v[i];
+  }
+  return v.empty() ? 0.0 : sqrt(sum / v.size());
+}
+
+double mean(const vector<double> &v) {
+  double sum = 0.0;
+  for (size_t i = 0; i < v.size(); ++i) {
+    sum += v[i];
+  }
+  return v.empty() ? 0.0 : sum / v.size();
+}
+
+double largest(const vector<double> &v) {
+  return v.empty() ? 0.0 : *max_element(v.begin(), v.end());
+}
+
+double smallest(const vector<double> &v) {
+  return v.empty() ? 0.0 : *min_element(v.begin(), v.end());
+}
+
+double last(const vector<double> &v) {
+  return v.empty() ? 0.0 : v.back();
+}
+
+// Stream the scans through the matcher, and write a report
+int runHeadless(const rosbag::Bag &bag, const string &scan_topic,
+                const string &base_frame, const string &report_path) {
+  BagTF tf_tree(bag);
+  rosbag::View view(bag, rosbag::TopicQuery(scan_topic));
+
+  ros::Time start_time = tf_tree.start + ros::Duration(0.1);
+  ros::Time stop_time = tf_tree.end - ros::Duration(1.0);
+  tf::StampedTransform offset, transform;
+  tf_tree.transformer->lookupTransform(map_frame, base_frame, start_time,
+                                       offset);
+
+  ros::NodeHandle pnh("~");
+  ScanMatcher mapper(ScanMatcher::Params::FromROS(pnh), false);
+  mapper.setPose(Pose2d(offset.getOrigin().x(), offset.getOrigin().y(),
+                        tf::getYaw(offset.getRotation())));
+
+  Latency total, preprocess, match, update;
+  // Match quality, and scans matched short of full resolution
+  vector<double> quality;
+  int coarse = 0;
+  TrajectoryError error;
+  ros::WallTime begin = ros::WallTime::now();
+  BOOST_FOREACH(const rosbag::MessageInstance &m, view) {
+    if (m.getTime() < start_time) {
+      continue;
+    } else if (m.getTime() > stop_time) {
+      break;
+    }
+    sensor_msgs::LaserScan::Ptr msg = m.instantiate<sensor_msgs::LaserScan>();
+    if (!msg) {
+      continue;
+    }
+    msg->header.stamp = m.getTime();
+
+    ros::WallTime scan_begin = ros::WallTime::now();
+    mapper.addScan(Pose2d(0.0, 0.0, 0.0), *msg);
+    total.add((ros::WallTime::now() - scan_begin).toSec());
+    const ScanMatcher::Timing &timing = mapper.timing();
+    preprocess.add(timing.preprocess);
+    match.add(timing.match);
+    update.add(timing.update);
+    const ScanMatcher::MatchInfo &info = mapper.matchInfo();
+    if (info.levels > 0) {
+      quality.push_back(info.quality);
+      coarse += info.stride > 1;
+    }
+
+    try {
+      tf_tree.transformer->lookupTransform(map_frame, base_frame, m.getTime(),
+                                           transform);
+      error.add(mapper.pose(), transform);
+    } catch (const tf::TransformException &exception) {
+      ++error.missing;
+    }
+  }
+  double wall_time = (ros::WallTime::now() - begin).toSec();
+
+  FILE *file = report_path == "-" ? stdout : fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    ROS_ERROR("laser_odom_bag: Couldn't open %s", report_path.c_str());
+    return 1;
+  }
+  // Throughput of the matcher alone, without reading the bag
+  double matcher_time = accumulate(total.ms.begin(), total.ms.end(), 0.0) /
+    1000.0;
+  fprintf(file, "{\n");
+  fprintf(file, "  \"scans\": %zu,\n", total.ms.size());
+  fprintf(file, "  \"bag_duration\": %.3f,\n", (stop_time - start_time).toSec());
+  fprintf(file, "  \"wall_time\": %.3f,\n", wall_time);
+  fprintf(file, "  \"scans_per_sec\": %.1f,\n",
+          matcher_time > 0.0 ? total.ms.size() / matcher_time : 0.0);
+  fprintf(file, "  \"latency_ms\": {\n");
+  writeLatency(file, "total", &total, false);
+  writeLatency(file, "preprocess", &preprocess, false);
+  writeLatency(file, "match", &match, false);
+  writeLatency(file, "update", &update, true);
+  fprintf(file, "  },\n");
+  fprintf(file, "  \"match\": {\n");
+  fprintf(file, "    \"matched\": %zu,\n", quality.size());
+  fprintf(file, "    \"coarse\": %i,\n", coarse);
+  fprintf(file, "    \"quality_mean\": %.4f,\n", mean(quality));
+  fprintf(file, "    \"quality_min\": %.4f\n", smallest(quality));
+  fprintf(file, "  },\n");
+  fprintf(file, "  \"trajectory\": {\n");
+  fprintf(file, "    \"poses\": %zu,\n", error.translation.size());
+  fprintf(file, "    \"missing\": %i,\n", error.missing);
+  fprintf(file, "    \"translation_rmse\": %.4f,\n", rms(error.translation));
+  fprintf(file, "    \"translation_mean\": %.4f,\n", mean(error.translation));
+  fprintf(file, "    \"translation_max\": %.4f,\n", largest(error.translation));
+  fprintf(file, "    \"translation_final\": %.4f,\n", last(error.translation));
+  fprintf(file, "    \"rotation_rmse\": %.5f,\n", rms(error.rotation));
+  fprintf(file, "    \"rotation_max\": %.5f,\n", largest(error.rotation));
+  fprintf(file, "    \"rotation_final\": %.5f\n", last(error.rotation));
+  fprintf(file, "  }\n");
+  fprintf(file, "}\n");
+  if (file != stdout) {
+    fclose(file);
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
-  ros::init(argc, argv, "map_build_bag");
-  if (argc != 2) {
-    ROS_ERROR("usage: map_build_bag bagfile");
+  ros::init(argc, argv, "map_build_bag",
+            ros::init_options::AnonymousName | ros::init_options::NoRosout);
+  if (argc < 2 || argc > 5) {
+    ROS_ERROR("usage: map_build_bag bagfile [scan topic] [base frame] "
+              "[report.json]");
     return 1;
   }
+  string scan_topic = argc > 2 ? argv[2] : "/scarab44/scan";
+  string base_frame = argc > 3 ? argv[3] : "/scarab44/base_link";
+  string map_topic = ros::names::parentNamespace(scan_topic) + "/map";
+
+  std::string bag_path(argv[1]);
+  rosbag::Bag bag(bag_path);
+  if (argc > 4) {
+    return runHeadless(bag, scan_topic, base_frame, argv[4]);
+  }
 
   ros::NodeHandle nh, pnh("~");
   ros::Publisher pub_path_true
@@ -80,11 +274,8 @@ int main(int argc, char **argv) {
     = nh.advertise<sensor_msgs::LaserScan>("/scan_mapping", 1, false);
   ros::Publisher pub_newmap =
     nh.advertise<nav_msgs::OccupancyGrid>("/newmap", 1, true);
-  std::string bag_path(argv[1]);
-  rosbag::Bag bag(bag_path);
-
-  ros::Publisher pub_map = publishMap(bag);
 
+  ros::Publisher pub_map = publishMap(bag, map_topic);
   BagTF tf_tree(bag);
 
   rosbag::View view(bag, rosbag::TopicQuery(scan_topic));
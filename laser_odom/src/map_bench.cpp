@@ -0,0 +1,234 @@
+// Drive GridMap through random stampMax(), setMax(), decay(), recenter() and
+// fill() calls, and check get(), copy() and occGrid() against a plain
+// row-major model of the window that's updated eagerly.  The window wanders over negative and
+// positive subscripts, by less than a tile as well as by more than the whole
+// window, and stamps are cut off by its edges.  Decay builds up over many
+// calls, past 255, between the writes that settle it.  occGrid() is only
+// asked for now and then, so that it has a mix of changes to catch up on;
+// it's compared with the whole window converted from the model.  Mismatches
+// are reported, and make the exit status nonzero.
+//
+// usage: map_bench [steps]
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "matcher.hpp"
+
+using namespace std;
+using namespace mrsl;
+
+// The window of a GridMap, stored row by row without wrapping, and moved by
+// copying
+class Model {
+public:
+  explicit Model(const GridMap &map)
+    : map_(&map), win_x_(map.windowX()), win_y_(map.windowY()),
+      width_(map.width()), height_(map.height()),
+      cells_(width_ * height_, 0) { }
+
+  int windowX() const { return win_x_; }
+  int windowY() const { return win_y_; }
+
+  bool valid(int xi, int yi) const {
+    return win_x_ <= xi && xi < win_x_ + width_ &&
+      win_y_ <= yi && yi < win_y_ + height_;
+  }
+
+  uint8_t get(int xi, int yi) const {
+    return valid(xi, yi) ? cells_[(yi - win_y_) * width_ + xi - win_x_] : 0;
+  }
+
+  void setMax(int xi, int yi, uint8_t val) {
+    if (valid(xi, yi)) {
+      uint8_t &cell = cells_[(yi - win_y_) * width_ + xi - win_x_];
+      cell = max(cell, val);
+    }
+  }
+
+  void stampMax(int xi, int yi, const uint8_t *stamp, int size, int stride) {
+    for (int y = 0; y < size; ++y) {
+      for (int x = 0; x < size; ++x) {
+        setMax(xi + x, yi + y, stamp[y * stride + x]);
+      }
+    }
+  }
+
+  void decay(int val) {
+    for (size_t i = 0; i < cells_.size(); ++i) {
+      cells_[i] = cells_[i] > val ? cells_[i] - val : 0;
+    }
+  }
+
+  void fill(uint8_t val) {
+    cells_.assign(cells_.size(), val);
+  }
+
+  void recenter(double x, double y) {
+    int xi = floor((x - map_->originX()) / map_->metersPerPixel());
+    int yi = floor((y - map_->originY()) / map_->metersPerPixel());
+    Model moved(*this);
+    moved.win_x_ = xi - width_ / 2;
+    moved.win_y_ = yi - height_ / 2;
+    for (int y = 0; y < height_; ++y) {
+      for (int x = 0; x < width_; ++x) {
+        moved.cells_[y * width_ + x] = get(moved.win_x_ + x, moved.win_y_ + y);
+      }
+    }
+    *this = moved;
+  }
+
+  // What GridMap::occGrid() should hold
+  bool sameOccGrid(const nav_msgs::OccupancyGrid &grid) const {
+    double resolution = map_->metersPerPixel();
+    if (int(grid.info.width) != width_ || int(grid.info.height) != height_ ||
+        grid.info.resolution != float(resolution) ||
+        fabs(grid.info.origin.position.x - map_->originX() -
+             win_x_ * resolution) > 1e-9 ||
+        fabs(grid.info.origin.position.y - map_->originY() -
+             win_y_ * resolution) > 1e-9 ||
+        int(grid.data.size()) != width_ * height_) {
+      return false;
+    }
+    for (size_t i = 0; i < cells_.size(); ++i) {
+      if (grid.data[i] != 100 - static_cast<int>(cells_[i] / 2.55)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  const GridMap *map_;
+  int win_x_, win_y_;
+  int width_, height_;
+  vector<uint8_t> cells_;
+};
+
+// A size x size stamp of random values, rows stride apart, with the 16 zero
+// cells before and after each row that stampMax() needs; the stamp starts at
+// &buffer[16]
+void randomStamp(int size, vector<uint8_t> *buffer, int *stride) {
+  *stride = size + 16;
+  buffer->assign(16 + size * *stride + 16, 0);
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      buffer->at(16 + y * *stride + x) = lrand48() % 256;
+    }
+  }
+}
+
+// Random subscript within margin cells of the window of map
+void randomCell(const GridMap &map, int margin, int *xi, int *yi) {
+  *xi = map.windowX() - margin + lrand48() % (map.width() + 2 * margin);
+  *yi = map.windowY() - margin + lrand48() % (map.height() + 2 * margin);
+}
+
+int main(int argc, char **argv) {
+  int steps = argc > 1 ? atoi(argv[1]) : 3000;
+  srand48(1);
+
+  // 3 x 2 tiles of 64 cells
+  const double kResolution = 0.05;
+  GridMap map(-1.0, 9.6, 0.5, 6.4, kResolution);
+  map.fill(0);
+  Model model(map);
+  // Center of the window, in meters
+  double cx = map.originX() + (map.windowX() + map.width() / 2) * kResolution;
+  double cy = map.originY() + (map.windowY() + map.height() / 2) * kResolution;
+
+  int mismatches = 0, window_mismatches = 0, grid_mismatches = 0, grids = 0;
+  long cells_checked = 0;
+  vector<uint8_t> stamp, block;
+  for (int step = 0; step < steps; ++step) {
+    double r = drand48();
+    if (r < 0.2) {
+      // Mostly less than a tile, sometimes past the whole window; the walk
+      // is pulled back to keep it within 15 m of the origin
+      double jump = drand48() < 0.05 ? 20.0 : 2.0;
+      cx += jump * (drand48() - 0.5) - 0.02 * cx;
+      cy += jump * (drand48() - 0.5) - 0.02 * cy;
+      map.recenter(cx, cy);
+      model.recenter(cx, cy);
+      if (map.windowX() != model.windowX() ||
+          map.windowY() != model.windowY()) {
+        ++window_mismatches;
+      }
+    } else if (r < 0.5) {
+      int size = 1 + lrand48() % 40, stride, xi, yi;
+      randomStamp(size, &stamp, &stride);
+      randomCell(map, size, &xi, &yi);
+      map.stampMax(xi, yi, &stamp[16], size, stride);
+      model.stampMax(xi, yi, &stamp[16], size, stride);
+    } else if (r < 0.75) {
+      for (int k = 0; k < 20; ++k) {
+        int xi, yi;
+        randomCell(map, 4, &xi, &yi);
+        uint8_t val = lrand48() % 256;
+        map.setMax(xi, yi, val);
+        model.setMax(xi, yi, val);
+      }
+    } else if (r < 0.995) {
+      // Mostly small steps, as ScanMatcher takes them
+      int val = drand48() < 0.9 ? 1 + lrand48() % 20 : lrand48() % 300;
+      map.decay(val);
+      model.decay(val);
+    } else {
+      uint8_t val = drand48() < 0.5 ? 0 : lrand48() % 256;
+      map.fill(val);
+      model.fill(val);
+    }
+
+    bool ok = true;
+    for (int k = 0; k < 500; ++k) {
+      int xi, yi;
+      randomCell(map, 20, &xi, &yi);
+      ok = ok && map.get(xi, yi) == model.get(xi, yi);
+    }
+    cells_checked += 500;
+
+    // A block that may hang over any edge of the window
+    int num_x = 1 + lrand48() % (map.width() + 40);
+    int num_y = 1 + lrand48() % (map.height() + 40);
+    int stride = num_x + lrand48() % 8, xi, yi;
+    randomCell(map, 20, &xi, &yi);
+    xi -= num_x / 2;
+    yi -= num_y / 2;
+    block.assign(stride * num_y, 0xaa);
+    map.copy(xi, yi, num_x, num_y, &block[0], stride);
+    for (int y = 0; y < num_y; ++y) {
+      for (int x = 0; x < num_x; ++x) {
+        ok = ok && block[y * stride + x] == model.get(xi + x, yi + y);
+      }
+    }
+    cells_checked += num_x * num_y;
+
+    if (!ok) {
+      if (mismatches < 10) {
+        ROS_ERROR("Step %i: cells differ from the model", step);
+      }
+      ++mismatches;
+    }
+
+    if (drand48() < 0.2) {
+      ++grids;
+      if (!model.sameOccGrid(map.occGrid())) {
+        if (grid_mismatches < 10) {
+          ROS_ERROR("Step %i: occGrid() differs from the model", step);
+        }
+        ++grid_mismatches;
+      }
+    }
+  }
+
+  ROS_INFO("%i x %i cells, %i steps, %li cells checked", map.width(),
+           map.height(), steps, cells_checked);
+  ROS_INFO("%i/%i steps differ, %i windows differ, %i/%i occGrid() calls "
+           "differ", mismatches, steps, window_mismatches, grid_mismatches,
+           grids);
+  return mismatches == 0 && window_mismatches == 0 && grid_mismatches == 0 ?
+    0 : 1;
+}
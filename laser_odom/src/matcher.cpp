@@ -1,12 +1,15 @@
 #include "matcher.hpp"
+#include "score_kernels.hpp"
 
+#include <boost/atomic.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
 #include <queue>
 
-#include <sensor_msgs/PointCloud.h>
-#include <pcl_ros/point_cloud.h>
-#include <pcl/point_types.h>
+#include <sensor_msgs/PointCloud2.h>
 #include <laser_geometry/laser_geometry.h>
-#include <pcl/filters/voxel_grid.h>
 
 using namespace std;
 using namespace Eigen;
@@ -14,20 +17,340 @@ using namespace mrsl;
 
 GridMap::GridMap(double ox, double width, double oy, double height,
                  double meters_per_pixel)
-  : origin_x_(ox), origin_y_(oy), meters_per_pixel_(meters_per_pixel) {
-  width_ = ceil(width / meters_per_pixel_);
-  height_ = ceil(height / meters_per_pixel_);
+  : origin_x_(ox), origin_y_(oy), meters_per_pixel_(meters_per_pixel),
+    win_x_(0), win_y_(0), revision_(0), decay_total_(0), ros_revision_(-1),
+    ros_win_x_(0), ros_win_y_(0) {
+  const int tile_size = 1 << kTileBits;
+  width_ = ceil(width / meters_per_pixel_ / tile_size) * tile_size;
+  height_ = ceil(height / meters_per_pixel_ / tile_size) * tile_size;
+  origin_.position.x = origin_x_;
+  origin_.position.y = origin_y_;
+  origin_.orientation.w = 1.0;
   ros_grid_.reset(new nav_msgs::OccupancyGrid);
   ros_grid_->header.frame_id = "/map";
   ros_grid_->data.resize(width_ * height_);
   ros_grid_->info.resolution = meters_per_pixel_;
   ros_grid_->info.width = width_;
   ros_grid_->info.height = height_;
-  ros_grid_->info.origin.position.x = origin_x_;
-  ros_grid_->info.origin.position.y = origin_y_;
-  ros_grid_->info.origin.orientation.w = 1.0;
 
   grid_ = new uint8_t[width_ * height_];
+  tiles_x_ = width_ >> kTileBits;
+  int tiles = tiles_x_ * (height_ >> kTileBits);
+  tile_decay_.resize(tiles, 0);
+  tile_revision_.resize(tiles, 0);
+  ros_tile_revision_.resize(tiles, -1);
+  ros_tile_pending_.resize(tiles, 0);
+  ros_tile_empty_.resize(tiles, 0);
+}
+
+void GridMap::settle(int tile) {
+  int pending = this->pending(tile);
+  if (pending == 0) {
+    return;
+  }
+  uint8_t *cells = tileData(tile);
+  subtractRow(cells, cells, 1 << (2 * kTileBits), pending);
+  tile_decay_[tile] = decay_total_;
+}
+
+void GridMap::stampMax(int xi, int yi, const uint8_t *stamp, int size,
+                       int stride) {
+  int x0 = max(xi, win_x_), x1 = min(xi + size, win_x_ + width_);
+  int y0 = max(yi, win_y_), y1 = min(yi + size, win_y_ + height_);
+  if (x0 != xi || y0 != yi || x1 != xi + size || y1 != yi + size) {
+    // Long beams reach past the window all the time; those cells are dropped
+    ROS_DEBUG_THROTTLE(1.0, "Setting coordinates outside map");
+  }
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  ++revision_;
+  // The block is split at tile edges, which is also where it wraps around
+  // the buffer.  Pieces are widened to a multiple of 16 cells, so maxRows()
+  // needs no scalar tail, past the edges of the stamp into its zero padding;
+  // that leaves the cells there unchanged.
+  const int tile_size = 1 << kTileBits, mask = tile_size - 1;
+  for (int ty = y0 & ~mask; ty < y1; ty += tile_size) {
+    int py0 = max(y0, ty), py1 = min(y1, ty + tile_size);
+    for (int tx = x0 & ~mask; tx < x1; tx += tile_size) {
+      int px0 = max(x0, tx), px1 = min(x1, tx + tile_size);
+      int tile = this->tile(tx, ty);
+      settle(tile);
+      touch(tile);
+      int extra = (16 - (px1 - px0) % 16) % 16;
+      int room_after = px1 == xi + size ? tx + tile_size - px1 : 0;
+      int room_before = px0 == xi ? px0 - tx : 0;
+      if (extra <= room_after) {
+        px1 += extra;
+      } else if (extra <= room_after + room_before) {
+        px0 -= extra - room_after;
+        px1 += room_after;
+      }
+      maxRows(tileData(tile) + ((py0 - ty) << kTileBits) + px0 - tx,
+              tile_size, stamp + (py0 - yi) * stride + px0 - xi, stride,
+              px1 - px0, py1 - py0);
+    }
+  }
+}
+
+void GridMap::clear(int xi, int yi, int num_x, int num_y) {
+  const int tile_size = 1 << kTileBits, mask = tile_size - 1;
+  for (int ty = yi & ~mask; ty < yi + num_y; ty += tile_size) {
+    int py0 = max(yi, ty), py1 = min(yi + num_y, ty + tile_size);
+    for (int tx = xi & ~mask; tx < xi + num_x; tx += tile_size) {
+      int px0 = max(xi, tx), px1 = min(xi + num_x, tx + tile_size);
+      int tile = this->tile(tx, ty);
+      touch(tile);
+      uint8_t *cells = tileData(tile);
+      if (px1 - px0 == tile_size && py1 - py0 == tile_size) {
+        memset(cells, 0, tile_size * tile_size);
+        continue;
+      }
+      for (int y = py0; y < py1; ++y) {
+        memset(cells + ((y - ty) << kTileBits) + px0 - tx, 0, px1 - px0);
+      }
+    }
+  }
+}
+
+void GridMap::recenter(double x, double y) {
+  int xi, yi;
+  getSubscript(x, y, &xi, &yi);
+  int win_x = xi - width_ / 2, win_y = yi - height_ / 2;
+  int dx = win_x - win_x_, dy = win_y - win_y_;
+  if (dx == 0 && dy == 0) {
+    return;
+  }
+  ++revision_;
+  win_x_ = win_x;
+  win_y_ = win_y;
+  if (abs(dx) >= width_ || abs(dy) >= height_) {
+    memset(grid_, 0, width_ * height_);
+    tile_revision_.assign(tile_revision_.size(), revision_);
+    return;
+  }
+  // Cleared cells are 0 whatever decay their tile has pending, so tiles
+  // don't need settling.  Columns that entered, then rows that entered.
+  if (dx > 0) {
+    clear(win_x_ + width_ - dx, win_y_, dx, height_);
+  } else if (dx < 0) {
+    clear(win_x_, win_y_, -dx, height_);
+  }
+  if (dy > 0) {
+    clear(win_x_, win_y_ + height_ - dy, width_, dy);
+  } else if (dy < 0) {
+    clear(win_x_, win_y_, width_, -dy);
+  }
+}
+
+bool GridMap::rosDirty(int tile) const {
+  return ros_tile_revision_[tile] != tile_revision_[tile] ||
+    (!ros_tile_empty_[tile] && pending(tile) != ros_tile_pending_[tile]);
+}
+
+void GridMap::convertRow(int ty, const int8_t *table) const {
+  const int size = 1 << kTileBits;
+  vector<int> tiles;
+  for (int tile = ty * tiles_x_; tile < (ty + 1) * tiles_x_; ++tile) {
+    if (rosDirty(tile)) {
+      tiles.push_back(tile);
+    }
+  }
+  if (tiles.empty()) {
+    return;
+  }
+
+  // Buffer cell (x, y) is cell (x - win_x_, y - win_y_) of ros_grid_,
+  // wrapped.  Rows are converted whole, so ros_grid_ is written in order,
+  // then copied out a tile at a time, split where the columns wrap.
+  vector<uint8_t> any(tiles.size(), 0);
+  vector<int8_t> converted(width_);
+  int shift = wrap(-win_x_, width_);
+  for (int y = ty << kTileBits; y < (ty + 1) << kTileBits; ++y) {
+    int offset = (y - (ty << kTileBits)) << kTileBits;
+    int8_t *data = &ros_grid_->data[wrap(y - win_y_, height_) * width_];
+    for (size_t k = 0; k < tiles.size(); ++k) {
+      int x0 = (tiles[k] % tiles_x_) << kTileBits;
+      uint8_t row[size];
+      subtractRow(row, tileData(tiles[k]) + offset, size, pending(tiles[k]));
+      uint8_t a = 0;
+      for (int x = 0; x < size; ++x) {
+        a |= row[x];
+      }
+      any[k] |= a;
+      int8_t *out = &converted[x0];
+      for (int x = 0; x < size; ++x) {
+        out[x] = table[row[x]];
+      }
+    }
+    for (size_t k = 0; k < tiles.size(); ++k) {
+      int x0 = (tiles[k] % tiles_x_) << kTileBits;
+      int col = (x0 + shift) % width_, split = min(size, width_ - col);
+      memcpy(data + col, &converted[x0], split);
+      memcpy(data, &converted[x0 + split], size - split);
+    }
+  }
+  for (size_t k = 0; k < tiles.size(); ++k) {
+    ros_tile_revision_[tiles[k]] = tile_revision_[tiles[k]];
+    ros_tile_pending_[tiles[k]] = pending(tiles[k]);
+    ros_tile_empty_[tiles[k]] = any[k] == 0;
+  }
+}
+
+void GridMap::shiftRos(int dx, int dy) const {
+  // Cells that entered the window were cleared, so their tiles are converted
+  // again anyway
+  if (abs(dx) >= width_ || abs(dy) >= height_) {
+    return;
+  }
+  int8_t *data = &ros_grid_->data[0];
+  int x0 = max(-dx, 0), num_x = width_ - abs(dx);
+  // Rows are moved in the order that doesn't overwrite rows still to be read
+  for (int i = 0; i < height_; ++i) {
+    int y = dy > 0 ? i : height_ - 1 - i;
+    if (0 <= y + dy && y + dy < height_) {
+      memmove(data + y * width_ + x0, data + (y + dy) * width_ + x0 + dx,
+              num_x);
+    }
+  }
+}
+
+const nav_msgs::OccupancyGrid& GridMap::occGrid() const {
+  if (ros_revision_ != revision_) {
+    // Offset the origin to the corner of the window
+    tf::Pose origin, offset;
+    tf::poseMsgToTF(origin_, origin);
+    offset.setIdentity();
+    offset.setOrigin(tf::Vector3(win_x_ * meters_per_pixel_,
+                                 win_y_ * meters_per_pixel_, 0.0));
+    tf::poseTFToMsg(origin * offset, ros_grid_->info.origin);
+
+    if (ros_win_x_ != win_x_ || ros_win_y_ != win_y_) {
+      shiftRos(win_x_ - ros_win_x_, win_y_ - ros_win_y_);
+      ros_win_x_ = win_x_;
+      ros_win_y_ = win_y_;
+    }
+
+    // 100 - p / 2.55 for each grid value p
+    int8_t table[256];
+    for (int v = 0; v < 256; ++v) {
+      table[v] = 100 - static_cast<int>(v / 2.55);
+    }
+    for (int ty = 0; ty < height_ >> kTileBits; ++ty) {
+      convertRow(ty, table);
+    }
+    ros_revision_ = revision_;
+  }
+  return *ros_grid_;
+}
+
+void GridMap::copy(int xi, int yi, int num_x, int num_y, uint8_t *out,
+                   int stride) const {
+  int x0 = max(xi, win_x_), x1 = min(xi + num_x, win_x_ + width_);
+  int y0 = max(yi, win_y_), y1 = min(yi + num_y, win_y_ + height_);
+  for (int dyi = 0; dyi < num_y; ++dyi) {
+    uint8_t *row = out + dyi * stride;
+    int y = yi + dyi;
+    if (y < y0 || y >= y1 || x0 >= x1) {
+      memset(row, 0, num_x);
+    } else {
+      memset(row, 0, x0 - xi);
+      memset(row + x1 - xi, 0, xi + num_x - x1);
+    }
+  }
+  // The tile loops below start at the tile edge before x0 and y0, which can
+  // be before x1 and y1 even if the block misses the window
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  // A tile at a time, subtracting its pending decay; tiles never straddle
+  // the wrap, so each piece is contiguous
+  const int tile_size = 1 << kTileBits, mask = tile_size - 1;
+  for (int ty = y0 & ~mask; ty < y1; ty += tile_size) {
+    int py0 = max(y0, ty), py1 = min(y1, ty + tile_size);
+    for (int tx = x0 & ~mask; tx < x1; tx += tile_size) {
+      int px0 = max(x0, tx), px1 = min(x1, tx + tile_size);
+      int tile = this->tile(tx, ty), pending = this->pending(tile);
+      const uint8_t *src = tileData(tile) + ((py0 - ty) << kTileBits) +
+        px0 - tx;
+      uint8_t *dst = out + (py0 - yi) * stride + px0 - xi;
+      for (int y = py0; y < py1; ++y) {
+        subtractRow(dst, src, px1 - px0, pending);
+        src += tile_size;
+        dst += stride;
+      }
+    }
+  }
+}
+
+namespace {
+
+// Grid coordinates of points at each rotation
+struct SubscriptTask {
+  SubscriptTask(const GridMap &map, const Pose2d &pose,
+                const RowMatrix2d &points, double delta_t, double inc_t,
+                int num_t)
+    : map(map), pose(pose), points(points), delta_t(delta_t), inc_t(inc_t),
+      xis(num_t), yis(num_t) {}
+
+  void operator()(int t, int worker) {
+    map.subscripts(pose, points, delta_t + t * inc_t, &xis[t], &yis[t]);
+  }
+
+  const GridMap &map;
+  const Pose2d &pose;
+  const RowMatrix2d &points;
+  double delta_t, inc_t;
+  vector<vector<int> > xis, yis;
+};
+
+// Scores of each rotation, with a buffer of kernel offsets for each thread
+struct ScoreTask {
+  ScoreTask(const vector<uint8_t> &grid, int stride,
+            const vector<vector<int> > &xis, const vector<vector<int> > &yis,
+            int min_xi, int min_yi, int num_x, int num_y, int threads,
+            vector<ArrayXXi> *scores)
+    : grid(grid), stride(stride), xis(xis), yis(yis), min_xi(min_xi),
+      min_yi(min_yi), num_x(num_x), num_y(num_y), corners(threads),
+      scores(scores) {}
+
+  void operator()(int t, int worker) {
+    int num_points = xis[t].size();
+    vector<int> &c = corners[worker];
+    c.resize(num_points);
+    for (int i = 0; i < num_points; ++i) {
+      c[i] = (yis[t][i] - min_yi) * stride + xis[t][i] - min_xi;
+    }
+    ArrayXXi &s = scores->at(t);
+    s.setZero(num_x, num_y);
+    addScores(&grid[0], stride, &c[0], num_points, num_x, num_y, s.data());
+  }
+
+  const vector<uint8_t> &grid;
+  int stride;
+  const vector<vector<int> > &xis, &yis;
+  int min_xi, min_yi, num_x, num_y;
+  vector<vector<int> > corners;
+  vector<ArrayXXi> *scores;
+};
+
+}
+
+void GridMap::subscripts(const Pose2d &pose, const RowMatrix2d &points,
+                         double theta, vector<int> *xis,
+                         vector<int> *yis) const {
+  xis->resize(points.cols());
+  yis->resize(points.cols());
+  double ct = cos(theta + pose.t()), st = sin(theta + pose.t());
+  for (int i = 0; i < points.cols(); ++i) {
+    // Rotate point, convert it to pixel coordinates and *then* translate it.
+    // If you translate in world coordinates rounding can do weird things.
+    const Eigen::Vector2d &point = points.col(i);
+    double x = ct * point(0) - st * point(1) + pose.x();
+    double y = st * point(0) + ct * point(1) + pose.y();
+    getSubscript(x, y, &xis->at(i), &yis->at(i));
+  }
 }
 
 void GridMap::scores3D(const Pose2d &pose,
@@ -35,48 +358,109 @@ void GridMap::scores3D(const Pose2d &pose,
                        int delta_xi, int num_x,
                        int delta_yi, int num_y,
                        double delta_t, int num_t, double inc_t,
-                       vector<ArrayXXi> *scores) const {
-  // Iterate over theta and get scores for each point
+                       vector<ArrayXXi> *scores, ThreadPool *pool) const {
   scores->resize(num_t);
+  if (points.cols() == 0) {
+    for (int t = 0; t < num_t; ++t) {
+      scores->at(t).setZero(num_x, num_y);
+    }
+    return;
+  }
+
+  ThreadPool serial(1);
+  if (pool == NULL) {
+    pool = &serial;
+  }
+
+  // Get grid coordinates of points for each theta, shifted by initial offset
+  SubscriptTask subscript(*this, pose, points, delta_t, inc_t, num_t);
+  pool->run(num_t, boost::ref(subscript));
+  vector<vector<int> > &xis = subscript.xis, &yis = subscript.yis;
+  int min_xi = numeric_limits<int>::max(), min_yi = min_xi;
+  int max_xi = numeric_limits<int>::min(), max_yi = max_xi;
   for (int t = 0; t < num_t; ++t) {
-    double theta = delta_t + t * inc_t;
-    scores2D(pose, points, delta_xi, num_x, delta_yi, num_y, theta,
-             &scores->at(t));
+    for (int i = 0; i < points.cols(); ++i) {
+      xis[t][i] += delta_xi;
+      yis[t][i] += delta_yi;
+      min_xi = min(min_xi, xis[t][i]);
+      min_yi = min(min_yi, yis[t][i]);
+      max_xi = max(max_xi, xis[t][i]);
+      max_yi = max(max_yi, yis[t][i]);
+    }
   }
+
+  // Copy every cell that any translation can reach, with zeros outside the
+  // map and padding for the kernel, so it needs no bounds checks
+  int num_copy_x = max_xi - min_xi + num_x, num_copy_y = max_yi - min_yi + num_y;
+  int stride = num_copy_x + kScorePadding;
+  vector<uint8_t> local(stride * num_copy_y, 0);
+  copy(min_xi, min_yi, num_copy_x, num_copy_y, &local[0], stride);
+
+  // Get scores for each theta
+  ScoreTask score(local, stride, xis, yis, min_xi, min_yi, num_x, num_y,
+                  pool->threads(), scores);
+  pool->run(num_t, boost::ref(score));
 }
 
 void GridMap::scores2D(const Pose2d &pose,
                        const RowMatrix2d &points,
                        int delta_xi, int num_x,
                        int delta_yi, int num_y,
-                       double theta, ArrayXXi *scores_ptr) const {
-  ArrayXXi &scores = *scores_ptr;
-  scores.resize(num_x, num_y);
-  scores.setZero();
+                       double theta, ArrayXXi *scores) const {
+  vector<ArrayXXi> all;
+  scores3D(pose, points, delta_xi, num_x, delta_yi, num_y, theta, 1, 0.0,
+           &all);
+  scores->swap(all[0]);
+}
 
-  double ct = cos(theta + pose.t()), st = sin(theta + pose.t());
-  for (int i = 0; i < points.cols(); ++i) {
-    // Rotate point, convert it to pixel coordinates and *then* translate it.
-    // If you translate in world coordinates rounding can do weird things.
-    const Eigen::Vector2d &point = points.col(i);
-    double x = ct * point(0) - st * point(1) + pose.x();
-    double y = st * point(0) + ct * point(1) + pose.y();
+GridPyramid::GridPyramid()
+  : min_xi_(0), min_yi_(0), max_xi_(-1), max_yi_(-1), stride_(0), map_(NULL),
+    revision_(0) {
+}
+
+void GridPyramid::build(const GridMap &map, int min_xi, int min_yi,
+                        int max_xi, int max_yi, int levels) {
+  if (&map == map_ && map.revision() == revision_ && levels <= this->levels() &&
+      min_xi_ <= min_xi && min_yi_ <= min_yi &&
+      max_xi <= max_xi_ && max_yi <= max_yi_) {
+    return;
+  }
+  // Pool a little more than asked for, so the box still covers the next few
+  // scans if the map doesn't change
+  const int margin = 16;
+  map_ = &map;
+  revision_ = map.revision();
+  min_xi_ = min_xi - margin;
+  min_yi_ = min_yi - margin;
+  max_xi_ = max_xi + margin;
+  max_yi_ = max_yi + margin;
 
-    int xi0, yi0;
-    // Get grid coordinates of point
-    getSubscript(x, y, &xi0, &yi0);
-
-    // Shift by initial offset
-    xi0 += delta_xi;
-    yi0 += delta_yi;
-
-    // Iterate over translation of point and update scores
-    for (int dyi = 0; dyi < num_y; ++dyi) {
-      int yi = yi0 + dyi;
-      for (int dxi = 0; dxi < num_x; ++dxi) {
-        int xi = xi0 + dxi;
-        int ll = static_cast<int>(get(xi, yi));
-        scores(dxi, dyi) += ll;
+  // Levels are padded with zeros so that pooling never reads past the end;
+  // that only drops cells outside the box
+  int num_x = max_xi_ - min_xi_ + 1, num_y = max_yi_ - min_yi_ + 1;
+  int pad = 1 << (levels - 1);
+  stride_ = num_x + pad;
+  int rows = num_y + pad;
+  levels_.resize(levels);
+  levels_[0].assign(stride_ * rows, 0);
+  map.copy(min_xi_, min_yi_, num_x, num_y, &levels_[0][0], stride_);
+
+  // Each level pools 2x2 blocks of cells of the one below, half its width
+  // apart
+  for (int l = 1; l < levels; ++l) {
+    int half = 1 << (l - 1);
+    const vector<uint8_t> &below = levels_[l - 1];
+    vector<uint8_t> &above = levels_[l];
+    above = below;
+    // Locals, since stores through uint8_t* could alias members and keep the
+    // loop from vectorizing
+    int stride = stride_, num = stride_ - half;
+    for (int y = 0; y + half < rows; ++y) {
+      const uint8_t *b0 = &below[y * stride], *b1 = b0 + half * stride;
+      uint8_t *a = &above[y * stride];
+      for (int x = 0; x < num; ++x) {
+        uint8_t m0 = max(b0[x], b0[x + half]), m1 = max(b1[x], b1[x + half]);
+        a[x] = max(m0, m1);
       }
     }
   }
@@ -121,33 +505,162 @@ void mrsl::transformPoints(const Pose2d& pose, const RowMatrix2d &local,
   }
 }
 
-ScanMatcher::ScanMatcher(const Params &p)
+ScanProjector::ScanProjector()
+  : num_beams_(0), angle_min_(0.0), angle_increment_(0.0), scan_(0) {
+}
+
+void ScanProjector::project(const sensor_msgs::LaserScan &scan,
+                            double leaf_size, RowMatrix2d *points,
+                            RowMatrix2d *all) {
+  size_t num_beams = scan.ranges.size();
+  if (num_beams != num_beams_ || scan.angle_min != angle_min_ ||
+      scan.angle_increment != angle_increment_) {
+    num_beams_ = num_beams;
+    angle_min_ = scan.angle_min;
+    angle_increment_ = scan.angle_increment;
+    cos_.resize(num_beams);
+    sin_.resize(num_beams);
+    for (size_t i = 0; i < num_beams; ++i) {
+      double theta = angle_min_ + double(i) * angle_increment_;
+      cos_[i] = cos(theta);
+      sin_[i] = sin(theta);
+    }
+    size_t num_cells = 16;
+    while (num_cells < 2 * num_beams) {
+      num_cells *= 2;
+    }
+    Cell empty = {0, 0, 0, 0};
+    cells_.assign(num_cells, empty);
+    scan_ = 0;
+    sums_.resize(2, num_beams);
+    counts_.resize(num_beams);
+    beams_.resize(2, num_beams);
+  }
+  // Cells are emptied by starting a new scan number, rather than clearing
+  // the table
+  if (++scan_ == 0) {
+    for (size_t c = 0; c < cells_.size(); ++c) {
+      cells_[c].scan = 0;
+    }
+    scan_ = 1;
+  }
+
+  const unsigned mask = cells_.size() - 1;
+  const double inv_leaf = 1.0 / leaf_size;
+  int num_points = 0, num_all = 0;
+  for (size_t i = 0; i < num_beams; ++i) {
+    double range = scan.ranges[i];
+    if (!(scan.range_min <= range && range <= scan.range_max)) {
+      continue;
+    }
+    double x = range * cos_[i], y = range * sin_[i];
+    beams_(0, num_all) = x;
+    beams_(1, num_all) = y;
+    ++num_all;
+    if (range == scan.range_max) {
+      continue;
+    }
+    int xi = floor(x * inv_leaf), yi = floor(y * inv_leaf);
+    unsigned h = (unsigned(xi) * 73856093u ^ unsigned(yi) * 19349663u) & mask;
+    while (cells_[h].scan == scan_ &&
+           (cells_[h].xi != xi || cells_[h].yi != yi)) {
+      h = (h + 1) & mask;
+    }
+    Cell &cell = cells_[h];
+    if (cell.scan != scan_) {
+      cell.xi = xi;
+      cell.yi = yi;
+      cell.col = num_points++;
+      cell.scan = scan_;
+      sums_.col(cell.col).setZero();
+      counts_[cell.col] = 0;
+    }
+    sums_(0, cell.col) += x;
+    sums_(1, cell.col) += y;
+    ++counts_[cell.col];
+  }
+
+  points->resize(2, num_points);
+  for (int k = 0; k < num_points; ++k) {
+    points->col(k) = sums_.col(k) / counts_[k];
+  }
+  if (all != NULL) {
+    *all = beams_.leftCols(num_all);
+  }
+}
+
+ScanMatcher::ScanMatcher(const Params &p, bool connect)
   : p_(p), map_(NULL), have_scan_(false) {
   p_.align();
-  map_.reset(new GridMap(-40, 80.0, -40, 80.0, p_.grid_res));
+  map_.reset(new GridMap(-p_.map_size / 2, p_.map_size,
+                         -p_.map_size / 2, p_.map_size, p_.grid_res));
   map_->fill(0);
-  pub_scan_ = nh_.advertise<sensor_msgs::PointCloud2>("laser_cloud", 1, false);
+  int threads = p_.threads > 0 ? p_.threads : boost::thread::hardware_concurrency();
+  pool_.reset(new ThreadPool(threads));
+  makeStamp();
+  window_ = fullWindow();
+  level_time_.assign(p_.anytime_levels, 0.0);
+  if (connect) {
+    pub_scan_ = nh_.advertise<sensor_msgs::PointCloud2>("laser_cloud", 1, false);
+  }
 }
 
 ScanMatcher::~ScanMatcher() {
 }
 
 bool ScanMatcher::addScan(const Pose2d &odom,
-                          const sensor_msgs::LaserScan &scan) {
+                          const sensor_msgs::LaserScan &scan, bool odom_valid) {
+  Scan s;
+  preprocess(scan, &s);
+  s.odom = odom;
+  s.odom_valid = odom_valid;
+  matchScan(&s);
+  bool changed = update(&s);
+  timing_ = s.timing;
+  match_info_ = s.match;
+  return changed;
+}
+
+void ScanMatcher::preprocess(const sensor_msgs::LaserScan &scan, Scan *out) {
+  // Project laser scan points into local frame, merging nearby points for
+  // matching and keeping all of them for the map
+  ros::WallTime start = ros::WallTime::now();
+  out->stamp = scan.header.stamp;
+  // out may be reused from an earlier scan
+  out->timing = Timing();
+  const double resolution = 0.01;
+  projector_.project(scan, resolution, &out->match_points, &out->map_points);
+
+  if (pub_scan_.getNumSubscribers() > 0) {
+    sensor_msgs::PointCloud2 cloud;
+    laser_geometry::LaserProjection projector;
+    projector.projectLaser(scan, cloud, -1.0,
+                           laser_geometry::channel_option::None);
+    pub_scan_.publish(cloud);
+  }
+  out->timing.preprocess = (ros::WallTime::now() - start).toSec();
+}
+
+void ScanMatcher::matchScan(Scan *scan) {
+  ros::WallTime start = ros::WallTime::now();
   // Add odometry
-  pose_ = pose_.oplus(odom);
+  pose_ = pose_.oplus(scan->odom);
   // ROS_INFO_STREAM("Pose: " << pose_);
 
   // Correct pose
+  scan->match = MatchInfo();
   if (have_scan_) {
-    // ros::Time start = ros::Time::now();
-    Gaussian3d update_est = matchScan(pose_, scan);
-    // ROS_INFO("  Match time: %.3f", (ros::Time::now() - start).toSec());
-    Eigen::Vector3d update = update_est.mean();
+    window_ = scan->odom_valid ? odomWindow(scan->odom) : fullWindow();
+    Eigen::Vector3d update = matchAnytime(scan->match_points, start,
+                                          &scan->match);
     // ROS_INFO_STREAM("Update: " << update.transpose());
+    if (atEdge(update) && window_ != fullWindow()) {
+      // Odometry was further off than expected
+      window_ = fullWindow();
+      update = matchAnytime(scan->match_points, start, &scan->match);
+    }
 
-    if (fabs(update(0)) == p_.range_x || fabs(update(1)) == p_.range_y ||
-        fabs(update(2)) == p_.range_t) {
+    if (atEdge(update)) {
       ROS_WARN("Update (%.5f, %.5f, %.5f) is at max of search window;\n"
                "drive slower or make window bigger!",
                update(0), update(1), update(2));
@@ -156,43 +669,59 @@ bool ScanMatcher::addScan(const Pose2d &odom,
     pose_.setX(pose_.x() +  update(0));
     pose_.setY(pose_.y() +  update(1));
     pose_.setT(pose_.t() +  update(2));
-  } else {
-    last_decay_ = scan.header.stamp;
+  }
+  scan->pose = pose_;
+  scan->timing.match = (ros::WallTime::now() - start).toSec();
+}
+
+bool ScanMatcher::update(Scan *scan) {
+  ros::WallTime start = ros::WallTime::now();
+  boost::mutex::scoped_lock lock(map_mutex_);
+  // Keep the map around the robot
+  map_->recenter(scan->pose.x(), scan->pose.y());
+  if (!have_scan_) {
+    last_decay_ = scan->stamp;
   }
 
   bool changed = false;
-  if (scan.header.stamp - last_decay_ > ros::Duration(p_.decay_duration)) {
+  if (scan->stamp - last_decay_ > ros::Duration(p_.decay_duration)) {
     map_->decay(p_.decay_step);
-    last_decay_ = scan.header.stamp;
+    last_decay_ = scan->stamp;
     changed = true;
   }
 
   // If map has no scans, robot has moved, or nothing has been incorporated in
   // a while, update the map
-  Pose2d traveled = pose_.ominus(last_scan_pose_);
+  Pose2d traveled = scan->pose.ominus(last_scan_pose_);
   bool moved_linear = hypot(traveled.x(), traveled.y()) > p_.travel_distance;
   bool moved_angular = traveled.t() > p_.travel_angle;
-  bool add = scan.header.stamp - last_add_ > ros::Duration(0.2);
+  bool add = scan->stamp - last_add_ > ros::Duration(0.2);
   if (!have_scan_ || moved_linear || moved_angular || add) {
     RowMatrix2d points;
-    projectScan(pose_, scan, 1, &points);
-
-    // ros::Time start = ros::Time::now();
+    transformPoints(scan->pose, scan->map_points, &points);
     updateMap(points);
-    // ROS_INFO("  Update time: %.3f", (ros::Time::now() - start).toSec());
-    last_scan_pose_ = pose_;
+    last_scan_pose_ = scan->pose;
     have_scan_ = true;
-    last_add_ = scan.header.stamp;
-    return true;
-  } else {
-    return changed;
+    last_add_ = scan->stamp;
+    changed = true;
   }
+  scan->timing.update = (ros::WallTime::now() - start).toSec();
+  return changed;
 }
 
 // update map; points are in map frame
 void ScanMatcher::updateMap(const RowMatrix2d &points) {
-  // TODO: Lookup table
-  // Update likelihood of neighboring points in 3 sigma radius around point
+  int offset = stamp_size_ / 2;
+  for (int i = 0; i < points.cols(); ++i) {
+    int xi, yi;
+    map_->getSubscript(points(0, i), points(1, i), &xi, &yi);
+    map_->stampMax(xi - offset, yi - offset, &stamp_[16], stamp_size_,
+                   stamp_stride_);
+  }
+}
+
+void ScanMatcher::makeStamp() {
+  // Likelihood of neighboring points in 3 sigma radius around point
   const int max_offset = ceil(p_.sensor_sd / p_.grid_res) * 3;
   // Don't normalize by standard deviation; all values are scaled equally and
   // this results in a better spread
@@ -200,64 +729,127 @@ void ScanMatcher::updateMap(const RowMatrix2d &points) {
   const double exp_factor = (p_.grid_res * p_.grid_res) /
     (2 * p_.sensor_sd * p_.sensor_sd);
 
-  for (int i = 0; i < points.cols(); ++i) {
-    int xi, yi;
-    map_->getSubscript(points(0, i), points(1, i), &xi, &yi);
-    for (int delta_y = -max_offset; delta_y <= max_offset; ++delta_y) {
-      for (int delta_x = -max_offset; delta_x <= max_offset; ++delta_x) {
-        int dist = delta_x * delta_x + delta_y * delta_y;
-        double prob = normalizer * exp(-dist * exp_factor);
-        uint8_t val = static_cast<uint8_t>(prob * 255.0);
-        map_->setMax(xi + delta_x, yi + delta_y, val);
-      }
+  // Each row is preceded by 16 zeros, and padded to a multiple of 16, with
+  // 16 more zeros after the last one
+  stamp_size_ = 2 * max_offset + 1;
+  stamp_stride_ = 16 + (stamp_size_ + 15) / 16 * 16;
+  stamp_.assign(stamp_stride_ * stamp_size_ + 16, 0);
+  uint8_t *stamp = &stamp_[16];
+  for (int delta_y = -max_offset; delta_y <= max_offset; ++delta_y) {
+    for (int delta_x = -max_offset; delta_x <= max_offset; ++delta_x) {
+      int dist = delta_x * delta_x + delta_y * delta_y;
+      double prob = normalizer * exp(-dist * exp_factor);
+      stamp[(delta_y + max_offset) * stamp_stride_ + delta_x + max_offset] =
+        static_cast<uint8_t>(prob * 255.0);
     }
   }
 }
 
-Gaussian3d ScanMatcher::matchScan(const Pose2d &pose,
-                                  const sensor_msgs::LaserScan &scan) {
-  RowMatrix2d points;
-  // Project laser scan points into local frame
-  Pose2d identity(0.0, 0.0, 0.0);
-  projectScan(identity, scan, p_.subsample, &points);
-
-  // Filter nearby points
-  double resolution = 0.01;
-  sensor_msgs::PointCloud2 ros_input;
-  laser_geometry::LaserProjection projector;
-  projector.projectLaser(scan, ros_input);
-  pcl::PCLPointCloud2 pcl_pc;
-  pcl_conversions::toPCL(ros_input, pcl_pc);
-  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>);
-  pcl::fromPCLPointCloud2(pcl_pc, *cloud);
-  pcl::VoxelGrid<pcl::PointXYZ> sor;
-  sor.setInputCloud(cloud);
-  sor.setLeafSize(resolution, resolution, 1.0);
-  pcl::PointCloud<pcl::PointXYZ> pcl_filtered;
-  sor.filter(pcl_filtered);
-  pub_scan_.publish(cloud);
+Vector3i ScanMatcher::fullWindow() const {
+  return Vector3i(int(round(p_.range_x / p_.grid_res)),
+                  int(round(p_.range_y / p_.grid_res)),
+                  int(round(p_.range_t / p_.inc_t)));
+}
 
-  RowMatrix2d points_filt;
-  points_filt.resize(2, pcl_filtered.points.size());
-  for (int i = 0; i < points_filt.cols(); ++i) {
-    points_filt(0, i) = pcl_filtered.points.at(i).x;
-    points_filt(1, i) = pcl_filtered.points.at(i).y;
-  }
+Vector3i ScanMatcher::odomWindow(const Pose2d &odom) const {
+  double range_xy = p_.min_range_xy + p_.odom_noise_xy * hypot(odom.x(), odom.y());
+  double range_t = p_.min_range_t +
+    p_.odom_noise_t * fabs(angles::normalize_angle(odom.t()));
+  Vector3i full = fullWindow();
+  int sxy = max(1, int(round(range_xy / p_.grid_res)));
+  int st = max(1, int(round(range_t / p_.inc_t)));
+  return Vector3i(min(sxy, full(0)), min(sxy, full(1)), min(st, full(2)));
+}
 
-  return match(points_filt);
+bool ScanMatcher::atEdge(const Vector3d &update) const {
+  return fabs(update(0)) > (window_(0) - 0.5) * p_.grid_res ||
+    fabs(update(1)) > (window_(1) - 0.5) * p_.grid_res ||
+    fabs(update(2)) > (window_(2) - 0.5) * p_.inc_t;
 }
 
 Gaussian3d ScanMatcher::match(const RowMatrix2d &points) {
-  int sx = round(p_.range_x / p_.grid_res);
-  int sy = round(p_.range_y / p_.grid_res);
+  int score;
+  return Gaussian3d(search(points, &score), Matrix3d::Identity());
+}
+
+Vector3d ScanMatcher::search(const RowMatrix2d &points, int *score) {
+  int sx = window_(0), sy = window_(1), st = window_(2);
+
+  Vector3i inds = p_.branch_and_bound ?
+    searchBranchAndBound(points, sx, sy, st, score) :
+    searchExhaustive(points, sx, sy, st, score);
+
+  return Vector3d((inds(0) - sx) * p_.grid_res,
+                  (inds(1) - sy) * p_.grid_res,
+                  (inds(2) - st) * p_.inc_t);
+}
+
+Vector3d ScanMatcher::matchAnytime(const RowMatrix2d &points,
+                                   const ros::WallTime &start,
+                                   MatchInfo *info) {
+  // Steps searched either side of the last level's result by finer levels
+  const int kRefineSteps = 2;
+  const int levels = p_.time_budget > 0.0 ? p_.anytime_levels : 1;
+  const Pose2d prior = pose_;
+  const Vector3i window = window_;
+  Vector3d update = Vector3d::Zero();
+  RowMatrix2d subset;
+  *info = MatchInfo();
+  for (int level = levels - 1; level >= 0; --level) {
+    ros::WallTime level_start = ros::WallTime::now();
+    if (level < levels - 1) {
+      if ((level_start - start).toSec() + level_time_[level] > p_.time_budget) {
+        // Keep the coarser estimate.  Let the estimate drift down, so a
+        // level that was once slow gets tried again.
+        level_time_[level] *= 0.95;
+        break;
+      }
+      pose_ = prior;
+      pose_.setX(prior.x() + update(0));
+      pose_.setY(prior.y() + update(1));
+      pose_.setT(prior.t() + update(2));
+      window_ = window.cwiseMin(Vector3i::Constant(kRefineSteps));
+    }
+
+    int stride = 1 << level;
+    const RowMatrix2d *used = &points;
+    if (stride > 1) {
+      subset.resize(2, (points.cols() + stride - 1) / stride);
+      for (int i = 0; i < subset.cols(); ++i) {
+        subset.col(i) = points.col(i * stride);
+      }
+      used = &subset;
+    }
+    int score;
+    update += search(*used, &score);
+
+    double elapsed = (ros::WallTime::now() - level_start).toSec();
+    level_time_[level] = level_time_[level] > 0.0 ?
+      0.8 * level_time_[level] + 0.2 * elapsed : elapsed;
+    info->quality = used->cols() > 0 ? score / (255.0 * used->cols()) : 0.0;
+    info->stride = stride;
+    info->points = used->cols();
+    ++info->levels;
+  }
+  pose_ = prior;
+  window_ = window;
+  return update;
+}
+
+Vector3i ScanMatcher::searchExhaustive(const RowMatrix2d &points, int sx,
+                                       int sy, int st, int *score) {
   int num_x = 2 * sx + 1;
   int num_y = 2 * sy + 1;
-  int num_t = 2 * round(p_.range_t / p_.inc_t) + 1;
+  int num_t = 2 * st + 1;
 
+  // Scores are read straight from the map, so it stays locked throughout
   vector<ArrayXXi> scores;
-  map_->scores3D(pose_,
-                 points, -sx, num_x, -sy, num_y,
-                 -p_.range_t, num_t, p_.inc_t, &scores);
+  {
+    boost::mutex::scoped_lock lock(map_mutex_);
+    map_->scores3D(pose_,
+                   points, -sx, num_x, -sy, num_y,
+                   -st * p_.inc_t, num_t, p_.inc_t, &scores, pool_.get());
+  }
 
   // Process scores to get best guess
   Vector3i inds = Vector3i::Zero();
@@ -266,19 +858,181 @@ Gaussian3d ScanMatcher::match(const RowMatrix2d &points) {
     ArrayXXi &dxdy_scores = scores.at(ti);
     for (int xi = 0; xi < dxdy_scores.rows(); ++xi) {
       for (int yi = 0; yi < dxdy_scores.cols(); ++yi) {
-        int score = dxdy_scores(xi, yi);
-        if (score > max_likeli) {
+        int likeli = dxdy_scores(xi, yi);
+        if (likeli > max_likeli) {
           inds(0) = xi;
           inds(1) = yi;
           inds(2) = ti;
-          max_likeli = score;
+          max_likeli = likeli;
+        }
+      }
+    }
+  }
+  *score = max_likeli;
+  return inds;
+}
+
+namespace {
+
+// Block of 2^level x 2^level translations at one rotation, starting at
+// (xi, yi) in the window.  score bounds the scores of all of them.
+struct Candidate {
+  Candidate(int ti, int xi, int yi, int level)
+    : ti(ti), xi(xi), yi(yi), level(level), score(0) {}
+  int ti, xi, yi, level, score;
+};
+
+// Higher scores first.  Ties go to the first index in scores3D() order, which
+// is the pose that the exhaustive search picks.
+bool better(const Candidate &a, const Candidate &b) {
+  if (a.score != b.score) {
+    return a.score > b.score;
+  } else if (a.ti != b.ti) {
+    return a.ti < b.ti;
+  } else if (a.xi != b.xi) {
+    return a.xi < b.xi;
+  }
+  return a.yi < b.yi;
+}
+
+struct BranchAndBound {
+  int score(const Candidate &c) const {
+    const uint8_t *level = pyramid->level(c.level) +
+      c.yi * pyramid->stride() + c.xi;
+    const vector<int> &cells = offsets[c.ti];
+    int sum = 0;
+    for (size_t i = 0; i < cells.size(); ++i) {
+      sum += level[cells[i]];
+    }
+    return sum;
+  }
+
+  // Candidates must be sorted with better()
+  void search(const vector<Candidate> &candidates, Candidate *best) {
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      const Candidate &c = candidates[i];
+      if (!better(c, *best) || c.score < floor.load(boost::memory_order_relaxed)) {
+        // Nothing in this block can beat the best pose so far
+        continue;
+      } else if (c.level == 0) {
+        *best = c;
+        raiseFloor(c.score);
+        continue;
+      }
+
+      vector<Candidate> children;
+      int half = 1 << (c.level - 1);
+      for (int dx = 0; dx <= half; dx += half) {
+        for (int dy = 0; dy <= half; dy += half) {
+          if (c.xi + dx < num_x && c.yi + dy < num_y) {
+            children.push_back(Candidate(c.ti, c.xi + dx, c.yi + dy,
+                                         c.level - 1));
+            children.back().score = score(children.back());
+          }
         }
       }
+      sort(children.begin(), children.end(), better);
+      search(children, best);
     }
   }
 
-  Vector3d transform(-p_.range_x + inds(0) * p_.grid_res,
-                     -p_.range_y + inds(1) * p_.grid_res,
-                     -p_.range_t + inds(2) * p_.inc_t);
-  return Gaussian3d(transform, Matrix3d::Identity());
+  void raiseFloor(int score) {
+    int current = floor.load(boost::memory_order_relaxed);
+    while (current < score &&
+           !floor.compare_exchange_weak(current, score,
+                                        boost::memory_order_relaxed)) {
+    }
+  }
+
+  // Rotations are searched in parallel, each for its own best pose.  They
+  // share the best score found by any of them, and drop blocks scoring less;
+  // as ties are kept, the best of the rotations' best poses is the same as
+  // with a single search over all of them.
+  void operator()(int k, int worker) {
+    const Candidate &top = tops[k];
+    Candidate &best = bests[top.ti];
+    best = Candidate(top.ti, 0, 0, 0);
+    best.score = numeric_limits<int>::min();
+    search(vector<Candidate>(1, top), &best);
+  }
+
+  const GridPyramid *pyramid;
+  // Pyramid indices of the points at each rotation, shifted to the corner of
+  // the window
+  vector<vector<int> > offsets;
+  int num_x, num_y;
+  // Whole window of each rotation, at the top level, best first
+  vector<Candidate> tops;
+  vector<Candidate> bests;
+  boost::atomic<int> floor;
+};
+
+}
+
+Vector3i ScanMatcher::searchBranchAndBound(const RowMatrix2d &points, int sx,
+                                           int sy, int st, int *score) {
+  int num_x = 2 * sx + 1;
+  int num_y = 2 * sy + 1;
+  int num_t = 2 * st + 1;
+  if (points.cols() == 0) {
+    *score = 0;
+    return Vector3i::Zero();
+  }
+  int top = 0;
+  while ((1 << top) < max(num_x, num_y)) {
+    ++top;
+  }
+
+  vector<vector<int> > xis(num_t), yis(num_t);
+  int min_xi = numeric_limits<int>::max(), min_yi = min_xi;
+  int max_xi = numeric_limits<int>::min(), max_yi = max_xi;
+  for (int t = 0; t < num_t; ++t) {
+    map_->subscripts(pose_, points, (t - st) * p_.inc_t,
+                     &xis[t], &yis[t]);
+    for (int i = 0; i < points.cols(); ++i) {
+      xis[t][i] -= sx;
+      yis[t][i] -= sy;
+      min_xi = min(min_xi, xis[t][i]);
+      min_yi = min(min_yi, yis[t][i]);
+      max_xi = max(max_xi, xis[t][i]);
+      max_yi = max(max_yi, yis[t][i]);
+    }
+  }
+  // The search only reads the pyramid, so the map can be updated meanwhile
+  {
+    boost::mutex::scoped_lock lock(map_mutex_);
+    pyramid_.build(*map_, min_xi, min_yi, max_xi + num_x - 1,
+                   max_yi + num_y - 1, top + 1);
+  }
+
+  BranchAndBound bb;
+  bb.pyramid = &pyramid_;
+  bb.num_x = num_x;
+  bb.num_y = num_y;
+  bb.offsets.resize(num_t);
+  for (int t = 0; t < num_t; ++t) {
+    bb.offsets[t].resize(points.cols());
+    for (int i = 0; i < points.cols(); ++i) {
+      bb.offsets[t][i] = pyramid_.index(xis[t][i], yis[t][i]);
+    }
+  }
+
+  // Rotations that look best are started first
+  for (int t = 0; t < num_t; ++t) {
+    bb.tops.push_back(Candidate(t, 0, 0, top));
+    bb.tops.back().score = bb.score(bb.tops.back());
+  }
+  sort(bb.tops.begin(), bb.tops.end(), better);
+  bb.bests.resize(num_t, Candidate(0, 0, 0, 0));
+  bb.floor = numeric_limits<int>::min();
+  pool_->run(num_t, boost::ref(bb));
+
+  Candidate best = bb.bests[0];
+  for (int t = 1; t < num_t; ++t) {
+    if (better(bb.bests[t], best)) {
+      best = bb.bests[t];
+    }
+  }
+  *score = best.score;
+  return Vector3i(best.xi, best.yi, best.ti);
 }
@@ -8,7 +8,12 @@
 
 #include <Eigen/Dense>
 
+#include <boost/atomic.hpp>
+
+#include <cstring>
+
 #include "Pose2d.hpp"
+#include "thread_pool.hpp"
 
 namespace mrsl {
 
@@ -34,8 +39,15 @@ typedef Gaussian<3> Gaussian3d;
 
 typedef Eigen::Matrix<double, 2, Eigen::Dynamic> RowMatrix2d;
 
+// Occupancy grid that scrolls with the robot.  Cells have fixed global
+// subscripts, but only a width() x height() window of them is stored, wrapped
+// around a toroidal buffer; recenter() moves the window, clearing just the
+// cells that roll into it.  Cells outside the window read as 0.  The buffer
+// is stored a tile at a time, so nearby cells share pages and cache lines.
 class GridMap {
 public:
+  // The window starts out covering [origin_x, origin_x + width) x
+  // [origin_y, origin_y + height); its size is rounded up to whole tiles.
   GridMap(double origin_x, double width, double origin_y, double height,
           double meters_per_pixel);
 
@@ -46,8 +58,12 @@ public:
   double metersPerPixel() const { return meters_per_pixel_; }
   int width() const { return width_; }
   int height() const { return height_; }
+  // Coordinate of global cell (0, 0), in meters
   double originX() const { return origin_x_; }
   double originY() const { return origin_y_; }
+  // First global cell of the window
+  int windowX() const { return win_x_; }
+  int windowY() const { return win_y_; }
 
   void getCoord(int xi, int yi, double *x, double *y) const {
     *x = (xi + 0.5) * meters_per_pixel_ + origin_x_;
@@ -55,65 +71,85 @@ public:
   }
 
   void getSubscript(double x, double y, int *xi, int *yi) const {
-    *xi = (x - origin_x_) / meters_per_pixel_;
-    *yi = (y - origin_y_) / meters_per_pixel_;
+    *xi = floor((x - origin_x_) / meters_per_pixel_);
+    *yi = floor((y - origin_y_) / meters_per_pixel_);
   }
 
   bool valid(int xi, int yi) const {
-    return !(xi >= width_ || yi >= height_ || xi < 0 || yi < 0);
+    return !(xi >= win_x_ + width_ || yi >= win_y_ + height_ ||
+             xi < win_x_ || yi < win_y_);
   }
 
+  // Incremented whenever a cell changes
+  unsigned revision() const { return revision_; }
+
   uint8_t get(int xi, int yi) const {
     if (valid(xi, yi)) {
-      int ind = yi * width_ + xi;
-      return grid_[ind];
+      int ind = index(xi, yi);
+      int pending = this->pending(tile(xi, yi));
+      return grid_[ind] > pending ? grid_[ind] - pending : 0;
     } else {
       return 0;
     }
   }
 
+  // Subtract val from every cell, down to 0.  Cells aren't touched here; each
+  // tile keeps how much of the decay it has seen, and the rest is subtracted
+  // when its cells are read, or for good before they're written.
   void decay(int val) {
-    for (int i = 0; i < width_ * height_; ++i) {
-      if (grid_[i] > 0) {
-        if (grid_[i] >= val) {
-          grid_[i] -= val;
-        } else {
-          grid_[i] = 0;
-        }
-        ros_grid_->data[i] = 100 - static_cast<int>(grid_[i] / 2.55);
-      }
-    }
+    ++revision_;
+    decay_total_ += val;
   }
 
-
   void setMax(int xi, int yi, uint8_t val) {
     if (valid(xi, yi)) {
-      int ind = yi * width_ + xi;
+      int ind = index(xi, yi), tile = this->tile(xi, yi);
+      ++revision_;
+      settle(tile);
+      touch(tile);
       grid_[ind] = std::max(val, grid_[ind]);
-      ros_grid_->data[ind] = 100 - static_cast<int>(grid_[ind] / 2.55);
     } else {
-      ROS_WARN("Setting coordinates outside map");
+      // Expected for long beams, which reach past the window
+      ROS_DEBUG_THROTTLE(1.0, "Setting coordinates outside map");
     }
   }
 
+  // setMax() for a size x size block of cells starting at (xi, yi), with
+  // values from stamp, whose rows are stride apart.  Each row must have 16
+  // zero cells before and after it, which can be shared with the rows next
+  // to it.
+  void stampMax(int xi, int yi, const uint8_t *stamp, int size, int stride);
+
   void fill(uint8_t val) {
-    for (int i = 0; i < width_ * height_; ++i) {
-      grid_[i] = val;
-      ros_grid_->data[i] = 100 - static_cast<int>(grid_[i] / 2.55);
-    }
+    ++revision_;
+    memset(grid_, val, width_ * height_);
+    tile_decay_.assign(tile_decay_.size(), decay_total_);
+    tile_revision_.assign(tile_revision_.size(), revision_);
   }
 
+  // Center the window on (x, y), in meters.  Cells that leave the window are
+  // forgotten and cells that enter it are 0; nothing else is touched.
+  void recenter(double x, double y);
+
   void setFrameId(const std::string &frame) {
     ros_grid_->header.frame_id = frame;
   }
 
+  // Pose of the corner of global cell (0, 0); occGrid() offsets it to the
+  // corner of the window
   geometry_msgs::Pose& origin() {
-    return ros_grid_->info.origin;
+    return origin_;
   }
 
-  const nav_msgs::OccupancyGrid& occGrid() const {
-    return *ros_grid_;
-  }
+  // Converted from the grid when it's asked for, rather than on every
+  // change, as it's only needed for publishing.  Covers the window; only
+  // tiles that changed since the last call are converted again.
+  const nav_msgs::OccupancyGrid& occGrid() const;
+
+  // Copy cells [xi, xi + num_x) x [yi, yi + num_y) to out, whose rows are
+  // stride apart.  Cells outside the window are 0, as with get().
+  void copy(int xi, int yi, int num_x, int num_y, uint8_t *out,
+            int stride) const;
 
   // Get likelihood of points for various translations after a rotation.
   //
@@ -132,24 +168,124 @@ public:
   // pose in the map frame.
   //
   // scores[i] scores2d() with theta = delta_t + i * inc_t
+  //
+  // Rotations are scored in parallel if given a pool.
   void scores3D(const Pose2d &pose, const RowMatrix2d &points,
                 int delta_xi, int num_x, int int_y, int num_yi,
                 double delta_t, int num_t, double inc_t,
-                std::vector<Eigen::ArrayXXi> *scores) const;
+                std::vector<Eigen::ArrayXXi> *scores,
+                ThreadPool *pool = NULL) const;
+
+  // Grid coordinates of points after rotating them by theta, as used by
+  // scores2D()
+  void subscripts(const Pose2d &pose, const RowMatrix2d &points, double theta,
+                  std::vector<int> *xis, std::vector<int> *yis) const;
 
 private:
   GridMap() {};
   GridMap(const GridMap &map);
   void operator=(const GridMap&);
 
-  // Lower left coordinate of map in meters
+  // Position of global subscript i in a buffer dimension of size n
+  static int wrap(int i, int n) {
+    int w = i % n;
+    return w < 0 ? w + n : w;
+  }
+
+  // The buffer is split into tiles of 2^kTileBits x 2^kTileBits cells, each
+  // stored row by row in a block of its own: a 4 KB page, whose rows are
+  // cache lines.  Decay and changes are tracked per tile too.  The window is
+  // a whole number of tiles, so an aligned block of global cells always
+  // lands in one tile; blocks of cells are best walked a tile at a time.
+  static const int kTileBits = 6;
+  int tile(int xi, int yi) const {
+    return (wrap(yi, height_) >> kTileBits) * tiles_x_ +
+      (wrap(xi, width_) >> kTileBits);
+  }
+  int index(int xi, int yi) const {
+    const int mask = (1 << kTileBits) - 1;
+    int wx = wrap(xi, width_), wy = wrap(yi, height_);
+    int tile = (wy >> kTileBits) * tiles_x_ + (wx >> kTileBits);
+    return (tile << (2 * kTileBits)) + ((wy & mask) << kTileBits) + (wx & mask);
+  }
+  // Cells of a tile
+  uint8_t* tileData(int tile) const {
+    return grid_ + (tile << (2 * kTileBits));
+  }
+  // Decay not yet subtracted from the cells of a tile
+  int pending(int tile) const {
+    return std::min(decay_total_ - tile_decay_[tile], 255u);
+  }
+  // Subtract pending decay from the cells of a tile
+  void settle(int tile);
+  // Note that cells of a tile changed in this revision
+  void touch(int tile) { tile_revision_[tile] = revision_; }
+
+  // Whether the ros_grid_ cells of a tile are out of date, and bring those
+  // of a row of tiles up to date, with table mapping grid values to them
+  bool rosDirty(int tile) const;
+  void convertRow(int ty, const int8_t *table) const;
+  // Move the ros_grid_ cells that are still in the window to where they are
+  // after the window moved by (dx, dy)
+  void shiftRos(int dx, int dy) const;
+
+  // Set cells [xi, xi + num_x) x [yi, yi + num_y) to 0, wrapping around the
+  // buffer; the block must be no bigger than it
+  void clear(int xi, int yi, int num_x, int num_y);
+
+  // Coordinate of global cell (0, 0) in meters
   double origin_x_, origin_y_;
   double meters_per_pixel_;
-  // Size of grid_ in pixels
+  // Size of grid_ in pixels, and the first global cell it holds
   int width_, height_;
+  int win_x_, win_y_;
   // Probability of occupancy; 0 means 0 probability, 255 means 1.0
   uint8_t *grid_;
+  unsigned revision_;
+  // Sum of all decay, and its value when each tile was last settled
+  unsigned decay_total_;
+  std::vector<unsigned> tile_decay_;
+  // Revision in which each tile last changed, other than by decay
+  std::vector<unsigned> tile_revision_;
+  int tiles_x_;
+  geometry_msgs::Pose origin_;
   boost::scoped_ptr<nav_msgs::OccupancyGrid> ros_grid_;
+  // Revision of the grid, and of each tile, that ros_grid_ was converted
+  // from, with the window and the pending decay of each tile at the time.
+  // Tiles that were all 0 stay that way under more decay.
+  mutable unsigned ros_revision_;
+  mutable std::vector<unsigned> ros_tile_revision_;
+  mutable std::vector<uint8_t> ros_tile_pending_, ros_tile_empty_;
+  mutable int ros_win_x_, ros_win_y_;
+};
+
+// Max-pooled copies of part of a GridMap, used to bound the scores of blocks
+// of translations in branch and bound search.  Cell (xi, yi) of level l holds
+// the max of the map over [xi, xi + 2^l) x [yi, yi + 2^l).
+class GridPyramid {
+public:
+  GridPyramid();
+
+  // Pool cells [min_xi, max_xi] x [min_yi, max_yi] of map.  Does nothing if
+  // they were already pooled from the same revision of the map.
+  void build(const GridMap &map, int min_xi, int min_yi, int max_xi, int max_yi,
+             int levels);
+
+  int levels() const { return levels_.size(); }
+  int stride() const { return stride_; }
+  // Index of cell (xi, yi) in a level; it must be in the pooled box
+  int index(int xi, int yi) const {
+    return (yi - min_yi_) * stride_ + xi - min_xi_;
+  }
+  const uint8_t* level(int l) const { return &levels_[l][0]; }
+
+private:
+  std::vector<std::vector<uint8_t> > levels_;
+  // Pooled box, and where it came from
+  int min_xi_, min_yi_, max_xi_, max_yi_;
+  int stride_;
+  const GridMap *map_;
+  unsigned revision_;
 };
 
 void projectScan(const Pose2d &pose, const sensor_msgs::LaserScan &scan,
@@ -158,6 +294,45 @@ void projectScan(const Pose2d &pose, const sensor_msgs::LaserScan &scan,
 void transformPoints(const Pose2d &pose, const RowMatrix2d &local,
                      RowMatrix2d *points);
 
+// Projects scans into the laser frame and thins the points with a voxel
+// filter, in one pass.  Beam directions and buffers are kept from scan to
+// scan, so nothing is allocated unless the scan's layout changes.
+class ScanProjector {
+public:
+  ScanProjector();
+
+  // Centroids of the points of scan in each leaf_size x leaf_size cell, in
+  // the order their cells were first hit.  Beams outside
+  // [range_min, range_max) are dropped.  Unless all is NULL, it gets every
+  // point in [range_min, range_max] unfiltered, in beam order, as
+  // projectScan() would.
+  void project(const sensor_msgs::LaserScan &scan, double leaf_size,
+               RowMatrix2d *points, RowMatrix2d *all = NULL);
+
+private:
+  // Cell of the hash grid, holding column col of sums_ if it was hit in
+  // this scan
+  struct Cell {
+    int xi, yi;
+    int col;
+    unsigned scan;
+  };
+
+  // Beam directions are for scans with this layout
+  size_t num_beams_;
+  float angle_min_, angle_increment_;
+  std::vector<double> cos_, sin_;
+  // Open addressing hash table of cells, sized to a power of two at least
+  // twice the number of beams, and the number of the current scan
+  std::vector<Cell> cells_;
+  unsigned scan_;
+  // Sum and number of points in each cell hit
+  RowMatrix2d sums_;
+  std::vector<int> counts_;
+  // Every point, for project()'s all
+  RowMatrix2d beams_;
+};
+
 // Estimate robot's position using scans + building local map
 class ScanMatcher {
 public:
@@ -168,7 +343,10 @@ public:
       : range_x(0.1), range_y(0.1), range_t(0.14), inc_t(0.0035),
         grid_res(0.02), sensor_sd(0.02), subsample(3),
         travel_distance(0.2), travel_angle(angles::from_degrees(2.0)),
-        decay_duration(15.0), decay_step(40) {}
+        decay_duration(15.0), decay_step(40), branch_and_bound(true),
+        threads(0), map_size(40.0), min_range_xy(0.04), min_range_t(0.035),
+        odom_noise_xy(0.2), odom_noise_t(0.2), time_budget(0.0),
+        anytime_levels(3) {}
 
     static Params FromROS(ros::NodeHandle &nh) {
       Params p;
@@ -183,21 +361,37 @@ public:
       nh.param("travel_angle", p.travel_angle, p.travel_angle);
       nh.param("decay_duration", p.decay_duration, p.decay_duration);
       nh.param("decay_step", p.decay_step, p.decay_step);
+      nh.param("branch_and_bound", p.branch_and_bound, p.branch_and_bound);
+      nh.param("threads", p.threads, p.threads);
+      nh.param("map_size", p.map_size, p.map_size);
+      nh.param("min_range_xy", p.min_range_xy, p.min_range_xy);
+      nh.param("min_range_t", p.min_range_t, p.min_range_t);
+      nh.param("odom_noise_xy", p.odom_noise_xy, p.odom_noise_xy);
+      nh.param("odom_noise_t", p.odom_noise_t, p.odom_noise_t);
+      nh.param("time_budget", p.time_budget, p.time_budget);
+      nh.param("anytime_levels", p.anytime_levels, p.anytime_levels);
       p.align();
       ROS_INFO("%s", p.string().c_str());
       return p;
     }
 
     std::string string() {
-      char s[400];
+      char s[500];
       sprintf(s,
               "range_x: %.3f range_y: %.3f range_tt: %.3f inc_t: %.3f\n"
               "grid_resolution: %.3f sensor_sd: %0.3f subsample: %i\n"
               "travel_distance: %.3f travel_angle: %0.3f\n"
-              "decay_duration: %.3f decay_step: %i",
+              "decay_duration: %.3f decay_step: %i\n"
+              "branch_and_bound: %i threads: %i map_size: %.1f\n"
+              "min_range_xy: %.3f min_range_t: %.3f odom_noise_xy: %.3f "
+              "odom_noise_t: %.3f\n"
+              "time_budget: %.3f anytime_levels: %i",
               range_x, range_y, range_t, inc_t,
               grid_res, sensor_sd, subsample,
-              travel_distance, travel_angle, decay_duration, decay_step);
+              travel_distance, travel_angle, decay_duration, decay_step,
+              branch_and_bound, threads, map_size,
+              min_range_xy, min_range_t, odom_noise_xy, odom_noise_t,
+              time_budget, anytime_levels);
       return std::string(s);
     }
 
@@ -211,35 +405,157 @@ public:
     double travel_distance, travel_angle;
     double decay_duration;
     int decay_step;
+    // Find the best pose by branch and bound over a GridPyramid rather than
+    // scoring the whole window; both find the same pose
+    bool branch_and_bound;
+    // Threads searching rotations in parallel; 0 means one per core
+    int threads;
+    // Side of the square map kept around the robot, in meters
+    double map_size;
+    // With odometry, the search window is min_range + odom_noise * motion
+    // since the last scan, up to range_x/y/t; motion is distance for x and
+    // y, and rotation for t
+    double min_range_xy, min_range_t;
+    double odom_noise_xy, odom_noise_t;
+    // Seconds matching a scan should take; 0 for no limit.  With a limit,
+    // the window is searched with every 2^(anytime_levels - 1)th point, and
+    // the result refined with twice the points at each finer level, for as
+    // long as the next level is expected to finish in time.  The coarsest
+    // level always runs.
+    double time_budget;
+    int anytime_levels;
 
     void align() {
       range_x = round(range_x / grid_res) * grid_res;
       range_y = round(range_y / grid_res) * grid_res;
       range_t = round(range_t / inc_t) * inc_t;
+      anytime_levels = std::max(anytime_levels, 1);
     }
   };
 
-  ScanMatcher(const Params &p);
+  // Time spent in each stage of a scan, in seconds; stages that didn't run
+  // are 0
+  struct Timing {
+    Timing() : preprocess(0.0), match(0.0), update(0.0) {}
+    // Projecting and filtering the scan for matching
+    double preprocess;
+    // Searching for the best pose
+    double match;
+    // Adding the scan to the map
+    double update;
+  };
+
+  // How far matching a scan got
+  struct MatchInfo {
+    MatchInfo() : quality(0.0), stride(0), points(0), levels(0) {}
+    // Mean likelihood of the points at the pose found, from 0 to 1
+    double quality;
+    // Every stride-th point, points in all, was used at the finest level
+    // reached; 1 is full resolution
+    int stride;
+    int points;
+    // Levels searched; 0 if the scan wasn't matched
+    int levels;
+  };
+
+  // A scan on its way through the stages of addScan().  The stages can run
+  // on different threads, overlapping for consecutive scans (see
+  // LaserOdomNode), as long as each stage sees the scans in order.
+  struct Scan {
+    Scan() : odom(0.0, 0.0, 0.0), odom_valid(false) {}
+    ros::Time stamp;
+    // Motion since the previous scan, as passed to addScan()
+    Pose2d odom;
+    bool odom_valid;
+    // Points in the laser frame; merged for matching, and all of them for
+    // the map, from the same pass over the scan
+    RowMatrix2d match_points, map_points;
+    // Pose of the robot, set by matchScan()
+    Pose2d pose;
+    MatchInfo match;
+    Timing timing;
+  };
+
+  // Unless connect, the debug cloud isn't advertised, so no ROS master is
+  // needed (see laser_odom_bag)
+  ScanMatcher(const Params &p, bool connect = true);
   ~ScanMatcher();
 
   const Pose2d& pose() { return pose_; }
   void setPose(const Pose2d &pose) { pose_ = pose; }
 
-  bool addScan(const Pose2d &odom, const sensor_msgs::LaserScan &scan);
+  // Add a scan, with odom the motion since the last one.  If odom_valid, the
+  // pose is searched for in a window sized to how far off odom might be,
+  // and only if it ends up on the edge in the full window.  Returns true if
+  // the map changed.  Runs preprocess(), matchScan() and update().
+  bool addScan(const Pose2d &odom, const sensor_msgs::LaserScan &scan,
+               bool odom_valid = false);
+
+  // Project and filter a scan; out's odometry is left alone
+  void preprocess(const sensor_msgs::LaserScan &scan, Scan *out);
+  // Find the pose of a scan, starting from the last pose plus its odometry.
+  // The map is only locked while cells are copied out of it.
+  void matchScan(Scan *scan);
+  // Decay the map, and add a scan to it if the robot has moved or it's been
+  // a while; true if the map changed.  The map is locked meanwhile.
+  bool update(Scan *scan);
+
+  // Not synchronized with the stages above; update() locks around it
   void updateMap(const RowMatrix2d &points);
 
+  // Timing and match of the last addScan()
+  const Timing& timing() const { return timing_; }
+  const MatchInfo& matchInfo() const { return match_info_; }
+
+  // When stages run on different threads, only use the map from the thread
+  // calling update()
   const GridMap& map() const { return *map_; }
   GridMap& map() { return *map_; }
 
-  Gaussian3d matchScan(const Pose2d &pose, const sensor_msgs::LaserScan &scan);
+  // Search the current window; its size is set by matchScan()
   Gaussian3d match(const RowMatrix2d &points);
 private:
+  void makeStamp();
+  // Half sizes (x, y, t) of the full search window, and of one sized for
+  // odometry, in steps of grid_res and inc_t
+  Eigen::Vector3i fullWindow() const;
+  Eigen::Vector3i odomWindow(const Pose2d &odom) const;
+  // Whether an update from match() is on the edge of the window
+  bool atEdge(const Eigen::Vector3d &update) const;
+  // Coarse to fine search within the time budget, from start; the update to
+  // pose_ like match()
+  Eigen::Vector3d matchAnytime(const RowMatrix2d &points,
+                               const ros::WallTime &start, MatchInfo *info);
+  // match(), also giving the score of the best pose
+  Eigen::Vector3d search(const RowMatrix2d &points, int *score);
+  // Indices (xi, yi, ti) of the best pose in the window, as in scores3D()
+  Eigen::Vector3i searchExhaustive(const RowMatrix2d &points, int sx, int sy,
+                                   int st, int *score);
+  Eigen::Vector3i searchBranchAndBound(const RowMatrix2d &points, int sx,
+                                       int sy, int st, int *score);
+
   Params p_;
   Pose2d last_scan_pose_; // pose of the last incorporated scan
   Pose2d pose_; // current pose of the robot
   ros::Time last_decay_, last_add_;
-  bool have_scan_;
+  // Whether update() has added a scan to the map yet
+  boost::atomic<bool> have_scan_;
   boost::scoped_ptr<GridMap> map_;
+  // Held while update() changes the map and while matching copies from it
+  boost::mutex map_mutex_;
+  GridPyramid pyramid_;
+  boost::scoped_ptr<ThreadPool> pool_;
+  ScanProjector projector_;
+  Timing timing_;
+  MatchInfo match_info_;
+  Eigen::Vector3i window_;
+  // Recent time taken by each level of matchAnytime(), finest first
+  std::vector<double> level_time_;
+  // Likelihood of cells around a point, added to the map for each point;
+  // stamp_size_ x stamp_size_ with rows stamp_stride_ apart, starting at
+  // stamp_[16], with zeros around them as stampMax() needs
+  std::vector<uint8_t> stamp_;
+  int stamp_size_, stamp_stride_;
   ros::NodeHandle nh_;
   ros::Publisher pub_scan_;
 };
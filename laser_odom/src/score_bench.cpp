@@ -0,0 +1,327 @@
+// Time GridMap::scores3D() against the original scalar scoring loop, with
+// the default search window of ScanMatcher, on a synthetic map, and each
+// version of addScores() that the CPU supports on the same windows.  All must
+// give the same scores.  Then check that ThreadPool runs every task exactly
+// once, and that exhaustive and branch and bound search find the same poses
+// for synthetic scans on 1, 2 and 4 threads.  Mismatches are reported, and
+// make the exit status nonzero.
+//
+// usage: score_bench [points] [trials]
+#include <algorithm>
+#include <cstdlib>
+
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <ros/ros.h>
+
+#include "matcher.hpp"
+#include "score_kernels.hpp"
+
+using namespace std;
+using namespace mrsl;
+
+// GridMap::scores2D() as it was before the vector kernels
+void scoresReference(const GridMap &map, const Pose2d &pose,
+                     const RowMatrix2d &points, int delta_xi, int num_x,
+                     int delta_yi, int num_y, double theta,
+                     Eigen::ArrayXXi *scores) {
+  scores->setZero(num_x, num_y);
+  double ct = cos(theta + pose.t()), st = sin(theta + pose.t());
+  for (int i = 0; i < points.cols(); ++i) {
+    double x = ct * points(0, i) - st * points(1, i) + pose.x();
+    double y = st * points(0, i) + ct * points(1, i) + pose.y();
+    int xi0, yi0;
+    map.getSubscript(x, y, &xi0, &yi0);
+    xi0 += delta_xi;
+    yi0 += delta_yi;
+    for (int dyi = 0; dyi < num_y; ++dyi) {
+      for (int dxi = 0; dxi < num_x; ++dxi) {
+        (*scores)(dxi, dyi) += map.get(xi0 + dxi, yi0 + dyi);
+      }
+    }
+  }
+}
+
+typedef void (*ScoreFn)(const uint8_t*, int, const int*, int, int, int, int*);
+
+struct Kernel {
+  Kernel(const char *name, ScoreFn score)
+    : name(name), score(score), time(0.0), mismatches(0) { }
+  const char *name;
+  ScoreFn score;
+  double time;
+  int mismatches;
+};
+
+// Run each kernel on the cells that the translations of points can reach,
+// copied out of the map the way GridMap::scores3D() does, and compare it
+// with the first
+void compareKernels(const GridMap &map, const Pose2d &pose,
+                    const RowMatrix2d &points, int delta_xi, int num_x,
+                    int delta_yi, int num_y, double theta,
+                    vector<Kernel> *kernels) {
+  vector<int> xis, yis;
+  map.subscripts(pose, points, theta, &xis, &yis);
+  int min_xi = *min_element(xis.begin(), xis.end()) + delta_xi;
+  int min_yi = *min_element(yis.begin(), yis.end()) + delta_yi;
+  int max_xi = *max_element(xis.begin(), xis.end()) + delta_xi;
+  int max_yi = *max_element(yis.begin(), yis.end()) + delta_yi;
+  int num_copy_x = max_xi - min_xi + num_x, num_copy_y = max_yi - min_yi + num_y;
+  int stride = num_copy_x + kScorePadding;
+  vector<uint8_t> local(stride * num_copy_y, 0);
+  map.copy(min_xi, min_yi, num_copy_x, num_copy_y, &local[0], stride);
+  vector<int> corners(xis.size());
+  for (size_t i = 0; i < xis.size(); ++i) {
+    corners[i] = (yis[i] + delta_yi - min_yi) * stride + xis[i] + delta_xi -
+      min_xi;
+  }
+
+  Eigen::ArrayXXi reference;
+  for (size_t k = 0; k < kernels->size(); ++k) {
+    Kernel &kernel = kernels->at(k);
+    Eigen::ArrayXXi scores = Eigen::ArrayXXi::Zero(num_x, num_y);
+    ros::WallTime start = ros::WallTime::now();
+    kernel.score(&local[0], stride, &corners[0], corners.size(), num_x, num_y,
+                 scores.data());
+    kernel.time += (ros::WallTime::now() - start).toSec();
+    if (k == 0) {
+      reference = scores;
+    } else if (!(scores == reference).all()) {
+      ++kernel.mismatches;
+    }
+  }
+}
+
+void countTask(int index, int worker, int threads, boost::atomic<int> *counts,
+               boost::atomic<int> *bad_workers) {
+  if (worker < 0 || worker >= threads) {
+    ++*bad_workers;
+  }
+  ++counts[index];
+  // Uneven tasks, so that workers steal from each other
+  volatile double sum = 0.0;
+  for (int k = 0; k < (index % 7) * 1000; ++k) {
+    sum += k;
+  }
+}
+
+// Run uneven tasks on pools of several sizes; returns the number of runs in
+// which a task didn't run exactly once, or ran on a worker the pool doesn't
+// have
+int checkThreadPool(int runs) {
+  const int kThreads[] = {1, 2, 3, 4, 8};
+  const int kMaxTasks = 100;
+  int failures = 0;
+  for (size_t k = 0; k < sizeof(kThreads) / sizeof(kThreads[0]); ++k) {
+    ThreadPool pool(kThreads[k]);
+    boost::scoped_array<boost::atomic<int> > counts(
+      new boost::atomic<int>[kMaxTasks]);
+    int bad_runs = 0;
+    for (int run = 0; run < runs; ++run) {
+      int n = run % kMaxTasks;
+      for (int i = 0; i < n; ++i) {
+        counts[i] = 0;
+      }
+      boost::atomic<int> bad_workers(0);
+      pool.run(n, boost::bind(countTask, _1, _2, pool.threads(), counts.get(),
+                              &bad_workers));
+      bool ok = bad_workers == 0;
+      for (int i = 0; i < n; ++i) {
+        ok = ok && counts[i] == 1;
+      }
+      if (!ok) {
+        ++bad_runs;
+      }
+    }
+    ROS_INFO("ThreadPool(%i) %i/%i runs missed or repeated a task",
+             kThreads[k], bad_runs, runs);
+    failures += bad_runs;
+  }
+  return failures;
+}
+
+// Range from (x, y) along angle a to the walls of a 16 x 10 m room, or to one
+// of the pillars in it
+double castRay(double x, double y, double a) {
+  const double kPillarX[] = {2.0, -3.0, 5.0, -6.0};
+  const double kPillarY[] = {1.0, -2.0, -3.0, 3.0};
+  const double kPillarRadius = 0.3;
+  double dx = cos(a), dy = sin(a);
+  double range = min(fabs(dx) > 1e-9 ? ((dx > 0 ? 8.0 : -8.0) - x) / dx : 1e9,
+                     fabs(dy) > 1e-9 ? ((dy > 0 ? 5.0 : -5.0) - y) / dy : 1e9);
+  for (int k = 0; k < 4; ++k) {
+    double fx = x - kPillarX[k], fy = y - kPillarY[k];
+    double b = fx * dx + fy * dy;
+    double d = b * b - (fx * fx + fy * fy - kPillarRadius * kPillarRadius);
+    if (d > 0.0 && -b - sqrt(d) > 0.0) {
+      range = min(range, -b - sqrt(d));
+    }
+  }
+  return range;
+}
+
+// Scan of the room from pose, in the laser frame
+RowMatrix2d roomScan(const Pose2d &pose, int num_points) {
+  RowMatrix2d points(2, num_points);
+  for (int i = 0; i < num_points; ++i) {
+    double a = -M_PI + 2.0 * M_PI * i / num_points;
+    double r = castRay(pose.x(), pose.y(), a + pose.t());
+    points(0, i) = r * cos(a);
+    points(1, i) = r * sin(a);
+  }
+  return points;
+}
+
+// Match scans of the room with each search on 1, 2 and 4 threads, from the
+// same prior, and compare the poses found with those of the first; returns
+// the number that differ
+int compareSearches(int scans) {
+  const int kThreads[] = {1, 2, 4};
+  vector<boost::shared_ptr<ScanMatcher> > matchers;
+  vector<string> names;
+  for (size_t k = 0; k < sizeof(kThreads) / sizeof(kThreads[0]); ++k) {
+    for (int bnb = 0; bnb < 2; ++bnb) {
+      ScanMatcher::Params p;
+      p.threads = kThreads[k];
+      p.branch_and_bound = bnb;
+      matchers.push_back(boost::shared_ptr<ScanMatcher>(
+        new ScanMatcher(p, false)));
+      char name[64];
+      snprintf(name, sizeof(name), "%s, %i threads",
+               bnb ? "branch and bound" : "exhaustive", kThreads[k]);
+      names.push_back(name);
+    }
+  }
+
+  // The same map for every matcher, from scans near the middle of the room
+  for (int k = 0; k < 5; ++k) {
+    Pose2d pose(drand48() - 0.5, drand48() - 0.5, 0.1 * (drand48() - 0.5));
+    RowMatrix2d points;
+    transformPoints(pose, roomScan(pose, 720), &points);
+    for (size_t m = 0; m < matchers.size(); ++m) {
+      matchers[m]->updateMap(points);
+    }
+  }
+
+  vector<double> times(matchers.size(), 0.0);
+  vector<int> mismatches(matchers.size(), 0);
+  for (int scan = 0; scan < scans; ++scan) {
+    Pose2d pose(drand48() - 0.5, drand48() - 0.5, 0.1 * (drand48() - 0.5));
+    Pose2d prior(pose.x() + 0.1 * (drand48() - 0.5),
+                 pose.y() + 0.1 * (drand48() - 0.5),
+                 pose.t() + 0.1 * (drand48() - 0.5));
+    RowMatrix2d points = roomScan(pose, 360);
+    Eigen::Vector3d reference;
+    for (size_t m = 0; m < matchers.size(); ++m) {
+      matchers[m]->setPose(prior);
+      ros::WallTime start = ros::WallTime::now();
+      Eigen::Vector3d update = matchers[m]->match(points).mean();
+      times[m] += (ros::WallTime::now() - start).toSec();
+      if (m == 0) {
+        reference = update;
+      } else if (update != reference) {
+        ++mismatches[m];
+      }
+    }
+  }
+
+  int total = 0;
+  for (size_t m = 0; m < matchers.size(); ++m) {
+    ROS_INFO("%-26s %8.3f ms/scan  %i/%i poses differ from %s",
+             names[m].c_str(), 1000.0 * times[m] / scans, mismatches[m], scans,
+             names[0].c_str());
+    total += mismatches[m];
+  }
+  return total;
+}
+
+int main(int argc, char **argv) {
+  int num_points = argc > 1 ? atoi(argv[1]) : 700;
+  int trials = argc > 2 ? atoi(argv[2]) : 20;
+  ScanMatcher::Params p;
+  p.align();
+
+  // Walls of a 16 x 10 m room, blurred the way ScanMatcher::updateMap() does
+  GridMap map(-40, 80.0, -40, 80.0, p.grid_res);
+  map.fill(0);
+  for (double t = 0.0; t < 52.0; t += p.grid_res / 2.0) {
+    double x = t < 16.0 ? t - 8.0 : (t < 26.0 ? 8.0 : (t < 42.0 ? 34.0 - t : -8.0));
+    double y = t < 16.0 ? -5.0 : (t < 26.0 ? t - 21.0 : (t < 42.0 ? 5.0 : 47.0 - t));
+    int xi, yi;
+    map.getSubscript(x, y, &xi, &yi);
+    for (int dy = -3; dy <= 3; ++dy) {
+      for (int dx = -3; dx <= 3; ++dx) {
+        map.setMax(xi + dx, yi + dy, 255.0 * exp(-(dx * dx + dy * dy) / 2.0));
+      }
+    }
+  }
+
+  int sx = round(p.range_x / p.grid_res), sy = round(p.range_y / p.grid_res);
+  int num_x = 2 * sx + 1, num_y = 2 * sy + 1;
+  int num_t = 2 * round(p.range_t / p.inc_t) + 1;
+  double reference_time = 0.0, kernel_time = 0.0;
+  int mismatches = 0;
+  vector<Kernel> kernels;
+  kernels.push_back(Kernel("scalar", addScoresScalar));
+#ifdef SCORE_KERNELS_X86
+  kernels.push_back(Kernel("sse2", addScoresSSE2));
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.push_back(Kernel("avx2", addScoresAVX2));
+  }
+#endif
+  srand48(1);
+  for (int trial = 0; trial < trials; ++trial) {
+    // Points on the walls, seen from near the middle of the room
+    RowMatrix2d points(2, num_points);
+    Pose2d pose(drand48() - 0.5, drand48() - 0.5, 0.2 * (drand48() - 0.5));
+    for (int i = 0; i < num_points; ++i) {
+      double a = 2.0 * M_PI * i / num_points;
+      double r = min(fabs(8.0 / cos(a)), fabs(5.0 / sin(a)));
+      Point2d local = pose.transform_to(Point2d(r * cos(a), r * sin(a)));
+      points(0, i) = local.x();
+      points(1, i) = local.y();
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    vector<Eigen::ArrayXXi> reference(num_t);
+    for (int t = 0; t < num_t; ++t) {
+      scoresReference(map, pose, points, -sx, num_x, -sy, num_y,
+                      -p.range_t + t * p.inc_t, &reference[t]);
+    }
+    ros::WallTime middle = ros::WallTime::now();
+    vector<Eigen::ArrayXXi> scores;
+    map.scores3D(pose, points, -sx, num_x, -sy, num_y,
+                 -p.range_t, num_t, p.inc_t, &scores);
+    ros::WallTime end = ros::WallTime::now();
+
+    reference_time += (middle - start).toSec();
+    kernel_time += (end - middle).toSec();
+    for (int t = 0; t < num_t; ++t) {
+      if (!(scores[t] == reference[t]).all()) {
+        ++mismatches;
+      }
+      compareKernels(map, pose, points, -sx, num_x, -sy, num_y,
+                     -p.range_t + t * p.inc_t, &kernels);
+    }
+  }
+
+  ROS_INFO("%i points, %i x %i x %i window", num_points, num_x, num_y, num_t);
+  ROS_INFO("reference %8.3f ms/scan", 1000.0 * reference_time / trials);
+  ROS_INFO("scores3D  %8.3f ms/scan  %.1fx", 1000.0 * kernel_time / trials,
+           reference_time / kernel_time);
+  ROS_INFO("%i/%i rotations differ", mismatches, trials * num_t);
+  for (size_t k = 0; k < kernels.size(); ++k) {
+    const Kernel &kernel = kernels[k];
+    ROS_INFO("%-9s %8.3f ms/scan  %i/%i rotations differ from %s", kernel.name,
+             1000.0 * kernel.time / trials, kernel.mismatches, trials * num_t,
+             kernels[0].name);
+    mismatches += kernel.mismatches;
+  }
+
+  mismatches += checkThreadPool(2000);
+  mismatches += compareSearches(100);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+#include "score_kernels.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef SCORE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace mrsl {
+
+//============================== Scalar ===================================//
+
+void addScoresScalar(const uint8_t *grid, int stride, const int *corners,
+                     int num_points, int num_x, int num_y, int *scores) {
+  for (int i = 0; i < num_points; ++i) {
+    for (int dyi = 0; dyi < num_y; ++dyi) {
+      const uint8_t *row = grid + corners[i] + dyi * stride;
+      int *out = scores + dyi * num_x;
+      for (int dxi = 0; dxi < num_x; ++dxi) {
+        out[dxi] += row[dxi];
+      }
+    }
+  }
+}
+
+static void maxRowsScalar(uint8_t *dst, int dst_stride, const uint8_t *src,
+                          int src_stride, int num_x, int num_y) {
+  for (int y = 0; y < num_y; ++y) {
+    uint8_t *d = dst + y * dst_stride;
+    const uint8_t *s = src + y * src_stride;
+    for (int x = 0; x < num_x; ++x) {
+      d[x] = std::max(d[x], s[x]);
+    }
+  }
+}
+
+static void subtractRowScalar(uint8_t *dst, const uint8_t *src, int n,
+                              uint8_t value) {
+  for (int x = 0; x < n; ++x) {
+    dst[x] = src[x] > value ? src[x] - value : 0;
+  }
+}
+
+#ifdef SCORE_KERNELS_X86
+
+// Sums of up to this many cells fit in 16 bits
+static const int kBlock = 65535 / 255;
+
+// Add the first n of 16 sums to out
+static inline void widenAdd(const uint16_t *sums, int n, int *out) {
+  for (int k = 0; k < n; ++k) {
+    out[k] += sums[k];
+  }
+}
+
+//=============================== SSE2 ====================================//
+
+// For each row of translations, 16 at a time, the rows of every point are
+// loaded and summed in 16 bit lanes held in registers; sums are widened and
+// added to scores every kBlock points, before they can overflow.
+void addScoresSSE2(const uint8_t *grid, int stride, const int *corners,
+                   int num_points, int num_x, int num_y, int *scores) {
+  const __m128i zero = _mm_setzero_si128();
+  uint16_t sums[16] __attribute__((aligned(16)));
+  for (int dyi = 0; dyi < num_y; ++dyi) {
+    const uint8_t *rows = grid + dyi * stride;
+    for (int dxi = 0; dxi < num_x; dxi += 16) {
+      int n = std::min(16, num_x - dxi);
+      for (int begin = 0; begin < num_points; begin += kBlock) {
+        int end = std::min(begin + kBlock, num_points);
+        __m128i lo = zero, hi = zero;
+        for (int i = begin; i < end; ++i) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(rows + corners[i] + dxi));
+          lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+          hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+        }
+        _mm_store_si128((__m128i*)sums, lo);
+        _mm_store_si128((__m128i*)(sums + 8), hi);
+        widenAdd(sums, n, scores + dyi * num_x + dxi);
+      }
+    }
+  }
+}
+
+static void maxRowsSSE2(uint8_t *dst, int dst_stride, const uint8_t *src,
+                        int src_stride, int num_x, int num_y) {
+  for (int y = 0; y < num_y; ++y) {
+    uint8_t *d = dst + y * dst_stride;
+    const uint8_t *s = src + y * src_stride;
+    int x = 0;
+    for (; x + 16 <= num_x; x += 16) {
+      __m128i v = _mm_max_epu8(_mm_loadu_si128((const __m128i*)(d + x)),
+                               _mm_loadu_si128((const __m128i*)(s + x)));
+      _mm_storeu_si128((__m128i*)(d + x), v);
+    }
+    maxRowsScalar(d + x, 0, s + x, 0, num_x - x, 1);
+  }
+}
+
+static void subtractRowSSE2(uint8_t *dst, const uint8_t *src, int n,
+                            uint8_t value) {
+  const __m128i v = _mm_set1_epi8(value);
+  int x = 0;
+  for (; x + 16 <= n; x += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + x));
+    _mm_storeu_si128((__m128i*)(dst + x), _mm_subs_epu8(s, v));
+  }
+  subtractRowScalar(dst + x, src + x, n - x, value);
+}
+
+//=============================== AVX2 ====================================//
+
+// As addScoresSSE2(), with the 16 sums in one register
+__attribute__((target("avx2")))
+void addScoresAVX2(const uint8_t *grid, int stride, const int *corners,
+                   int num_points, int num_x, int num_y, int *scores) {
+  uint16_t sums[16] __attribute__((aligned(32)));
+  for (int dyi = 0; dyi < num_y; ++dyi) {
+    const uint8_t *rows = grid + dyi * stride;
+    for (int dxi = 0; dxi < num_x; dxi += 16) {
+      int n = std::min(16, num_x - dxi);
+      for (int begin = 0; begin < num_points; begin += kBlock) {
+        int end = std::min(begin + kBlock, num_points);
+        __m256i sum = _mm256_setzero_si256();
+        for (int i = begin; i < end; ++i) {
+          __m128i v = _mm_loadu_si128((const __m128i*)(rows + corners[i] + dxi));
+          sum = _mm256_add_epi16(sum, _mm256_cvtepu8_epi16(v));
+        }
+        _mm256_store_si256((__m256i*)sums, sum);
+        widenAdd(sums, n, scores + dyi * num_x + dxi);
+      }
+    }
+  }
+}
+
+#endif // SCORE_KERNELS_X86
+
+//============================= Dispatch ==================================//
+
+void addScores(const uint8_t *grid, int stride, const int *corners,
+               int num_points, int num_x, int num_y, int *scores) {
+#ifdef SCORE_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    addScoresAVX2(grid, stride, corners, num_points, num_x, num_y, scores);
+  } else {
+    addScoresSSE2(grid, stride, corners, num_points, num_x, num_y, scores);
+  }
+#else
+  addScoresScalar(grid, stride, corners, num_points, num_x, num_y, scores);
+#endif
+}
+
+void maxRows(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+             int num_x, int num_y) {
+#ifdef SCORE_KERNELS_X86
+  maxRowsSSE2(dst, dst_stride, src, src_stride, num_x, num_y);
+#else
+  maxRowsScalar(dst, dst_stride, src, src_stride, num_x, num_y);
+#endif
+}
+
+void subtractRow(uint8_t *dst, const uint8_t *src, int n, uint8_t value) {
+  if (value == 0) {
+    if (dst != src) {
+      memcpy(dst, src, n);
+    }
+    return;
+  }
+#ifdef SCORE_KERNELS_X86
+  subtractRowSSE2(dst, src, n, value);
+#else
+  subtractRowScalar(dst, src, n, value);
+#endif
+}
+
+} // end namespace mrsl
@@ -0,0 +1,43 @@
+#ifndef SCORE_KERNELS_HPP
+#define SCORE_KERNELS_HPP
+
+#include <stdint.h>
+
+namespace mrsl {
+
+// Scan matching and map update kernels.  Each has an SSE2 version on x86,
+// addScores() also an AVX2 one picked at runtime, and a scalar version used
+// everywhere else; all of them give identical results.
+
+// Add the grid values under translated points to scores.  For translation
+// (dxi, dyi), point i lands on grid[corners[i] + dyi * stride + dxi], and its
+// score is scores[dxi + dyi * num_x] (the layout of an Eigen::ArrayXXi with
+// num_x rows).  There are no bounds checks; the grid must be readable up to
+// kScorePadding cells past the end of every translated row.
+void addScores(const uint8_t *grid, int stride, const int *corners,
+               int num_points, int num_x, int num_y, int *scores);
+
+// Translations are scored 16 at a time
+const int kScorePadding = 16;
+
+// dst[x] = max(dst[x], src[x]) over num_y rows of num_x cells
+void maxRows(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+             int num_x, int num_y);
+
+// dst[x] = max(src[x] - value, 0) for n cells; dst may be src
+void subtractRow(uint8_t *dst, const uint8_t *src, int n, uint8_t value);
+
+// The versions of addScores() picked between above, for comparing them (see
+// score_bench).  The AVX2 one must only be called if the CPU supports it.
+void addScoresScalar(const uint8_t *grid, int stride, const int *corners,
+                     int num_points, int num_x, int num_y, int *scores);
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCORE_KERNELS_X86
+void addScoresSSE2(const uint8_t *grid, int stride, const int *corners,
+                   int num_points, int num_x, int num_y, int *scores);
+void addScoresAVX2(const uint8_t *grid, int stride, const int *corners,
+                   int num_points, int num_x, int num_y, int *scores);
+#endif
+
+} // end namespace mrsl
+#endif
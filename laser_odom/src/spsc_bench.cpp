@@ -0,0 +1,166 @@
+// Stress SpscQueue.  Values are streamed through a small queue with both
+// threads pausing now and then, and bounced back and forth between two
+// queues, so that nearly every pop() goes to sleep and has to be woken by a
+// push().  Values must arrive exactly once and in order, and a consumer
+// waiting on an empty queue must wake when it's closed.  A thread left
+// asleep stalls the test; that's reported after a few seconds, and like
+// lost or reordered values makes the exit status nonzero.
+//
+// usage: spsc_bench [values] [round trips]
+#include <cstdlib>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <ros/ros.h>
+
+#include "spsc_queue.hpp"
+
+using namespace mrsl;
+
+// Seconds without progress before a test is taken to be stalled
+static const double kStallTime = 5.0;
+
+// Values received or round trips made by any test so far
+static boost::atomic<long> g_progress(0);
+
+void produce(SpscQueue<long> *queue, long count) {
+  for (long value = 1; value <= count; ++value) {
+    while (!queue->push(value)) {
+      boost::this_thread::yield();
+    }
+    if (value % 5003 == 0) {
+      boost::this_thread::sleep(boost::posix_time::microseconds(50));
+    }
+  }
+  queue->close();
+}
+
+// Take values from queue until it's closed, counting those that don't follow
+// the one before
+void consume(SpscQueue<long> *queue, long *received, long *out_of_order) {
+  long value, expected = 1;
+  while (queue->pop(&value)) {
+    if (value != expected) {
+      ++*out_of_order;
+    }
+    expected = value + 1;
+    ++*received;
+    ++g_progress;
+    if (value % 997 == 0) {
+      boost::this_thread::yield();
+    } else if (value % 10007 == 0) {
+      boost::this_thread::sleep(boost::posix_time::microseconds(50));
+    }
+  }
+}
+
+// Send each request back as a reply
+void echo(SpscQueue<long> *requests, SpscQueue<long> *replies) {
+  long value;
+  while (requests->pop(&value)) {
+    replies->push(value);
+  }
+  replies->close();
+}
+
+// Send values one at a time, waiting for each to come back
+void ping(SpscQueue<long> *requests, SpscQueue<long> *replies, long trips,
+          long *wrong) {
+  long value;
+  for (long trip = 1; trip <= trips; ++trip) {
+    requests->push(trip);
+    if (!replies->pop(&value) || value != trip) {
+      ++*wrong;
+    }
+    ++g_progress;
+  }
+  requests->close();
+  if (replies->pop(&value)) {
+    ++*wrong;
+  }
+}
+
+void waitForClose(SpscQueue<long> *queue, long *popped) {
+  long value;
+  while (queue->pop(&value)) {
+    ++*popped;
+  }
+  ++g_progress;
+}
+
+// Join thread, or give up on the whole test if nothing makes progress for
+// kStallTime
+void join(boost::thread *thread, const char *test) {
+  long last = g_progress;
+  ros::WallTime last_change = ros::WallTime::now();
+  while (!thread->timed_join(boost::posix_time::milliseconds(100))) {
+    ros::WallTime now = ros::WallTime::now();
+    if (g_progress != last) {
+      last = g_progress;
+      last_change = now;
+    } else if ((now - last_change).toSec() > kStallTime) {
+      ROS_ERROR("%s stalled for %.0f s; a wakeup was lost", test, kStallTime);
+      // The stalled threads can't be joined
+      exit(1);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  long values = argc > 1 ? atol(argv[1]) : 1000000;
+  long trips = argc > 2 ? atol(argv[2]) : 200000;
+  int failures = 0;
+
+  // Small enough that the producer often finds the queue full, and the
+  // consumer often finds it empty
+  SpscQueue<long> stream(4);
+  long received = 0, out_of_order = 0;
+  ros::WallTime start = ros::WallTime::now();
+  boost::thread consumer(boost::bind(consume, &stream, &received,
+                                     &out_of_order));
+  boost::thread producer(boost::bind(produce, &stream, values));
+  join(&producer, "Streaming");
+  join(&consumer, "Streaming");
+  double stream_time = (ros::WallTime::now() - start).toSec();
+  ROS_INFO("Streaming  %8.1f ns/value   %li/%li received, %li out of order",
+           1e9 * stream_time / values, received, values, out_of_order);
+  if (received != values || out_of_order != 0) {
+    ++failures;
+  }
+
+  SpscQueue<long> requests(1), replies(1);
+  long wrong = 0;
+  start = ros::WallTime::now();
+  boost::thread echoer(boost::bind(echo, &requests, &replies));
+  boost::thread pinger(boost::bind(ping, &requests, &replies, trips, &wrong));
+  join(&pinger, "Ping pong");
+  join(&echoer, "Ping pong");
+  double trip_time = (ros::WallTime::now() - start).toSec();
+  ROS_INFO("Ping pong  %8.1f us/trip    %li/%li wrong", 1e6 * trip_time / trips,
+           wrong, trips);
+  if (wrong != 0) {
+    ++failures;
+  }
+
+  // close() from another thread has to wake a consumer that's asleep, or
+  // about to go to sleep
+  const int kCloses = 1000;
+  long popped = 0;
+  for (int k = 0; k < kCloses; ++k) {
+    SpscQueue<long> queue(4);
+    boost::thread waiter(boost::bind(waitForClose, &queue, &popped));
+    if (k % 2 == 0) {
+      boost::this_thread::sleep(boost::posix_time::microseconds(100));
+    }
+    queue.close();
+    join(&waiter, "Close");
+  }
+  ROS_INFO("Close      %i/%i woken, %li values from empty queues", kCloses,
+           kCloses, popped);
+  if (popped != 0) {
+    ++failures;
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <cstddef>
+
+#include <boost/atomic.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/thread.hpp>
+
+namespace mrsl {
+
+// Bounded queue handing values from one producer thread to one consumer
+// thread.  Values go through a lock-free ring; the mutex is only taken to
+// wake a consumer that found the queue empty and went to sleep.
+template <typename T>
+class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity)
+    : queue_(capacity), waiting_(false), closed_(false) {}
+
+  // False if the queue is full; value is left alone then
+  bool push(const T &value) {
+    if (!queue_.push(value)) {
+      return false;
+    }
+    // Pairs with the fence in pop(): either the consumer sees the value, or
+    // this sees it waiting
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    if (waiting_.load(boost::memory_order_relaxed)) {
+      boost::mutex::scoped_lock lock(mutex_);
+      ready_.notify_one();
+    }
+    return true;
+  }
+
+  bool tryPop(T *value) {
+    return queue_.pop(*value);
+  }
+
+  // Wait for a value; false once the queue is closed and empty
+  bool pop(T *value) {
+    if (queue_.pop(*value)) {
+      return true;
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    while (true) {
+      waiting_.store(true, boost::memory_order_relaxed);
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      if (queue_.pop(*value)) {
+        waiting_.store(false, boost::memory_order_relaxed);
+        return true;
+      }
+      if (closed_) {
+        waiting_.store(false, boost::memory_order_relaxed);
+        return false;
+      }
+      ready_.wait(lock);
+    }
+  }
+
+  // Wake the consumer; pop() fails once the queue is empty.  Either thread
+  // may call it.
+  void close() {
+    boost::mutex::scoped_lock lock(mutex_);
+    closed_ = true;
+    ready_.notify_all();
+  }
+
+private:
+  SpscQueue(const SpscQueue&);
+  void operator=(const SpscQueue&);
+
+  boost::lockfree::spsc_queue<T> queue_;
+  boost::atomic<bool> waiting_;
+  boost::mutex mutex_;
+  boost::condition_variable ready_;
+  bool closed_;
+};
+
+} // end namespace mrsl
+#endif
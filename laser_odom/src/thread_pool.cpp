@@ -0,0 +1,108 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+namespace mrsl {
+
+ThreadPool::ThreadPool(int threads)
+  : num_workers_(std::max(threads, 1)), shares_(new Share[num_workers_]),
+    task_(NULL), generation_(0), running_(0), stop_(false) {
+  for (int w = 0; w < num_workers_; ++w) {
+    shares_[w].begin = shares_[w].end = 0;
+  }
+  for (int w = 1; w < num_workers_; ++w) {
+    threads_.create_thread(boost::bind(&ThreadPool::work, this, w));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_ = true;
+  }
+  start_.notify_all();
+  threads_.join_all();
+}
+
+void ThreadPool::run(int n, const Task &task) {
+  if (num_workers_ == 1 || n <= 1) {
+    for (int i = 0; i < n; ++i) {
+      task(i, 0);
+    }
+    return;
+  }
+
+  for (int w = 0; w < num_workers_; ++w) {
+    boost::mutex::scoped_lock lock(shares_[w].mutex);
+    shares_[w].begin = long(n) * w / num_workers_;
+    shares_[w].end = long(n) * (w + 1) / num_workers_;
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    task_ = &task;
+    running_ = num_workers_ - 1;
+    ++generation_;
+  }
+  start_.notify_all();
+
+  drain(0);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  while (running_ > 0) {
+    done_.wait(lock);
+  }
+  task_ = NULL;
+}
+
+bool ThreadPool::next(int worker, int *index) {
+  {
+    Share &own = shares_[worker];
+    boost::mutex::scoped_lock lock(own.mutex);
+    if (own.begin < own.end) {
+      *index = own.begin++;
+      return true;
+    }
+  }
+  for (int k = 1; k < num_workers_; ++k) {
+    Share &other = shares_[(worker + k) % num_workers_];
+    boost::mutex::scoped_lock lock(other.mutex);
+    if (other.begin < other.end) {
+      *index = --other.end;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::drain(int worker) {
+  int index;
+  while (next(worker, &index)) {
+    (*task_)(index, worker);
+  }
+}
+
+void ThreadPool::work(int worker) {
+  int generation = 0;
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (!stop_ && generation_ == generation) {
+      start_.wait(lock);
+    }
+    if (stop_) {
+      return;
+    }
+    generation = generation_;
+
+    lock.unlock();
+    drain(worker);
+    lock.lock();
+
+    if (--running_ == 0) {
+      done_.notify_all();
+    }
+  }
+}
+
+} // end namespace mrsl
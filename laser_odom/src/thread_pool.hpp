@@ -0,0 +1,59 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread.hpp>
+
+namespace mrsl {
+
+// Persistent worker threads for running many small, independent tasks, such
+// as scoring each rotation of a scan.  Each run() splits the task indices
+// evenly between the workers; a worker that runs out steals indices from the
+// end of another's share, so uneven tasks still keep every thread busy.
+class ThreadPool {
+public:
+  // Task index and the worker (0 to threads() - 1) running it, for picking
+  // per thread buffers
+  typedef boost::function<void(int, int)> Task;
+
+  // With threads <= 1 tasks run on the calling thread
+  explicit ThreadPool(int threads);
+  ~ThreadPool();
+
+  int threads() const { return num_workers_; }
+
+  // Run task(i, worker) for i in [0, n) and wait for all of them.  The
+  // calling thread is worker 0.
+  void run(int n, const Task &task);
+
+private:
+  ThreadPool(const ThreadPool&);
+  void operator=(const ThreadPool&);
+
+  // Indices [begin, end) left in one worker's share
+  struct Share {
+    boost::mutex mutex;
+    int begin, end;
+  };
+
+  bool next(int worker, int *index);
+  void drain(int worker);
+  void work(int worker);
+
+  int num_workers_;
+  boost::scoped_array<Share> shares_;
+  boost::thread_group threads_;
+
+  boost::mutex mutex_;
+  boost::condition_variable start_, done_;
+  const Task *task_;
+  int generation_;
+  int running_; // helper threads still working on this generation
+  bool stop_;
+};
+
+} // end namespace mrsl
+#endif